@@ -0,0 +1,39 @@
+#include <icsc.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "sensors.h"
+
+// Each handler gets its message already decoded from the payload.
+void readingReceived(icsc_ptr icsc, unsigned char from, const sensors_Reading_t *r) {
+    printf("Station %d channel %d reads %d (scale %f)\n", from, r->channel, r->value, r->scale);
+}
+
+void setPointReceived(icsc_ptr icsc, unsigned char from, const sensors_SetPoint_t *sp) {
+    printf("Station %d set channel %d to %d..%d\n", from, sp->channel, sp->low, sp->high);
+}
+
+static const sensors_handlers_t handlers = {
+    .Reading = readingReceived,
+    .SetPoint = setPointReceived,
+};
+
+int main(void) {
+    sensors_SetPoint_t sp = { .channel = 2, .low = -40, .high = 85, .name = "outside" };
+
+    // Station 50, GPIO49 = DE (BBB pin 23), 115200 baud, /dev/ttyO1 (BBB pins 24/26)
+    icsc_ptr icsc = icsc_init_de("/dev/ttyO1", B115200, 50, 49);
+    if (icsc == NULL) {
+        exit(-1);
+    }
+
+    sensors_register(icsc, &handlers);
+
+    // Packed straight into the frame buffer in little-endian order.
+    sensors_send_SetPoint(icsc, 100, &sp);
+
+    sleep(10);
+    icsc_close(icsc);
+    return 0;
+}
@@ -0,0 +1,352 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "icsc.h"
+#include "icsc_private.h"
+#include "config.h"
+
+// An ICSC_SYS_AGGR payload is a run of records, each a command byte, a
+// length byte and that many bytes of data.
+#define AGGR_RECORD_HEADER 2
+
+// Messages waiting for one destination. due is when the oldest of them
+// has waited the coalescing delay, or 0 if there are none. sending is set
+// while a frame for the station is being written, so the next one waits
+// for it instead of overtaking it.
+struct icsc_aggr_buf {
+    uint64_t due;
+    int sending;
+    uint8_t count;
+    uint8_t len;
+    char data[255];
+};
+
+struct icsc_aggr {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    pthread_cond_t sent;
+    pthread_t thread;
+    int running;
+    unsigned long delay;
+    uint8_t maxLen;
+    struct icsc_aggr_buf *bufs[256];
+};
+
+// Send what is waiting for a station. Called with the mutex held; the
+// buffer is copied so the send itself happens without it.
+static int icsc_aggr_send(icsc_ptr icsc, struct icsc_aggr *a, uint8_t station) {
+    struct icsc_aggr_buf *b = a->bufs[station];
+    char data[255];
+    uint8_t count;
+    uint8_t len;
+    int rc;
+
+    while (b->sending) {
+        pthread_cond_wait(&a->sent, &a->mutex);
+    }
+
+    count = b->count;
+    len = b->len;
+    if (count == 0) {
+        return 0;
+    }
+
+    memcpy(data, b->data, len);
+    b->count = 0;
+    b->len = 0;
+    b->due = 0;
+    b->sending = 1;
+
+    pthread_mutex_unlock(&a->mutex);
+    if (count == 1) {
+        // A container for one message only adds overhead.
+        rc = icsc_send_raw(icsc, icsc->station, station, data[0], len - AGGR_RECORD_HEADER, data + AGGR_RECORD_HEADER);
+    } else {
+        rc = icsc_send_raw(icsc, icsc->station, station, ICSC_SYS_AGGR, len, data);
+    }
+    pthread_mutex_lock(&a->mutex);
+    b->sending = 0;
+    pthread_cond_broadcast(&a->sent);
+    return rc;
+}
+
+// Send everything that is due at now, or everything if now is 0. Returns
+// when the next buffer falls due, or 0 if none are waiting.
+static uint64_t icsc_aggr_flush_due(icsc_ptr icsc, struct icsc_aggr *a, uint64_t now) {
+    uint64_t next = 0;
+    int i;
+
+    for (i = 0; i < 256; i++) {
+        if (a->bufs[i] == NULL || a->bufs[i]->due == 0) {
+            continue;
+        }
+        if (now == 0 || a->bufs[i]->due <= now) {
+            icsc_aggr_send(icsc, a, i);
+        }
+        // The send dropped the lock, so more may have arrived.
+        if (a->bufs[i]->due != 0 && (next == 0 || a->bufs[i]->due < next)) {
+            next = a->bufs[i]->due;
+        }
+    }
+    return next;
+}
+
+static void *icsc_aggr_thread(void *arg) {
+    icsc_ptr icsc = (icsc_ptr)arg;
+    struct icsc_aggr *a = icsc->aggr;
+    struct timespec ts;
+    uint64_t next;
+
+    icsc_debug("Aggregation thread executing\n");
+
+    pthread_mutex_lock(&a->mutex);
+    while (a->running) {
+        next = icsc_aggr_flush_due(icsc, a, icsc_micros());
+        if (next == 0) {
+            pthread_cond_wait(&a->cond, &a->mutex);
+        } else {
+            ts.tv_sec = next / 1000000;
+            ts.tv_nsec = (next % 1000000) * 1000;
+            pthread_cond_timedwait(&a->cond, &a->mutex, &ts);
+        }
+    }
+    pthread_mutex_unlock(&a->mutex);
+
+    icsc_debug("Aggregation thread finishing\n");
+    return NULL;
+}
+
+int icsc_aggregate(icsc_ptr icsc, unsigned long delay, uint8_t maxLen) {
+    struct icsc_aggr *a;
+    pthread_condattr_t attr;
+
+    if (icsc == NULL) {
+        return -1;
+    }
+
+    if (maxLen == 0) {
+        maxLen = 255;
+    }
+    if (maxLen < AGGR_RECORD_HEADER + 1) {
+        return -1;
+    }
+
+    if (icsc->aggr != NULL) {
+        a = icsc->aggr;
+        pthread_mutex_lock(&a->mutex);
+        a->delay = delay;
+        a->maxLen = maxLen;
+        pthread_cond_signal(&a->cond);
+        pthread_mutex_unlock(&a->mutex);
+        return 0;
+    }
+
+    a = (struct icsc_aggr *)calloc(1, sizeof(struct icsc_aggr));
+    if (a == NULL) {
+        icsc_error("Cannot allocate aggregation: %s\n", strerror(errno));
+        return -1;
+    }
+    a->delay = delay;
+    a->maxLen = maxLen;
+
+    pthread_mutex_init(&a->mutex, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&a->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_cond_init(&a->sent, NULL);
+
+    icsc->aggr = a;
+
+    // Without a read thread the application's loop sends them instead.
+    if (icsc->threadless) {
+        return 0;
+    }
+
+    a->running = 1;
+    if (pthread_create(&a->thread, NULL, icsc_aggr_thread, icsc) != 0) {
+        icsc_error("Cannot start aggregation thread: %s\n", strerror(errno));
+        a->running = 0;
+        icsc_aggr_free(icsc);
+        return -1;
+    }
+    return 0;
+}
+
+int icsc_queue_array(icsc_ptr icsc, uint8_t station, char command, uint8_t len, const char *data) {
+    struct icsc_aggr *a;
+    struct icsc_aggr_buf *b;
+    int rc = 0;
+
+    if (icsc == NULL || icsc->aggr == NULL) {
+        return -1;
+    }
+
+    a = icsc->aggr;
+
+    // The receiver would hand these to the callbacks, not handle them.
+    if ((uint8_t)command >= ICSC_SYS_PING && (uint8_t)command <= ICSC_SYS_BULK_NACK) {
+        icsc_error("System command 0x%02x cannot be aggregated\n", (uint8_t)command);
+        return -1;
+    }
+
+    pthread_mutex_lock(&a->mutex);
+
+    b = a->bufs[station];
+    if (b == NULL) {
+        b = (struct icsc_aggr_buf *)calloc(1, sizeof(struct icsc_aggr_buf));
+        if (b == NULL) {
+            pthread_mutex_unlock(&a->mutex);
+            icsc_error("Cannot allocate aggregation buffer: %s\n", strerror(errno));
+            return -1;
+        }
+        a->bufs[station] = b;
+    }
+
+    // Too big to share a frame with anything. What is already waiting for
+    // the station goes first, and nothing may overtake it while it is sent.
+    if (len + AGGR_RECORD_HEADER > a->maxLen) {
+        while (b->count != 0 || b->sending) {
+            if (icsc_aggr_send(icsc, a, station) < 0) {
+                rc = -1;
+            }
+        }
+        b->sending = 1;
+        pthread_mutex_unlock(&a->mutex);
+
+        if (icsc_send_array(icsc, station, command, len, data) < 0) {
+            rc = -1;
+        }
+
+        pthread_mutex_lock(&a->mutex);
+        b->sending = 0;
+        pthread_cond_broadcast(&a->sent);
+        pthread_mutex_unlock(&a->mutex);
+        return rc;
+    }
+
+    // Sending drops the lock, so check again afterwards.
+    while (b->len + AGGR_RECORD_HEADER + len > a->maxLen) {
+        if (icsc_aggr_send(icsc, a, station) < 0) {
+            rc = -1;
+        }
+    }
+
+    b->data[b->len] = command;
+    b->data[b->len + 1] = len;
+    memcpy(&b->data[b->len + AGGR_RECORD_HEADER], data, len);
+    b->len += AGGR_RECORD_HEADER + len;
+    b->count++;
+
+    if (b->len + AGGR_RECORD_HEADER > a->maxLen) {
+        // Nothing more would fit.
+        if (icsc_aggr_send(icsc, a, station) < 0) {
+            rc = -1;
+        }
+    } else if (b->due == 0) {
+        b->due = icsc_micros() + a->delay;
+        pthread_cond_signal(&a->cond);
+    }
+
+    pthread_mutex_unlock(&a->mutex);
+    return rc;
+}
+
+int icsc_flush(icsc_ptr icsc) {
+    struct icsc_aggr *a;
+
+    if (icsc == NULL || icsc->aggr == NULL) {
+        return -1;
+    }
+
+    a = icsc->aggr;
+    pthread_mutex_lock(&a->mutex);
+    icsc_aggr_flush_due(icsc, a, 0);
+    pthread_mutex_unlock(&a->mutex);
+    return 0;
+}
+
+void icsc_aggr_poll(icsc_ptr icsc) {
+    struct icsc_aggr *a = icsc->aggr;
+
+    pthread_mutex_lock(&a->mutex);
+    icsc_aggr_flush_due(icsc, a, icsc_micros());
+    pthread_mutex_unlock(&a->mutex);
+}
+
+uint64_t icsc_aggr_next(icsc_ptr icsc) {
+    struct icsc_aggr *a = icsc->aggr;
+    uint64_t next = 0;
+    int i;
+
+    pthread_mutex_lock(&a->mutex);
+    for (i = 0; i < 256; i++) {
+        if (a->bufs[i] != NULL && a->bufs[i]->due != 0 && (next == 0 || a->bufs[i]->due < next)) {
+            next = a->bufs[i]->due;
+        }
+    }
+    pthread_mutex_unlock(&a->mutex);
+    return next;
+}
+
+void icsc_aggr_split(icsc_ptr icsc, uint8_t station, uint8_t sender, uint8_t len, char *data) {
+    char copy[255];
+    char *slot;
+    uint8_t rlen;
+    int pos = 0;
+
+    // The frame may be sitting in the receive slot that the first record
+    // claims, so split a copy of it.
+    memcpy(copy, data, len);
+    data = copy;
+
+    while (pos + AGGR_RECORD_HEADER <= len) {
+        rlen = data[pos + 1];
+        if (pos + AGGR_RECORD_HEADER + rlen > len) {
+            icsc_debug("Aggregate frame from %d is truncated\n", sender);
+            break;
+        }
+
+        if (icsc_dispatch(icsc, station, sender, data[pos], rlen, data + pos + AGGR_RECORD_HEADER, 0) &&
+            icsc->recvQueue != NULL && (slot = icsc_recv_claim(icsc)) != NULL) {
+            memcpy(slot, data + pos + AGGR_RECORD_HEADER, rlen);
+            icsc_recv_publish(icsc, station, sender, data[pos], rlen);
+        }
+
+        pos += AGGR_RECORD_HEADER + rlen;
+    }
+}
+
+void icsc_aggr_free(icsc_ptr icsc) {
+    struct icsc_aggr *a = icsc->aggr;
+    int running;
+    int i;
+
+    if (a == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&a->mutex);
+    running = a->running;
+    a->running = 0;
+    pthread_cond_signal(&a->cond);
+    pthread_mutex_unlock(&a->mutex);
+
+    if (running) {
+        pthread_join(a->thread, NULL);
+    }
+
+    for (i = 0; i < 256; i++) {
+        free(a->bufs[i]);
+    }
+
+    pthread_mutex_destroy(&a->mutex);
+    pthread_cond_destroy(&a->cond);
+    pthread_cond_destroy(&a->sent);
+    free(a);
+    icsc->aggr = NULL;
+}
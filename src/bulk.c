@@ -0,0 +1,476 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <endian.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "icsc.h"
+#include "icsc_private.h"
+#include "config.h"
+
+// The first byte of every ICSC_SYS_BULK payload says what it is. All
+// values are little-endian.
+#define BULK_DATA   1   // id, index u16, total u16, size u32, data
+#define BULK_POLL   2   // id, total u16, size u32, first station, last station
+
+#define BULK_HEADER     10
+#define BULK_FRAGMENT   (255 - BULK_HEADER)
+#define BULK_POLL_LEN   10
+
+// An ICSC_SYS_BULK_NACK payload is the transfer id, the first fragment it
+// covers (a multiple of 8) and a map of the fragments from there that are
+// missing. Receivers missing more than that ask for the rest next round.
+#define BULK_NACK_MAP   32
+#define BULK_NACK_LEN   (3 + BULK_NACK_MAP)
+
+struct icsc_bulk {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+
+    // Receiving: the caller's buffer and which fragments have arrived.
+    uint8_t *buffer;
+    uint32_t max;
+    int active;
+    uint8_t sender;
+    uint8_t id;
+    uint16_t total;
+    uint32_t size;
+    uint16_t count;
+    uint8_t *have;
+    uint64_t nackDue;
+
+    // Sending: the fragments still to go out in this round or the next.
+    int sending;
+    uint8_t sendId;
+    uint16_t sendTotal;
+    uint8_t *missing;
+};
+
+#define MAP_SET(map, n) ((map)[(n) >> 3] |= (1 << ((n) & 7)))
+#define MAP_CLEAR(map, n) ((map)[(n) >> 3] &= ~(1 << ((n) & 7)))
+#define MAP_BIT(map, n) ((map)[(n) >> 3] & (1 << ((n) & 7)))
+
+static struct icsc_bulk *icsc_bulk_get(icsc_ptr icsc) {
+    struct icsc_bulk *b;
+    pthread_condattr_t attr;
+
+    if (icsc->bulk != NULL) {
+        return icsc->bulk;
+    }
+
+    b = (struct icsc_bulk *)calloc(1, sizeof(struct icsc_bulk));
+    if (b == NULL) {
+        icsc_error("Cannot allocate bulk transfer state: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    pthread_mutex_init(&b->mutex, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&b->cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    __atomic_store_n(&icsc->bulk, b, __ATOMIC_RELEASE);
+    return b;
+}
+
+// Receivers answer a poll one after another, in station order, so their
+// NACKs do not collide.
+static unsigned long icsc_bulk_slot(icsc_ptr icsc) {
+    return icsc_frame_time(icsc, BULK_NACK_LEN) + ICSC_TURNAROUND_TIME;
+}
+
+static void put16(char *p, uint16_t v) {
+    v = htole16(v);
+    memcpy(p, &v, 2);
+}
+
+static void put32(char *p, uint32_t v) {
+    v = htole32(v);
+    memcpy(p, &v, 4);
+}
+
+static uint16_t get16(const char *p) {
+    uint16_t v;
+    memcpy(&v, p, 2);
+    return le16toh(v);
+}
+
+static uint32_t get32(const char *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return le32toh(v);
+}
+
+int icsc_bulk_send(icsc_ptr icsc, uint8_t station, uint8_t first, uint8_t last, const void *data, uint32_t len, unsigned long timeout) {
+    struct icsc_bulk *b;
+    char frame[255];
+    uint64_t deadline;
+    uint64_t end;
+    uint64_t now;
+    unsigned long window;
+    struct timespec ts;
+    uint32_t total;
+    uint32_t i;
+    uint32_t flen;
+    int missing;
+    int failed;
+    int quiet = 0;
+    int rc = -1;
+
+    if (icsc == NULL || data == NULL || len == 0 || last < first) {
+        return -1;
+    }
+
+    total = (len + BULK_FRAGMENT - 1) / BULK_FRAGMENT;
+    if (total > 65535) {
+        icsc_error("Bulk transfer of %u bytes is too large\n", len);
+        return -1;
+    }
+
+    b = icsc_bulk_get(icsc);
+    if (b == NULL) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&b->mutex);
+    if (b->sending) {
+        pthread_mutex_unlock(&b->mutex);
+        icsc_error("A bulk transfer is already being sent\n");
+        return -1;
+    }
+    b->missing = (uint8_t *)malloc((total + 7) / 8);
+    if (b->missing == NULL) {
+        pthread_mutex_unlock(&b->mutex);
+        icsc_error("Cannot allocate bulk transfer map: %s\n", strerror(errno));
+        return -1;
+    }
+    memset(b->missing, 0, (total + 7) / 8);
+    for (i = 0; i < total; i++) {
+        MAP_SET(b->missing, i);
+    }
+    b->sending = 1;
+    b->sendId++;
+    b->sendTotal = total;
+    pthread_mutex_unlock(&b->mutex);
+
+    window = (unsigned long)(last - first + 1) * icsc_bulk_slot(icsc) + icsc_frame_time(icsc, BULK_POLL_LEN) + icsc->rxTimeout;
+    deadline = icsc_micros() + timeout;
+
+    for (;;) {
+        // Send whatever is missing. A NACK that comes in meanwhile puts a
+        // fragment back for the next round.
+        for (i = 0; i < total; i++) {
+            pthread_mutex_lock(&b->mutex);
+            missing = MAP_BIT(b->missing, i);
+            MAP_CLEAR(b->missing, i);
+            pthread_mutex_unlock(&b->mutex);
+            if (!missing) {
+                continue;
+            }
+
+            flen = (i == total - 1) ? len - i * BULK_FRAGMENT : BULK_FRAGMENT;
+            frame[0] = BULK_DATA;
+            frame[1] = b->sendId;
+            put16(&frame[2], i);
+            put16(&frame[4], total);
+            put32(&frame[6], len);
+            memcpy(&frame[BULK_HEADER], (const uint8_t *)data + i * BULK_FRAGMENT, flen);
+            if (icsc_send_raw(icsc, icsc->station, station, ICSC_SYS_BULK, BULK_HEADER + flen, frame) < 0) {
+                goto done;
+            }
+        }
+
+        frame[0] = BULK_POLL;
+        frame[1] = b->sendId;
+        put16(&frame[2], total);
+        put32(&frame[4], len);
+        frame[8] = first;
+        frame[9] = last;
+        if (icsc_send_raw(icsc, icsc->station, station, ICSC_SYS_BULK, BULK_POLL_LEN, frame) < 0) {
+            goto done;
+        }
+
+        // Give every receiver its turn to answer.
+        end = icsc_micros() + window;
+        ts.tv_sec = end / 1000000;
+        ts.tv_nsec = (end % 1000000) * 1000;
+        pthread_mutex_lock(&b->mutex);
+        while ((now = icsc_micros()) < end) {
+            // With no read thread, the NACKs only arrive if we read them.
+            if (icsc->threadless && !__atomic_exchange_n(&icsc->processing, 1, __ATOMIC_ACQUIRE)) {
+                pthread_mutex_unlock(&b->mutex);
+                failed = icsc_process(icsc, end - now) < 0;
+                __atomic_store_n(&icsc->processing, 0, __ATOMIC_RELEASE);
+                pthread_mutex_lock(&b->mutex);
+                if (failed) {
+                    break;
+                }
+                continue;
+            }
+            pthread_cond_timedwait(&b->cond, &b->mutex, &ts);
+        }
+        missing = 0;
+        for (i = 0; i < (total + 7) / 8 && !missing; i++) {
+            missing = b->missing[i];
+        }
+        pthread_mutex_unlock(&b->mutex);
+
+        // A receiver that missed the poll as well as some data would stay
+        // silent, so only stop once two polls in a row go unanswered.
+        if (!missing && ++quiet == 2) {
+            rc = 0;
+            break;
+        }
+        if (missing) {
+            quiet = 0;
+        }
+        if (icsc_micros() >= deadline) {
+            icsc_debug("Bulk transfer timed out with fragments still missing\n");
+            break;
+        }
+        icsc_debug("Repairing bulk transfer\n");
+    }
+
+done:
+    pthread_mutex_lock(&b->mutex);
+    free(b->missing);
+    b->missing = NULL;
+    b->sending = 0;
+    pthread_mutex_unlock(&b->mutex);
+    return rc;
+}
+
+int icsc_bulk_accept(icsc_ptr icsc, void *buffer, uint32_t size) {
+    struct icsc_bulk *b;
+
+    if (icsc == NULL || buffer == NULL) {
+        return -1;
+    }
+
+    b = icsc_bulk_get(icsc);
+    if (b == NULL) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&b->mutex);
+    free(b->have);
+    b->have = NULL;
+    b->active = 0;
+    b->count = 0;
+    b->nackDue = 0;
+    b->max = size;
+    b->buffer = (uint8_t *)buffer;
+    pthread_mutex_unlock(&b->mutex);
+    return 0;
+}
+
+// Start receiving a transfer we have not seen before. Called with the
+// mutex held.
+static int icsc_bulk_start(struct icsc_bulk *b, uint8_t sender, uint8_t id, uint16_t total, uint32_t size) {
+    if (b->active && b->sender == sender && b->id == id) {
+        return 0;
+    }
+
+    if (size > b->max || total == 0 || total != (size + BULK_FRAGMENT - 1) / BULK_FRAGMENT) {
+        icsc_debug("Bulk transfer of %u bytes from %d does not fit\n", size, sender);
+        return -1;
+    }
+
+    free(b->have);
+    b->have = (uint8_t *)calloc((total + 7) / 8, 1);
+    if (b->have == NULL) {
+        b->active = 0;
+        return -1;
+    }
+    b->active = 1;
+    b->sender = sender;
+    b->id = id;
+    b->total = total;
+    b->size = size;
+    b->count = 0;
+    b->nackDue = 0;
+    return 0;
+}
+
+static void icsc_bulk_data(struct icsc_bulk *b, uint8_t sender, uint8_t len, const char *data) {
+    uint16_t index = get16(&data[2]);
+    uint32_t flen = len - BULK_HEADER;
+
+    if (icsc_bulk_start(b, sender, data[1], get16(&data[4]), get32(&data[6])) < 0) {
+        return;
+    }
+
+    if (index >= b->total || MAP_BIT(b->have, index)) {
+        return;
+    }
+    if (flen != ((index == b->total - 1) ? b->size - index * BULK_FRAGMENT : BULK_FRAGMENT)) {
+        return;
+    }
+
+    memcpy(b->buffer + index * BULK_FRAGMENT, &data[BULK_HEADER], flen);
+    MAP_SET(b->have, index);
+    b->count++;
+    if (b->count == b->total) {
+        pthread_cond_broadcast(&b->cond);
+    }
+}
+
+static void icsc_bulk_poll(icsc_ptr icsc, struct icsc_bulk *b, uint8_t sender, const char *data) {
+    uint8_t first = data[8];
+    uint8_t last = data[9];
+
+    if (icsc->station < first || icsc->station > last) {
+        return;
+    }
+
+    // Even if we heard none of the data, the poll says how much there is.
+    if (icsc_bulk_start(b, sender, data[1], get16(&data[2]), get32(&data[4])) < 0) {
+        return;
+    }
+
+    if (b->count < b->total) {
+        b->nackDue = icsc_micros() + (uint64_t)(icsc->station - first) * icsc_bulk_slot(icsc) + ICSC_TURNAROUND_TIME;
+        pthread_cond_broadcast(&b->cond);
+    }
+}
+
+static void icsc_bulk_nack(struct icsc_bulk *b, uint8_t len, const char *data) {
+    uint16_t base;
+    int i;
+
+    if (len < 3 || !b->sending || (uint8_t)data[0] != b->sendId) {
+        return;
+    }
+
+    base = get16(&data[1]);
+    for (i = 0; i < (len - 3) * 8 && base + i < b->sendTotal; i++) {
+        if (data[3 + (i >> 3)] & (1 << (i & 7))) {
+            MAP_SET(b->missing, base + i);
+        }
+    }
+}
+
+void icsc_bulk_frame(icsc_ptr icsc, uint8_t sender, uint8_t command, uint8_t len, const char *data) {
+    struct icsc_bulk *b = icsc->bulk;
+
+    pthread_mutex_lock(&b->mutex);
+    if (command == ICSC_SYS_BULK_NACK) {
+        icsc_bulk_nack(b, len, data);
+    } else if (b->buffer != NULL && len >= BULK_POLL_LEN) {
+        switch (data[0]) {
+            case BULK_DATA:
+                if (len > BULK_HEADER) {
+                    icsc_bulk_data(b, sender, len, data);
+                }
+                break;
+            case BULK_POLL:
+                icsc_bulk_poll(icsc, b, sender, data);
+                break;
+        }
+    }
+    pthread_mutex_unlock(&b->mutex);
+}
+
+// Build a NACK for the first fragments still missing. Called with the
+// mutex held.
+static int icsc_bulk_build_nack(struct icsc_bulk *b, char *nack) {
+    uint16_t base = 0;
+    int i;
+
+    while (base < b->total && MAP_BIT(b->have, base)) {
+        base++;
+    }
+    base &= ~7;
+
+    memset(nack, 0, BULK_NACK_LEN);
+    nack[0] = b->id;
+    put16(&nack[1], base);
+    for (i = 0; i < BULK_NACK_MAP * 8 && base + i < b->total; i++) {
+        if (!MAP_BIT(b->have, base + i)) {
+            nack[3 + (i >> 3)] |= 1 << (i & 7);
+        }
+    }
+    return BULK_NACK_LEN;
+}
+
+long icsc_bulk_wait(icsc_ptr icsc, unsigned long timeout) {
+    struct icsc_bulk *b;
+    char nack[BULK_NACK_LEN];
+    struct timespec ts;
+    uint64_t deadline;
+    uint64_t wake;
+    uint64_t now;
+    uint8_t sender;
+    long rc = -1;
+    int failed;
+    int len;
+
+    if (icsc == NULL || icsc->bulk == NULL || icsc->bulk->buffer == NULL) {
+        return -1;
+    }
+
+    b = icsc->bulk;
+    deadline = icsc_micros() + timeout;
+
+    pthread_mutex_lock(&b->mutex);
+    while (!(b->active && b->count == b->total) && (now = icsc_micros()) < deadline) {
+        if (b->nackDue != 0 && now >= b->nackDue) {
+            b->nackDue = 0;
+            sender = b->sender;
+            len = icsc_bulk_build_nack(b, nack);
+            pthread_mutex_unlock(&b->mutex);
+            icsc_send_raw(icsc, icsc->station, sender, ICSC_SYS_BULK_NACK, len, nack);
+            pthread_mutex_lock(&b->mutex);
+            continue;
+        }
+
+        wake = (b->nackDue != 0 && b->nackDue < deadline) ? b->nackDue : deadline;
+
+        // With no read thread, nothing arrives unless we read it.
+        if (icsc->threadless && !__atomic_exchange_n(&icsc->processing, 1, __ATOMIC_ACQUIRE)) {
+            pthread_mutex_unlock(&b->mutex);
+            failed = icsc_process(icsc, wake - now) < 0;
+            __atomic_store_n(&icsc->processing, 0, __ATOMIC_RELEASE);
+            pthread_mutex_lock(&b->mutex);
+            if (failed) {
+                // The link has gone, so nothing more will arrive.
+                break;
+            }
+            continue;
+        }
+
+        ts.tv_sec = wake / 1000000;
+        ts.tv_nsec = (wake % 1000000) * 1000;
+        pthread_cond_timedwait(&b->cond, &b->mutex, &ts);
+    }
+
+    if (b->active && b->count == b->total) {
+        rc = b->size;
+    }
+
+    // The buffer is the caller's again.
+    b->buffer = NULL;
+    b->active = 0;
+    free(b->have);
+    b->have = NULL;
+    pthread_mutex_unlock(&b->mutex);
+    return rc;
+}
+
+void icsc_bulk_free(icsc_ptr icsc) {
+    struct icsc_bulk *b = icsc->bulk;
+
+    if (b == NULL) {
+        return;
+    }
+
+    pthread_mutex_destroy(&b->mutex);
+    pthread_cond_destroy(&b->cond);
+    free(b->have);
+    free(b->missing);
+    free(b);
+    icsc->bulk = NULL;
+}
@@ -0,0 +1,61 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+
+#include "icsc.h"
+#include "icsc_private.h"
+#include "config.h"
+
+int icsc_subscribe(icsc_ptr icsc, const uint8_t *stations, const uint8_t *commands) {
+    char filter[ICSC_DAEMON_FILTER_LEN];
+
+    if (icsc == NULL) {
+        return -1;
+    }
+
+    // Anywhere else the control frame would go out onto a real bus.
+    if (icsc->transport != &icsc_transport_socket) {
+        icsc_error("Subscriptions need a connection to icscd\n");
+        return -1;
+    }
+
+    memset(filter, 0, ICSC_DAEMON_FILTER_LEN);
+    if (stations != NULL) {
+        filter[0] |= ICSC_DAEMON_FILTER_STATIONS;
+        memcpy(&filter[1], stations, 32);
+    }
+    if (commands != NULL) {
+        filter[0] |= ICSC_DAEMON_FILTER_COMMANDS;
+        memcpy(&filter[33], commands, 32);
+    }
+
+    return icsc_send_raw(icsc, icsc->station, icsc->station, ICSC_CMD_SYS, ICSC_DAEMON_FILTER_LEN, filter);
+}
+
+icsc_ptr icsc_connect(const char *path, uint8_t station) {
+    uint8_t stations[32];
+    uint8_t commands[32];
+    icsc_ptr icsc;
+
+    if (path == NULL) {
+        path = ICSC_DAEMON_SOCKET;
+    }
+
+    icsc = icsc_init_transport(&icsc_transport_socket, path, 0, station, -1);
+    if (icsc == NULL) {
+        return NULL;
+    }
+
+    memset(stations, 0, 32);
+    stations[station >> 3] |= 1 << (station & 7);
+    stations[ICSC_BROADCAST >> 3] |= 1 << (ICSC_BROADCAST & 7);
+    memset(commands, 0xFF, 32);
+
+    if (icsc_subscribe(icsc, stations, commands) < 0) {
+        icsc_close(icsc);
+        return NULL;
+    }
+
+    return icsc;
+}
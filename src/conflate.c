@@ -0,0 +1,275 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "icsc.h"
+#include "icsc_private.h"
+#include "config.h"
+
+// Each slot holds the newest payload for one (station, command) pair and
+// is published through a sequence lock: the read thread makes the
+// sequence odd while it is copying, and readers retry if the sequence was
+// odd or changed while they copied. Slots are only ever added, at the head
+// of the list for their command, so the read thread never needs a lock.
+struct icsc_conflate_slot {
+    uint8_t station;
+    uint32_t sequence;
+    uint8_t len;
+    char data[255];
+    struct icsc_conflate_slot *next;
+};
+
+struct icsc_conflate {
+    struct icsc_conflate_slot *slots[256];
+    pthread_mutex_t mutex;
+
+    // The notifier thread, which calls back at most once per interval
+    // when any slot has changed.
+    pthread_t thread;
+    int running;
+    int dirty;
+    int waiting;
+    pthread_cond_t cond;
+    unsigned long interval;
+    icsc_conflate_callback callback;
+    void *arg;
+};
+
+static struct icsc_conflate *icsc_conflate_get(icsc_ptr icsc) {
+    struct icsc_conflate *c;
+    pthread_condattr_t attr;
+
+    if (icsc->conflate != NULL) {
+        return icsc->conflate;
+    }
+
+    c = (struct icsc_conflate *)calloc(1, sizeof(struct icsc_conflate));
+    if (c == NULL) {
+        icsc_error("Cannot allocate conflation table: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    pthread_mutex_init(&c->mutex, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&c->cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    __atomic_store_n(&icsc->conflate, c, __ATOMIC_RELEASE);
+    return c;
+}
+
+static struct icsc_conflate_slot *icsc_conflate_find(struct icsc_conflate *c, uint8_t station, char command) {
+    struct icsc_conflate_slot *slot;
+
+    for (slot = __atomic_load_n(&c->slots[(uint8_t)command], __ATOMIC_ACQUIRE); slot; slot = slot->next) {
+        if (slot->station == station) {
+            return slot;
+        }
+    }
+    return NULL;
+}
+
+int icsc_conflate(icsc_ptr icsc, uint8_t station, char command) {
+    struct icsc_conflate *c;
+    struct icsc_conflate_slot *slot;
+
+    if (icsc == NULL) {
+        return -1;
+    }
+
+    c = icsc_conflate_get(icsc);
+    if (c == NULL) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&c->mutex);
+
+    if (icsc_conflate_find(c, station, command) != NULL) {
+        pthread_mutex_unlock(&c->mutex);
+        return 0;
+    }
+
+    slot = (struct icsc_conflate_slot *)calloc(1, sizeof(struct icsc_conflate_slot));
+    if (slot == NULL) {
+        pthread_mutex_unlock(&c->mutex);
+        icsc_error("Cannot allocate conflation slot: %s\n", strerror(errno));
+        return -1;
+    }
+    slot->station = station;
+    slot->next = c->slots[(uint8_t)command];
+    __atomic_store_n(&c->slots[(uint8_t)command], slot, __ATOMIC_RELEASE);
+
+    pthread_mutex_unlock(&c->mutex);
+    return 0;
+}
+
+int icsc_conflate_update(icsc_ptr icsc, uint8_t station, char command, uint8_t len, const char *data) {
+    struct icsc_conflate *c = icsc->conflate;
+    struct icsc_conflate_slot *slot;
+
+    slot = icsc_conflate_find(c, station, command);
+    if (slot == NULL) {
+        return 0;
+    }
+
+    __atomic_add_fetch(&slot->sequence, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    slot->len = len;
+    memcpy(slot->data, data, len);
+    __atomic_add_fetch(&slot->sequence, 1, __ATOMIC_RELEASE);
+
+    // Pairs with the notifier setting waiting and then checking dirty.
+    __atomic_store_n(&c->dirty, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&c->waiting, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&c->mutex);
+        pthread_cond_signal(&c->cond);
+        pthread_mutex_unlock(&c->mutex);
+    }
+    return 1;
+}
+
+int icsc_conflate_read(icsc_ptr icsc, uint8_t station, char command, void *data, uint8_t *len, uint32_t *version) {
+    struct icsc_conflate_slot *slot;
+    uint32_t sequence;
+    uint8_t l;
+
+    if (icsc == NULL || data == NULL || icsc->conflate == NULL) {
+        return -1;
+    }
+
+    slot = icsc_conflate_find(icsc->conflate, station, command);
+    if (slot == NULL) {
+        return -1;
+    }
+
+    do {
+        sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+        if (sequence & 1) {
+            continue;
+        }
+        if (version != NULL && sequence / 2 == *version) {
+            return 0;
+        }
+        l = slot->len;
+        memcpy(data, slot->data, l);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((sequence & 1) || (sequence != __atomic_load_n(&slot->sequence, __ATOMIC_RELAXED)));
+
+    if (sequence == 0) {
+        return 0;
+    }
+
+    if (len != NULL) {
+        *len = l;
+    }
+    if (version != NULL) {
+        *version = sequence / 2;
+    }
+    return 1;
+}
+
+static void *icsc_conflate_thread(void *arg) {
+    icsc_ptr icsc = (icsc_ptr)arg;
+    struct icsc_conflate *c = icsc->conflate;
+    struct timespec ts;
+    uint64_t next;
+
+    icsc_debug("Conflation notifier executing\n");
+
+    pthread_mutex_lock(&c->mutex);
+    while (c->running) {
+        __atomic_store_n(&c->waiting, 1, __ATOMIC_SEQ_CST);
+        while (c->running && !__atomic_load_n(&c->dirty, __ATOMIC_SEQ_CST)) {
+            pthread_cond_wait(&c->cond, &c->mutex);
+        }
+        __atomic_store_n(&c->waiting, 0, __ATOMIC_RELAXED);
+        if (!c->running) {
+            break;
+        }
+
+        __atomic_store_n(&c->dirty, 0, __ATOMIC_SEQ_CST);
+        next = icsc_micros() + c->interval;
+        pthread_mutex_unlock(&c->mutex);
+
+        c->callback(icsc, c->arg);
+
+        // Whatever changes in the meantime is picked up in one go.
+        pthread_mutex_lock(&c->mutex);
+        ts.tv_sec = next / 1000000;
+        ts.tv_nsec = (next % 1000000) * 1000;
+        while (c->running && pthread_cond_timedwait(&c->cond, &c->mutex, &ts) == 0);
+    }
+    pthread_mutex_unlock(&c->mutex);
+
+    icsc_debug("Conflation notifier finishing\n");
+    return NULL;
+}
+
+int icsc_conflate_notify(icsc_ptr icsc, icsc_conflate_callback callback, void *arg, unsigned long interval) {
+    struct icsc_conflate *c;
+
+    if (icsc == NULL || callback == NULL) {
+        return -1;
+    }
+
+    c = icsc_conflate_get(icsc);
+    if (c == NULL) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&c->mutex);
+    if (c->running) {
+        pthread_mutex_unlock(&c->mutex);
+        return -1;
+    }
+    c->callback = callback;
+    c->arg = arg;
+    c->interval = interval;
+    c->running = 1;
+    pthread_mutex_unlock(&c->mutex);
+
+    if (pthread_create(&c->thread, NULL, icsc_conflate_thread, icsc) != 0) {
+        icsc_error("Cannot start conflation notifier: %s\n", strerror(errno));
+        c->running = 0;
+        return -1;
+    }
+    return 0;
+}
+
+void icsc_conflate_free(icsc_ptr icsc) {
+    struct icsc_conflate *c = icsc->conflate;
+    struct icsc_conflate_slot *slot;
+    struct icsc_conflate_slot *next;
+    int running;
+    int i;
+
+    if (c == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&c->mutex);
+    running = c->running;
+    c->running = 0;
+    pthread_cond_signal(&c->cond);
+    pthread_mutex_unlock(&c->mutex);
+
+    if (running) {
+        pthread_join(c->thread, NULL);
+    }
+
+    for (i = 0; i < 256; i++) {
+        for (slot = c->slots[i]; slot; slot = next) {
+            next = slot->next;
+            free(slot);
+        }
+    }
+
+    pthread_mutex_destroy(&c->mutex);
+    pthread_cond_destroy(&c->cond);
+    free(c);
+    icsc->conflate = NULL;
+}
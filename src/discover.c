@@ -0,0 +1,282 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "icsc.h"
+#include "icsc_private.h"
+#include "config.h"
+
+// A station that misses this many pings in a row is no longer live.
+#define DISCOVER_MAX_MISSED 2
+
+struct icsc_discovery {
+    pthread_t thread;
+    int running;
+    uint8_t first;
+    uint8_t last;
+    unsigned long interval;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    struct {
+        uint8_t alive;
+        uint8_t missed;
+        uint32_t rtt;
+        uint64_t lastSeen;
+    } stations[256];
+};
+
+// About 3.5 ms at 115200 baud. A sequential sweep spends this on every
+// address that does not answer.
+static unsigned long icsc_ping_timeout(icsc_ptr icsc) {
+    return icsc_frame_time(icsc, 0) * 2 + ICSC_TURNAROUND_TIME;
+}
+
+static int icsc_ping(icsc_ptr icsc, uint8_t station, unsigned long timeout, uint32_t *rtt) {
+    icsc_waiter_t waiter;
+    uint64_t sent;
+
+    icsc_waiter_add(icsc, &waiter, station, ICSC_SYS_PONG);
+    sent = icsc_micros();
+    if (icsc_send_raw(icsc, icsc->station, station, ICSC_SYS_PING, 0, NULL) < 0) {
+        icsc_waiter_wait(icsc, &waiter, 0);
+        return 0;
+    }
+
+    if (!icsc_waiter_wait(icsc, &waiter, timeout)) {
+        return 0;
+    }
+
+    *rtt = waiter.when - sent;
+    return 1;
+}
+
+static int icsc_discoverable(icsc_ptr icsc, int station) {
+    return (station != ICSC_BROADCAST) && (station != icsc->station);
+}
+
+int icsc_discover(icsc_ptr icsc, uint8_t first, uint8_t last, int flags, icsc_station_info_t *table, int max) {
+    icsc_waiter_t *waiters;
+    uint64_t *sent;
+    unsigned long timeout;
+    uint64_t deadline;
+    uint64_t now;
+    uint32_t rtt;
+    int found = 0;
+    int count;
+    int i;
+
+    if (icsc == NULL || table == NULL || last < first) {
+        return -1;
+    }
+
+    timeout = icsc_ping_timeout(icsc);
+    count = last - first + 1;
+
+    if (!(flags & ICSC_DISCOVER_PIPELINE)) {
+        for (i = first; i <= last && found < max; i++) {
+            if (!icsc_discoverable(icsc, i)) {
+                continue;
+            }
+            if (icsc_ping(icsc, i, timeout, &rtt)) {
+                icsc_debug("Found station %d (%u us)\n", i, rtt);
+                table[found].station = i;
+                table[found].rtt = rtt;
+                table[found].age = 0;
+                found++;
+            }
+        }
+        return found;
+    }
+
+    waiters = (icsc_waiter_t *)calloc(count, sizeof(icsc_waiter_t));
+    sent = (uint64_t *)calloc(count, sizeof(uint64_t));
+    if (waiters == NULL || sent == NULL) {
+        icsc_error("Cannot allocate discovery: %s\n", strerror(errno));
+        free(waiters);
+        free(sent);
+        return -1;
+    }
+
+    for (i = 0; i < count; i++) {
+        icsc_waiter_add(icsc, &waiters[i], first + i, ICSC_SYS_PONG);
+    }
+
+    for (i = 0; i < count; i++) {
+        if (icsc_discoverable(icsc, first + i)) {
+            sent[i] = icsc_micros();
+            icsc_send_raw(icsc, icsc->station, first + i, ICSC_SYS_PING, 0, NULL);
+        }
+    }
+
+    deadline = icsc_micros() + timeout;
+
+    for (i = 0; i < count; i++) {
+        now = icsc_micros();
+        if (!icsc_waiter_wait(icsc, &waiters[i], now < deadline ? deadline - now : 0)) {
+            continue;
+        }
+        if (sent[i] != 0 && found < max) {
+            table[found].station = first + i;
+            table[found].rtt = waiters[i].when - sent[i];
+            table[found].age = 0;
+            found++;
+        }
+    }
+
+    free(waiters);
+    free(sent);
+    return found;
+}
+
+void icsc_discover_seen(icsc_ptr icsc, uint8_t station) {
+    struct icsc_discovery *d = icsc->discovery;
+
+    if (!d->running) {
+        return;
+    }
+
+    pthread_mutex_lock(&d->mutex);
+    d->stations[station].alive = 1;
+    d->stations[station].missed = 0;
+    d->stations[station].lastSeen = icsc_micros();
+    pthread_mutex_unlock(&d->mutex);
+}
+
+static void *icsc_discover_thread(void *arg) {
+    icsc_ptr icsc = (icsc_ptr)arg;
+    struct icsc_discovery *d = icsc->discovery;
+    unsigned long timeout = icsc_ping_timeout(icsc);
+    uint64_t cycle = (uint64_t)d->interval * (d->last - d->first + 1);
+    struct timespec ts;
+    uint32_t rtt;
+    int station = d->first;
+    int alive;
+    int stale;
+
+    icsc_debug("Discovery thread executing\n");
+
+    pthread_mutex_lock(&d->mutex);
+    while (d->running) {
+        if (icsc_discoverable(icsc, station)) {
+            stale = !d->stations[station].alive || (icsc_micros() - d->stations[station].lastSeen >= cycle);
+            if (stale) {
+                pthread_mutex_unlock(&d->mutex);
+                alive = icsc_ping(icsc, station, timeout, &rtt);
+                pthread_mutex_lock(&d->mutex);
+
+                if (alive) {
+                    d->stations[station].alive = 1;
+                    d->stations[station].missed = 0;
+                    d->stations[station].rtt = rtt;
+                    d->stations[station].lastSeen = icsc_micros();
+                } else if (++d->stations[station].missed >= DISCOVER_MAX_MISSED) {
+                    d->stations[station].alive = 0;
+                }
+            }
+        }
+
+        station = (station == d->last) ? d->first : station + 1;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        ts.tv_sec += d->interval / 1000000;
+        ts.tv_nsec += (d->interval % 1000000) * 1000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        while (d->running && pthread_cond_timedwait(&d->cond, &d->mutex, &ts) == 0);
+    }
+    pthread_mutex_unlock(&d->mutex);
+
+    icsc_debug("Discovery thread finishing\n");
+    return NULL;
+}
+
+int icsc_discover_start(icsc_ptr icsc, uint8_t first, uint8_t last, unsigned long interval) {
+    struct icsc_discovery *d;
+    pthread_condattr_t attr;
+
+    if (icsc == NULL || last < first || interval == 0) {
+        return -1;
+    }
+
+    if (icsc->discovery == NULL) {
+        d = (struct icsc_discovery *)calloc(1, sizeof(struct icsc_discovery));
+        if (d == NULL) {
+            icsc_error("Cannot allocate discovery: %s\n", strerror(errno));
+            return -1;
+        }
+        pthread_mutex_init(&d->mutex, NULL);
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&d->cond, &attr);
+        pthread_condattr_destroy(&attr);
+        icsc->discovery = d;
+    }
+
+    d = icsc->discovery;
+    if (d->running) {
+        return -1;
+    }
+
+    memset(d->stations, 0, sizeof(d->stations));
+    d->first = first;
+    d->last = last;
+    d->interval = interval;
+    d->running = 1;
+
+    if (pthread_create(&d->thread, NULL, icsc_discover_thread, icsc) != 0) {
+        icsc_error("Cannot start discovery thread: %s\n", strerror(errno));
+        d->running = 0;
+        return -1;
+    }
+
+    return 0;
+}
+
+int icsc_discover_stop(icsc_ptr icsc) {
+    struct icsc_discovery *d;
+
+    if (icsc == NULL || icsc->discovery == NULL || !icsc->discovery->running) {
+        return -1;
+    }
+
+    d = icsc->discovery;
+    pthread_mutex_lock(&d->mutex);
+    d->running = 0;
+    pthread_cond_signal(&d->cond);
+    pthread_mutex_unlock(&d->mutex);
+
+    pthread_join(d->thread, NULL);
+    return 0;
+}
+
+int icsc_discover_table(icsc_ptr icsc, icsc_station_info_t *table, int max) {
+    struct icsc_discovery *d;
+    uint64_t now;
+    int found = 0;
+    int i;
+
+    if (icsc == NULL || table == NULL || icsc->discovery == NULL || !icsc->discovery->running) {
+        return -1;
+    }
+
+    d = icsc->discovery;
+    now = icsc_micros();
+
+    pthread_mutex_lock(&d->mutex);
+    for (i = d->first; i <= d->last && found < max; i++) {
+        if (!d->stations[i].alive) {
+            continue;
+        }
+        table[found].station = i;
+        table[found].rtt = d->stations[i].rtt;
+        table[found].age = now - d->stations[i].lastSeen;
+        found++;
+    }
+    pthread_mutex_unlock(&d->mutex);
+
+    return found;
+}
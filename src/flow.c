@@ -0,0 +1,146 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "icsc.h"
+#include "icsc_private.h"
+#include "config.h"
+
+// Once a send has been refused, blocked stays set until whoever sees the
+// backlog fall to the low-water mark first clears it and calls back, so a
+// producer hears about each refusal once.
+struct icsc_flow {
+    uint32_t high;
+    uint32_t low;
+    int blocked;
+    icsc_writable_callback callback;
+    void *arg;
+};
+
+static struct icsc_flow *icsc_flow_get(icsc_ptr icsc) {
+    struct icsc_flow *f;
+    struct icsc_flow *none = NULL;
+
+    if (icsc->flow != NULL) {
+        return icsc->flow;
+    }
+
+    f = (struct icsc_flow *)calloc(1, sizeof(struct icsc_flow));
+    if (f == NULL) {
+        icsc_error("Cannot allocate flow control: %s\n", strerror(errno));
+        return NULL;
+    }
+    f->high = ICSC_TX_HIGH_WATER;
+    f->low = ICSC_TX_LOW_WATER;
+
+    // Senders may race to set this up; whichever gets there first wins.
+    if (!__atomic_compare_exchange_n(&icsc->flow, &none, f, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        free(f);
+    }
+    return icsc->flow;
+}
+
+int icsc_tx_pending(icsc_ptr icsc) {
+    int pending;
+    int outq;
+
+    if (icsc == NULL) {
+        return -1;
+    }
+
+    pending = __atomic_load_n(&icsc->txPending, __ATOMIC_SEQ_CST);
+    if (icsc->transport->outq != NULL) {
+        outq = icsc->transport->outq(icsc->transportData);
+        if (outq > 0) {
+            pending += outq;
+        }
+    }
+    return pending;
+}
+
+int icsc_set_tx_watermarks(icsc_ptr icsc, uint32_t high, uint32_t low) {
+    struct icsc_flow *f;
+
+    if (icsc == NULL || low >= high) {
+        return -1;
+    }
+
+    f = icsc_flow_get(icsc);
+    if (f == NULL) {
+        return -1;
+    }
+    f->high = high;
+    f->low = low;
+    return 0;
+}
+
+int icsc_set_writable(icsc_ptr icsc, icsc_writable_callback callback, void *arg) {
+    struct icsc_flow *f;
+
+    if (icsc == NULL) {
+        return -1;
+    }
+
+    f = icsc_flow_get(icsc);
+    if (f == NULL) {
+        return -1;
+    }
+    f->arg = arg;
+    __atomic_store_n(&f->callback, callback, __ATOMIC_RELEASE);
+    return 0;
+}
+
+int icsc_try_send_array(icsc_ptr icsc, uint8_t station, char command, uint8_t len, const char *data) {
+    struct icsc_flow *f;
+
+    if (icsc == NULL) {
+        return -1;
+    }
+
+    f = icsc_flow_get(icsc);
+    if (f == NULL) {
+        return -1;
+    }
+
+    if ((uint32_t)icsc_tx_pending(icsc) >= f->high) {
+        // Pairs with icsc_flow_check(): either the sender that drains the
+        // backlog sees blocked, or we see the backlog gone.
+        __atomic_store_n(&f->blocked, 1, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&icsc->stats.txRefused, 1, __ATOMIC_RELAXED);
+        icsc_flow_check(icsc);
+        errno = EAGAIN;
+        return -1;
+    }
+
+    return icsc_send_array(icsc, station, command, len, data);
+}
+
+int icsc_flow_blocked(icsc_ptr icsc) {
+    struct icsc_flow *f = __atomic_load_n(&icsc->flow, __ATOMIC_ACQUIRE);
+
+    return f != NULL && __atomic_load_n(&f->blocked, __ATOMIC_SEQ_CST);
+}
+
+void icsc_flow_check(icsc_ptr icsc) {
+    struct icsc_flow *f = __atomic_load_n(&icsc->flow, __ATOMIC_ACQUIRE);
+    icsc_writable_callback callback;
+
+    if (f == NULL || !__atomic_load_n(&f->blocked, __ATOMIC_SEQ_CST)) {
+        return;
+    }
+
+    if ((uint32_t)icsc_tx_pending(icsc) > f->low) {
+        return;
+    }
+
+    if (!__atomic_exchange_n(&f->blocked, 0, __ATOMIC_SEQ_CST)) {
+        return;
+    }
+
+    callback = __atomic_load_n(&f->callback, __ATOMIC_ACQUIRE);
+    if (callback != NULL) {
+        callback(icsc, f->arg);
+    }
+}
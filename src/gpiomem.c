@@ -0,0 +1,219 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "icsc.h"
+#include "config.h"
+
+// Raspberry Pi 1 to 4. /dev/gpiomem maps just the GPIO block, so it can be
+// used without root. Pins 32 to 53 use the second word of each register.
+const icsc_gpiomem_layout_t icsc_gpiomem_bcm2835 = {
+    .name = "bcm2835",
+    .device = "/dev/gpiomem",
+    .banks = 2,
+    .base = { 0x00, 0x04 },
+    .set = 0x1C,
+    .clear = 0x28,
+    .level = 0x34,
+    .direction = 0x00,
+    .directionType = ICSC_GPIOMEM_FSEL,
+};
+
+// BeagleBone. Each bank of 32 pins is a separate block. The bank's clock
+// must be running, which exporting the pin through sysfs takes care of.
+const icsc_gpiomem_layout_t icsc_gpiomem_am335x = {
+    .name = "am335x",
+    .device = "/dev/mem",
+    .banks = 4,
+    .base = { 0x44E07000, 0x4804C000, 0x481AC000, 0x481AE000 },
+    .set = 0x194,
+    .clear = 0x190,
+    .level = 0x138,
+    .direction = 0x134,
+    .directionType = ICSC_GPIOMEM_OE,
+};
+
+struct icsc_gpiomem {
+    void *map;
+    size_t mapLen;
+    volatile uint32_t *set;
+    volatile uint32_t *clear;
+    volatile uint32_t *level;
+    uint32_t bit;
+};
+
+const icsc_gpiomem_layout_t *icsc_gpiomem_detect() {
+    char compatible[256];
+    ssize_t len;
+    ssize_t i;
+    int fd;
+
+    fd = open("/proc/device-tree/compatible", O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    len = read(fd, compatible, sizeof(compatible) - 1);
+    close(fd);
+    if (len <= 0) {
+        return NULL;
+    }
+    compatible[len] = 0;
+
+    // A list of NUL separated strings, most specific first.
+    for (i = 0; i < len; i += strlen(&compatible[i]) + 1) {
+        if (!strcmp(&compatible[i], "brcm,bcm2835") || !strcmp(&compatible[i], "brcm,bcm2836") ||
+            !strcmp(&compatible[i], "brcm,bcm2837") || !strcmp(&compatible[i], "brcm,bcm2711")) {
+            return &icsc_gpiomem_bcm2835;
+        }
+        if (!strcmp(&compatible[i], "ti,am33xx")) {
+            return &icsc_gpiomem_am335x;
+        }
+    }
+    return NULL;
+}
+
+icsc_gpiomem_ptr icsc_gpiomem_open(const icsc_gpiomem_layout_t *layout, int num) {
+    struct icsc_gpiomem *g;
+    uint64_t bank;
+    uint64_t fsel = 0;
+    uint64_t first;
+    uint64_t last;
+    long page = sysconf(_SC_PAGESIZE);
+    volatile uint32_t *direction;
+    uint32_t v;
+    int fd;
+
+    if (layout == NULL || num < 0 || num / 32 >= layout->banks) {
+        icsc_error("GPIO%d is not in the %s register block\n", num, layout ? layout->name : "(none)");
+        return NULL;
+    }
+
+    // Work out the span of registers this pin uses and map just those pages.
+    bank = layout->base[num / 32];
+    first = bank + layout->level;
+    last = first;
+    if (bank + layout->set < first) first = bank + layout->set;
+    if (bank + layout->clear < first) first = bank + layout->clear;
+    if (bank + layout->set > last) last = bank + layout->set;
+    if (bank + layout->clear > last) last = bank + layout->clear;
+
+    switch (layout->directionType) {
+        case ICSC_GPIOMEM_FSEL:
+            fsel = layout->base[0] + layout->direction + (num / 10) * 4;
+            break;
+        case ICSC_GPIOMEM_OE:
+            fsel = bank + layout->direction;
+            break;
+    }
+    if (layout->directionType != ICSC_GPIOMEM_NONE) {
+        if (fsel < first) first = fsel;
+        if (fsel > last) last = fsel;
+    }
+    first &= ~(uint64_t)(page - 1);
+
+    g = (struct icsc_gpiomem *)calloc(1, sizeof(struct icsc_gpiomem));
+    if (g == NULL) {
+        icsc_error("Cannot allocate GPIO mapping: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    fd = open(layout->device, O_RDWR | O_SYNC);
+    if (fd < 0) {
+        icsc_error("Unable to open %s: %s\n", layout->device, strerror(errno));
+        free(g);
+        return NULL;
+    }
+
+    g->mapLen = last + 4 - first;
+    g->map = mmap(NULL, g->mapLen, PROT_READ | PROT_WRITE, MAP_SHARED, fd, first);
+    close(fd);
+    if (g->map == MAP_FAILED) {
+        icsc_error("Unable to map %s registers: %s\n", layout->name, strerror(errno));
+        free(g);
+        return NULL;
+    }
+
+#define REG(offset) ((volatile uint32_t *)((uint8_t *)g->map + (offset) - first))
+    g->set = REG(bank + layout->set);
+    g->clear = REG(bank + layout->clear);
+    g->level = REG(bank + layout->level);
+    g->bit = 1 << (num % 32);
+
+    switch (layout->directionType) {
+        case ICSC_GPIOMEM_FSEL:
+            // Three bits per pin, ten pins per word; 001 is an output.
+            direction = REG(fsel);
+            v = *direction;
+            v &= ~(7 << ((num % 10) * 3));
+            v |= 1 << ((num % 10) * 3);
+            *direction = v;
+            break;
+        case ICSC_GPIOMEM_OE:
+            // One bit per pin; clear is an output.
+            direction = REG(fsel);
+            *direction &= ~g->bit;
+            break;
+    }
+#undef REG
+
+    icsc_debug("GPIO%d mapped through %s (%s)\n", num, layout->device, layout->name);
+    return g;
+}
+
+void icsc_gpiomem_write(icsc_gpiomem_ptr g, int level) {
+    if (level) {
+        *g->set = g->bit;
+    } else {
+        *g->clear = g->bit;
+    }
+    // Make sure the store has left before the UART is touched.
+    __sync_synchronize();
+}
+
+int icsc_gpiomem_read(icsc_gpiomem_ptr g) {
+    return (*g->level & g->bit) ? 1 : 0;
+}
+
+void icsc_gpiomem_close(icsc_gpiomem_ptr g) {
+    if (g == NULL) {
+        return;
+    }
+    munmap(g->map, g->mapLen);
+    free(g);
+}
+
+int icsc_set_de_gpiomem(icsc_ptr icsc, const icsc_gpiomem_layout_t *layout) {
+    icsc_gpiomem_ptr g;
+    icsc_gpiomem_ptr old;
+
+    if (icsc == NULL || icsc->dePin < 0) {
+        return -1;
+    }
+
+    if (layout == NULL) {
+        layout = icsc_gpiomem_detect();
+        if (layout == NULL) {
+            icsc_error("No GPIO register layout known for this board\n");
+            return -1;
+        }
+    }
+
+    g = icsc_gpiomem_open(layout, icsc->dePin);
+    if (g == NULL) {
+        return -1;
+    }
+    icsc_gpiomem_write(g, 0);
+
+    // Swap over between frames.
+    pthread_mutex_lock(&icsc->uartMutex);
+    old = icsc->deMem;
+    icsc->deMem = g;
+    pthread_mutex_unlock(&icsc->uartMutex);
+
+    icsc_gpiomem_close(old);
+    return 0;
+}
@@ -5,9 +5,14 @@
 #include <endian.h>
 #include <pthread.h>
 #include <stdarg.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
 
 #include "icsc.h"
+#include "icsc_private.h"
 #include "config.h"
+#include "probes.h"
 
 int doDebug = 0;
 
@@ -38,6 +43,10 @@ static void icsc_assert_de(icsc_ptr icsc) {
     if (icsc->dePin < 0) {
         return;
     }
+    if (icsc->deMem != NULL) {
+        icsc_gpiomem_write(icsc->deMem, 1);
+        return;
+    }
     icsc_gpio_write(icsc->dePin, 1);
 }
 
@@ -45,174 +54,832 @@ static void icsc_deassert_de(icsc_ptr icsc) {
     if (icsc->dePin < 0) {
         return;
     }
+    if (icsc->deMem != NULL) {
+        icsc_gpiomem_write(icsc->deMem, 0);
+        return;
+    }
     icsc_gpio_write(icsc->dePin, 0);
 }
 
-static int icsc_send_raw(icsc_ptr icsc, uint8_t origin, unsigned char station, char command, uint8_t len, const char *data) {
+// Fill in everything around a payload that is already in place.
+static int icsc_finish_frame(uint8_t *frame, uint8_t origin, uint8_t station, uint8_t command, uint8_t len) {
     int i;
+    int pos = 0;
     uint8_t cs = 0;
 
-    if (icsc->uartFD < 0) {
-        return -1;
-    }
-
-    pthread_mutex_lock(&icsc->uartMutex);
-
-    icsc_assert_de(icsc);
-
     for (i = 0; i < ICSC_SOH_START_COUNT; i++) {
-        icsc_serial_write(icsc->uartFD, SOH);
+        frame[pos++] = SOH;
     }
 
-    icsc_serial_write(icsc->uartFD, station);
+    frame[pos++] = station;
     cs += station;
 
-    icsc_serial_write(icsc->uartFD, origin);
+    frame[pos++] = origin;
     cs += origin;
 
-    icsc_serial_write(icsc->uartFD, command);
+    frame[pos++] = command;
     cs += command;
 
-    icsc_serial_write(icsc->uartFD, len);
+    frame[pos++] = len;
     cs += len;
 
-    icsc_serial_write(icsc->uartFD, STX);
+    frame[pos++] = STX;
 
     for (i = 0; i < len; i++) {
-        icsc_serial_write(icsc->uartFD, data[i]);
-        cs += data[i];
+        cs += frame[pos++];
     }
 
-    icsc_serial_write(icsc->uartFD, ETX);
-    icsc_serial_write(icsc->uartFD, cs);
-    icsc_serial_write(icsc->uartFD, EOT);
+    frame[pos++] = ETX;
+    frame[pos++] = cs;
+    frame[pos++] = EOT;
 
-    icsc_serial_flush(icsc->uartFD);
-    icsc_deassert_de(icsc);
-    pthread_mutex_unlock(&icsc->uartMutex);
+    return pos;
+}
+
+int icsc_build_frame(uint8_t *frame, uint8_t origin, uint8_t station, uint8_t command, uint8_t len, const char *data) {
+    if (len > 0) {
+        memcpy(frame + ICSC_SOH_START_COUNT + 5, data, len);
+    }
+    return icsc_finish_frame(frame, origin, station, command, len);
+}
+
+// Wait until the link is free and no more urgent frame is waiting. Each
+// class hands out tickets so frames of the same class keep their order.
+static void icsc_tx_acquire(icsc_ptr icsc, int priority) {
+    uint32_t ticket;
+    uint64_t start = 0;
+    uint32_t waited;
+    int blocked;
+    int p;
+
+    if (priority == ICSC_PRIORITY_CONTROL) {
+        start = icsc_micros();
+    }
+
+    pthread_mutex_lock(&icsc->txMutex);
+    ticket = icsc->txTicket[priority]++;
+    for (;;) {
+        blocked = icsc->txBusy || (icsc->txServing[priority] != ticket);
+        for (p = 0; p < priority && !blocked; p++) {
+            blocked = (icsc->txTicket[p] != icsc->txServing[p]);
+        }
+        if (!blocked) {
+            break;
+        }
+        pthread_cond_wait(&icsc->txCond, &icsc->txMutex);
+    }
+    icsc->txServing[priority]++;
+    icsc->txBusy = 1;
+
+    if (priority == ICSC_PRIORITY_CONTROL) {
+        waited = icsc_micros() - start;
+        icsc->stats.controlFrames++;
+        icsc->stats.controlWaitTotal += waited;
+        if (waited > icsc->stats.controlWaitMax) {
+            icsc->stats.controlWaitMax = waited;
+        }
+    }
+    pthread_mutex_unlock(&icsc->txMutex);
+}
+
+static void icsc_tx_release(icsc_ptr icsc) {
+    pthread_mutex_lock(&icsc->txMutex);
+    icsc->txBusy = 0;
+    pthread_cond_broadcast(&icsc->txCond);
+    pthread_mutex_unlock(&icsc->txMutex);
+}
+
+int icsc_set_priority(icsc_ptr icsc, char command, int priority) {
+    uint8_t *priorities;
+    uint8_t *none = NULL;
+
+    if (icsc == NULL || priority < 0 || priority >= ICSC_PRIORITY_COUNT) {
+        return -1;
+    }
+
+    priorities = __atomic_load_n(&icsc->priorities, __ATOMIC_ACQUIRE);
+    if (priorities == NULL) {
+        priorities = (uint8_t *)malloc(256);
+        if (priorities == NULL) {
+            icsc_error("Cannot allocate priority table: %s\n", strerror(errno));
+            return -1;
+        }
+        memset(priorities, ICSC_PRIORITY_NORMAL, 256);
+
+        // Senders read the table without a lock, so only publish it once
+        // it is filled in. Whichever caller gets there first wins.
+        if (!__atomic_compare_exchange_n(&icsc->priorities, &none, priorities, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            free(priorities);
+            priorities = none;
+        }
+    }
+
+    __atomic_store_n(&priorities[(uint8_t)command], priority, __ATOMIC_RELAXED);
     return 0;
 }
 
-static int icsc_respond_to_ping(icsc_ptr icsc, uint8_t station, uint8_t len, const char *data) {
-    return icsc_send_raw(icsc, icsc->station, station, ICSC_SYS_PONG, len, data);
+// icscd filters by destination before we see anything, so tell it
+// whenever the stations we answer to change.
+static int icsc_members_changed(icsc_ptr icsc) {
+    uint8_t members[32];
+    int i;
+
+    if (icsc->transport == &icsc_transport_socket) {
+        for (i = 0; i < 32; i++) {
+            members[i] = __atomic_load_n(&icsc->members[i], __ATOMIC_RELAXED);
+        }
+        return icsc_subscribe(icsc, members, NULL);
+    }
+    return 0;
+}
+
+static int icsc_group_update(icsc_ptr icsc, uint8_t group, int join) {
+    if (icsc == NULL || group < ICSC_GROUP_FIRST || group == icsc->station) {
+        return -1;
+    }
+
+    // The read thread tests single bytes, so each change is atomic.
+    if (join) {
+        __atomic_or_fetch(&icsc->members[group >> 3], 1 << (group & 7), __ATOMIC_RELAXED);
+    } else {
+        __atomic_and_fetch(&icsc->members[group >> 3], ~(1 << (group & 7)), __ATOMIC_RELAXED);
+    }
+
+    return icsc_members_changed(icsc);
+}
+
+int icsc_join_group(icsc_ptr icsc, uint8_t group) {
+    return icsc_group_update(icsc, group, 1);
+}
+
+int icsc_leave_group(icsc_ptr icsc, uint8_t group) {
+    return icsc_group_update(icsc, group, 0);
 }
 
-static int icsc_process(icsc_ptr icsc, unsigned long timeout) {
-    char inch;
+static int icsc_station_update(icsc_ptr icsc, uint8_t station, int claim) {
+    if (icsc == NULL || station == ICSC_BROADCAST || station >= ICSC_GROUP_FIRST) {
+        return -1;
+    }
+    if (station == icsc->station) {
+        return claim ? 0 : -1;
+    }
+
+    if (claim) {
+        __atomic_or_fetch(&icsc->members[station >> 3], 1 << (station & 7), __ATOMIC_RELAXED);
+    } else {
+        __atomic_and_fetch(&icsc->members[station >> 3], ~(1 << (station & 7)), __ATOMIC_RELAXED);
+    }
+
+    return icsc_members_changed(icsc);
+}
+
+int icsc_claim_station(icsc_ptr icsc, uint8_t station) {
+    return icsc_station_update(icsc, station, 1);
+}
+
+int icsc_release_station(icsc_ptr icsc, uint8_t station) {
+    return icsc_station_update(icsc, station, 0);
+}
+
+int icsc_set_stations(icsc_ptr icsc, const uint8_t *stations) {
+    uint8_t bits;
     int i;
-    command_ptr scan;
 
     if (icsc == NULL) {
         return -1;
     }
 
-    if (icsc->uartFD < 0) {
+    // Station numbers share the bitmap with broadcasts and groups. Each
+    // byte is stored whole, so the read thread never sees our own station
+    // or the broadcast address missing.
+    for (i = 0; i < (ICSC_GROUP_FIRST >> 3); i++) {
+        bits = (stations != NULL) ? stations[i] : 0;
+        if (i == (ICSC_BROADCAST >> 3)) {
+            bits |= 1 << (ICSC_BROADCAST & 7);
+        }
+        if (i == (icsc->station >> 3)) {
+            bits |= 1 << (icsc->station & 7);
+        }
+        __atomic_store_n(&icsc->members[i], bits, __ATOMIC_RELAXED);
+    }
+
+    return icsc_members_changed(icsc);
+}
+
+int icsc_send_array_from(icsc_ptr icsc, uint8_t origin, uint8_t station, char command, uint8_t len, const char *data) {
+    if (icsc == NULL || origin == ICSC_BROADCAST || origin >= ICSC_GROUP_FIRST || !ICSC_MEMBER(icsc, origin)) {
+        return -1;
+    }
+    return icsc_send_raw(icsc, origin, station, command, len, data);
+}
+
+int icsc_in_group(icsc_ptr icsc, uint8_t group) {
+    if (icsc == NULL || group < ICSC_GROUP_FIRST) {
         return -1;
     }
+    return ICSC_MEMBER(icsc, group) ? 1 : 0;
+}
+
+// On a half-duplex line, turning the driver on in the middle of a frame
+// would destroy it, so wait for the frame to finish or time out.
+static void icsc_wait_rx_idle(icsc_ptr icsc) {
+    unsigned long byteTime = icsc_frame_time(icsc, 1) - icsc_frame_time(icsc, 0);
+    uint64_t deadline = icsc_micros() + icsc_frame_time(icsc, 255) + icsc->rxTimeout;
+    uint64_t now;
+
+    if (byteTime == 0) {
+        return;
+    }
 
-    if (icsc_serial_wait_available(icsc->uartFD, timeout) <= 0) {
+    // Only the read thread clears the flag, so it must never wait for it.
+    if (!icsc->threadless && pthread_equal(pthread_self(), icsc->readThread)) {
+        return;
+    }
+
+    if (icsc->threadless) {
+        // Nor must whoever is inside icsc_process(), such as a timer or a
+        // callback sending from the host loop.
+        if (__atomic_load_n(&icsc->processing, __ATOMIC_ACQUIRE) && pthread_equal(pthread_self(), icsc->processThread)) {
+            return;
+        }
+
+        // With nobody reading, the flag stays set until the host loop polls
+        // again. Parsing here would run callbacks under the tx arbiter, so
+        // just sleep until the frame should have finished on the line and
+        // leave its bytes for the next poll.
+        if (!__atomic_exchange_n(&icsc->processing, 1, __ATOMIC_ACQUIRE)) {
+            if (icsc->rxBusy && icsc->recDeadline > icsc->rxTimeout) {
+                deadline = icsc->recDeadline - icsc->rxTimeout;
+                now = icsc_micros();
+                if (now < deadline) {
+                    usleep(deadline - now);
+                }
+            }
+            __atomic_store_n(&icsc->processing, 0, __ATOMIC_RELEASE);
+            return;
+        }
+    }
+
+    while (__atomic_load_n(&icsc->rxBusy, __ATOMIC_RELAXED) && icsc_micros() < deadline) {
+        usleep(byteTime);
+    }
+}
+
+int icsc_write_link(icsc_ptr icsc, const uint8_t *frame, int len) {
+    int rc;
+
+    pthread_mutex_lock(&icsc->uartMutex);
+    ICSC_PROBE1(tx_lock, icsc);
+
+    icsc_assert_de(icsc);
+    ICSC_PROBE1(de_assert, icsc);
+    rc = icsc->transport->write(icsc->transportData, frame, len) == len ? 0 : -1;
+    icsc->transport->drain(icsc->transportData);
+    ICSC_PROBE2(tx_drained, icsc, rc);
+    icsc_deassert_de(icsc);
+    ICSC_PROBE1(de_release, icsc);
+
+    if (rc == 0) {
+        icsc->stats.txFrames++;
+        icsc->stats.txBytes += frame[ICSC_SOH_START_COUNT + 3];
+    } else {
+        icsc->stats.txErrors++;
+    }
+
+    pthread_mutex_unlock(&icsc->uartMutex);
+    return rc;
+}
+
+int icsc_write_frame(icsc_ptr icsc, const uint8_t *frame, int len) {
+    uint8_t *priorities;
+    int priority = ICSC_PRIORITY_NORMAL;
+    int rc;
+
+    if (icsc->transportData == NULL) {
+        return -1;
+    }
+
+    if (icsc->promiscuous == ICSC_PROMISCUOUS_PASSIVE) {
+        return -1;
+    }
+
+    ICSC_PROBE4(tx_start, icsc, frame[ICSC_SOH_START_COUNT], frame[ICSC_SOH_START_COUNT + 2], frame[ICSC_SOH_START_COUNT + 3]);
+
+    priorities = __atomic_load_n(&icsc->priorities, __ATOMIC_ACQUIRE);
+    if (priorities != NULL) {
+        priority = __atomic_load_n(&priorities[frame[ICSC_SOH_START_COUNT + 2]], __ATOMIC_RELAXED);
+    }
+
+    __atomic_add_fetch(&icsc->txWaiting, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&icsc->txPending, len, __ATOMIC_SEQ_CST);
+    icsc_tx_acquire(icsc, priority);
+
+    rc = 0;
+    if (icsc->tdma != NULL) {
+        rc = icsc_tdma_wait(icsc, frame[ICSC_SOH_START_COUNT + 3]);
+    }
+    __atomic_sub_fetch(&icsc->txWaiting, 1, __ATOMIC_RELAXED);
+
+    if (rc == 0 && icsc->dePin >= 0) {
+        icsc_wait_rx_idle(icsc);
+    }
+
+    // From here on the kernel's output queue accounts for the frame.
+    __atomic_sub_fetch(&icsc->txPending, len, __ATOMIC_SEQ_CST);
+
+    if (rc == 0) {
+        rc = icsc_write_link(icsc, frame, len);
+    } else {
+        icsc->stats.txErrors++;
+    }
+
+    icsc_tx_release(icsc);
+
+    if (icsc->flow != NULL) {
+        icsc_flow_check(icsc);
+    }
+    return rc;
+}
+
+int icsc_send_raw(icsc_ptr icsc, uint8_t origin, uint8_t station, char command, uint8_t len, const char *data) {
+    uint8_t frame[ICSC_MAX_FRAME];
+    int flen;
+
+    if (icsc->transportData == NULL) {
+        return -1;
+    }
+
+    flen = icsc_build_frame(frame, origin, station, command, len, data);
+    return icsc_write_frame(icsc, frame, flen);
+}
+
+unsigned long icsc_frame_time(icsc_ptr icsc, uint8_t len) {
+    unsigned long rate = icsc_serial_baud_rate(icsc->baud);
+
+    if (rate == 0) {
         return 0;
     }
 
-    while (icsc_serial_available(icsc->uartFD) > 0) {
-        inch = icsc_serial_read(icsc->uartFD);
+    // Ten bits per byte: start, eight data bits and stop.
+    return ((unsigned long long)(ICSC_SOH_START_COUNT + 8 + len) * 10 * 1000000 + rate - 1) / rate;
+}
 
-        icsc_debug("Received 0x%02x from FD %d in phase %d\n", inch, icsc->uartFD, icsc->recPhase);
+void icsc_waiter_add(icsc_ptr icsc, icsc_waiter_t *waiter, uint8_t station, uint8_t command) {
+    waiter->station = station;
+    waiter->command = command;
+    waiter->done = 0;
+    waiter->len = 0;
 
-        switch (icsc->recPhase) {
-            case 0: // Looking for header
-                memcpy(&(icsc->header[0]), &(icsc->header[1]), 5);
-                icsc->header[5] = inch;
-                if ((icsc->header[0] == SOH) && (icsc->header[5] == STX) && (icsc->header[1] != icsc->header[2])) {
-                    icsc->recCalcCS = 0;
-                    icsc->recStation = icsc->header[1];
-                    icsc->recSender = icsc->header[2];
-                    icsc->recCommand = icsc->header[3];
-                    icsc->recLen = icsc->header[4];
+    pthread_mutex_lock(&icsc->replyMutex);
+    waiter->next = icsc->waiters;
+    icsc->waiters = waiter;
+    pthread_mutex_unlock(&icsc->replyMutex);
+}
 
-                    icsc_debug("Found valid header from %d to %d\n", icsc->recSender, icsc->recStation);
-                    pthread_mutex_lock(&icsc->uartMutex);
+int icsc_waiter_wait(icsc_ptr icsc, icsc_waiter_t *waiter, unsigned long timeout) {
+    icsc_waiter_t **scan;
+    struct timespec ts;
+    uint64_t deadline;
+    uint64_t now;
+    int done;
+
+    // With no read thread, the answer only arrives if we read it ourselves.
+    // If the parser is already busy (we are in a callback, or another
+    // thread is polling) wait for it to deliver the answer instead.
+    if (icsc->threadless && !__atomic_exchange_n(&icsc->processing, 1, __ATOMIC_ACQUIRE)) {
+        deadline = icsc_micros() + timeout;
+        while (!waiter->done && (now = icsc_micros()) < deadline) {
+            if (icsc_process(icsc, deadline - now) < 0) {
+                break;
+            }
+        }
+        __atomic_store_n(&icsc->processing, 0, __ATOMIC_RELEASE);
+        timeout = 0;
+    }
 
-                    for (i = 1; i < 5; i++) {
-                        icsc->recCalcCS += icsc->header[i];
-                    }
-                    icsc->recPhase = 1;
-                    icsc->recPos = 0;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_sec += timeout / 1000000;
+    ts.tv_nsec += (timeout % 1000000) * 1000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
 
-                    if ((icsc->recStation != icsc->station) &&
-                        (icsc->recStation != ICSC_BROADCAST ||
-                         icsc->recStation != ICSC_SYS_RELAY )) {
-                        icsc_reset(icsc);
-                        break;
-                    }
+    pthread_mutex_lock(&icsc->replyMutex);
 
-                    icsc_debug("Packet is for me!\n");
+    while (!waiter->done) {
+        if (pthread_cond_timedwait(&icsc->replyCond, &icsc->replyMutex, &ts) != 0) {
+            break;
+        }
+    }
+
+    done = waiter->done;
 
-                    if (icsc->recLen == 0) {
-                        icsc_debug("No payload. Skipping to phase 2\n");
-                        icsc->recPhase = 2;
+    for (scan = &icsc->waiters; *scan; scan = &(*scan)->next) {
+        if (*scan == waiter) {
+            *scan = waiter->next;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&icsc->replyMutex);
+    return done;
+}
+
+void icsc_waiter_complete(icsc_ptr icsc, uint8_t sender, uint8_t command, uint8_t len, const char *data) {
+    icsc_waiter_t *scan;
+    int woken = 0;
+
+    if (icsc->waiters == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&icsc->replyMutex);
+    for (scan = icsc->waiters; scan; scan = scan->next) {
+        if ((scan->done == 0) && (scan->station == sender) && (scan->command == command)) {
+            scan->when = icsc_micros();
+            scan->len = len;
+            if (len > 0) {
+                memcpy(scan->data, data, len);
+            }
+            scan->done = 1;
+            woken = 1;
+        }
+    }
+    if (woken) {
+        pthread_cond_broadcast(&icsc->replyCond);
+    }
+    pthread_mutex_unlock(&icsc->replyMutex);
+}
+
+int icsc_send_frame(icsc_ptr icsc, icsc_frame_t *frame, uint8_t station, char command, uint8_t len) {
+    int flen;
+
+    if (icsc == NULL || frame == NULL) {
+        return -1;
+    }
+
+    flen = icsc_finish_frame(frame->data, icsc->station, station, command, len);
+    return icsc_write_frame(icsc, frame->data, flen);
+}
+
+static int icsc_respond_to_ping(icsc_ptr icsc, uint8_t origin, uint8_t station, uint8_t len, const char *data) {
+    return icsc_send_raw(icsc, origin, station, ICSC_SYS_PONG, len, data);
+}
+
+// Replies come from the station a frame was sent to, unless that was a
+// broadcast or a group.
+static uint8_t icsc_reply_origin(icsc_ptr icsc) {
+    if (icsc->recStation == ICSC_BROADCAST || icsc->recStation >= ICSC_GROUP_FIRST) {
+        return icsc->station;
+    }
+    return icsc->recStation;
+}
+
+int icsc_dispatch(icsc_ptr icsc, uint8_t station, uint8_t sender, char command, uint8_t len, char *data, int inQueue) {
+    command_ptr scan;
+
+    icsc_waiter_complete(icsc, sender, command, len, data);
+
+    // Conflated commands only keep their newest value.
+    if (icsc->conflate != NULL && icsc_conflate_update(icsc, sender, command, len, data)) {
+        return 0;
+    }
+
+    for (scan = icsc->commandList; scan; scan = scan->next) {
+        if ((scan->commandCode == command || (uint8_t)scan->commandCode == ICSC_CATCH_ALL) && scan->callback) {
+            icsc_debug("Executing callback for command %c\n", scan->commandCode);
+            scan->callback(icsc, sender, command, len, data);
+        }
+        if ((scan->commandCode == command || (uint8_t)scan->commandCode == ICSC_CATCH_ALL) && scan->callbackArg) {
+            icsc_debug("Executing callback for command %c\n", scan->commandCode);
+            scan->callbackArg(icsc, sender, command, len, data, scan->arg);
+        }
+        if ((scan->commandCode == command || (uint8_t)scan->commandCode == ICSC_CATCH_ALL) && scan->callbackStation) {
+            icsc_debug("Executing callback for command %c\n", scan->commandCode);
+            scan->callbackStation(icsc, station, sender, command, len, data, scan->arg);
+        }
+    }
+
+    if (inQueue) {
+        icsc_recv_publish(icsc, station, sender, command, len);
+    }
+    return 1;
+}
+
+static void icsc_receive(icsc_ptr icsc, char inch) {
+    int i;
+
+    icsc_debug("Received 0x%02x in phase %d\n", inch, icsc->recPhase);
+
+    switch (icsc->recPhase) {
+        case 0: // Looking for header
+            memmove(&(icsc->header[0]), &(icsc->header[1]), 5);
+            icsc->header[5] = inch;
+            if ((icsc->header[0] == SOH) && (icsc->header[5] == STX) && (icsc->header[1] != icsc->header[2])) {
+                icsc->recCalcCS = 0;
+                icsc->recStation = icsc->header[1];
+                icsc->recSender = icsc->header[2];
+                icsc->recCommand = icsc->header[3];
+                icsc->recLen = icsc->header[4];
+
+                icsc_debug("Found valid header from %d to %d\n", icsc->recSender, icsc->recStation);
+                ICSC_PROBE5(rx_header, icsc, icsc->recSender, icsc->recStation, icsc->recCommand, icsc->recLen);
+                __atomic_store_n(&icsc->rxBusy, 1, __ATOMIC_RELAXED);
+
+                // The rest of the frame must follow within its own frame time.
+                if (icsc_frame_time(icsc, 0) != 0) {
+                    icsc->recDeadline = icsc_micros() + icsc_frame_time(icsc, icsc->recLen) + icsc->rxTimeout;
+                } else {
+                    icsc->recDeadline = 0;
+                }
+
+                for (i = 1; i < 5; i++) {
+                    icsc->recCalcCS += icsc->header[i];
+                }
+                icsc->recPhase = 1;
+                icsc->recPos = 0;
+
+                icsc->recForward = 0;
+                icsc->recMonitorOnly = 0;
+                if (!ICSC_MEMBER(icsc, icsc->recStation)) {
+                    if (icsc->routes != NULL && icsc_route_exists(icsc, icsc->recStation)) {
+                        icsc_debug("Packet is for routed station %d\n", icsc->recStation);
+                        icsc->recForward = 1;
+                    } else if (icsc->promiscuous) {
+                        icsc_debug("Packet is for station %d; monitoring it\n", icsc->recStation);
+                        icsc->recMonitorOnly = 1;
                     } else {
-                        icsc_debug("Payload length %d\n", icsc->recLen);
-                        icsc->buffer = (char *)malloc(icsc->recLen);
+                        icsc_reset(icsc);
+                        break;
                     }
+                } else {
+                    icsc_debug("Packet is for me!\n");
                 }
-                break;
 
-            case 1: // Receive data
-                icsc->buffer[icsc->recPos++] = inch;
-                icsc->recCalcCS += inch;
-                if (icsc->recPos == icsc->recLen) {
-                    icsc_debug("Finished receiving data\n");
-                    icsc->recPhase = 2;
+                // Frames for us are received straight into the receive queue
+                // when there is one. Aggregate frames are split into it later.
+                if (!icsc->recForward && !icsc->recMonitorOnly && icsc->recvQueue != NULL && icsc->recCommand != ICSC_SYS_AGGR) {
+                    icsc->buffer = icsc_recv_claim(icsc);
+                    icsc->recInQueue = (icsc->buffer != NULL);
                 }
-                break;
 
-            case 2: // Check for ETX
-                if (inch == ETX) {
-                    icsc_debug("Got ETX\n");
-                    icsc->recPhase = 3;
+                if (icsc->recLen == 0) {
+                    icsc_debug("No payload. Skipping to phase 2\n");
+                    ICSC_PROBE2(rx_payload, icsc, 0);
+                    icsc->recPhase = 2;
                 } else {
-                    icsc_debug("Expecting ETX but got 0x%02x\n", inch);
-                    icsc_reset(icsc);
+                    icsc_debug("Payload length %d\n", icsc->recLen);
+                    if (icsc->buffer == NULL) {
+                        icsc->buffer = (char *)malloc(icsc->recLen);
+                    }
                 }
-                break;
+            }
+            break;
+
+        case 1: // Receive data
+            icsc->buffer[icsc->recPos++] = inch;
+            icsc->recCalcCS += inch;
+            if (icsc->recPos == icsc->recLen) {
+                icsc_debug("Finished receiving data\n");
+                ICSC_PROBE2(rx_payload, icsc, icsc->recLen);
+                icsc->recPhase = 2;
+            }
+            break;
+
+        case 2: // Check for ETX
+            if (inch == ETX) {
+                icsc_debug("Got ETX\n");
+                icsc->recPhase = 3;
+            } else {
+                icsc_debug("Expecting ETX but got 0x%02x\n", inch);
+                icsc->stats.framingErrors++;
+                if (icsc->monitor != NULL) {
+                    icsc_monitor_frame(icsc, ICSC_MONITOR_FRAMING);
+                }
+                icsc_reset(icsc);
+            }
+            break;
+
+        case 3: // Grab the checksum
+            icsc->recCS = inch;
+            icsc->recPhase = 4;
+            icsc_debug("Received checksum byte of 0x%02x\n", inch);
+            break;
+
+        case 4: // Check for ETX and check the checksum.
+            // The frame has left the line, so senders need not wait for it
+            // any more. Clear this before dispatching: replies are sent from
+            // here and must not wait for a frame we have already read.
+            __atomic_store_n(&icsc->rxBusy, 0, __ATOMIC_RELAXED);
+            if (inch == EOT) {
+                icsc_debug("Got EOT\n");
+                ICSC_PROBE2(rx_checksum, icsc, icsc->recCS == icsc->recCalcCS);
+                if (icsc->recCS == icsc->recCalcCS) {
+                    icsc_debug("Checksum is valid.\n");
+
+                    if (icsc->monitor != NULL) {
+                        icsc_monitor_frame(icsc, ICSC_MONITOR_OK);
+                    }
 
-            case 3: // Grab the checksum
-                icsc->recCS = inch;
-                icsc->recPhase = 4;
-                icsc_debug("Received checksum byte of 0x%02x\n", inch);
-                break;
+                    if (icsc->recMonitorOnly) {
+                        icsc_reset(icsc);
+                        break;
+                    }
+
+                    icsc->stats.rxFrames++;
+                    icsc->stats.rxBytes += icsc->recLen;
+
+                    if (icsc->recForward) {
+                        icsc_relay_frame(icsc, icsc->recStation, icsc->recSender, icsc->recCommand, icsc->recLen, icsc->buffer);
+                        icsc_reset(icsc);
+                        break;
+                    }
 
-            case 4: // Check for ETX and check the checksum.
-                pthread_mutex_unlock(&icsc->uartMutex);
-                if (inch == EOT) {
-                    icsc_debug("Got EOT\n");
-                    if (icsc->recCS == icsc->recCalcCS) {
-                        icsc_debug("Checksum is valid.\n");
-
-                        switch (icsc->recCommand) {
-                            case ICSC_SYS_PING:
-                                icsc_debug("Responding to ping\n");
-                                icsc_respond_to_ping(icsc, icsc->recSender, icsc->recLen, icsc->buffer);
-                                break;
-                        }
-
-                        for (scan = icsc->commandList; scan; scan = scan->next) {
-                            if ((scan->commandCode == icsc->recCommand || scan->commandCode == ICSC_CATCH_ALL) && scan->callback) {
-                                icsc_debug("Executing callback for command %c\n", scan->commandCode);
-                                scan->callback(icsc, icsc->recSender, icsc->recCommand, icsc->recLen, icsc->buffer);
+                    ICSC_PROBE3(dispatch_start, icsc, icsc->recSender, icsc->recCommand);
+
+                    switch (icsc->recCommand) {
+                        case ICSC_SYS_PING:
+                            icsc_debug("Responding to ping\n");
+                            icsc_respond_to_ping(icsc, icsc_reply_origin(icsc), icsc->recSender, icsc->recLen, icsc->buffer);
+                            break;
+                        case ICSC_SYS_QSTAT:
+                            icsc_debug("Responding to status query\n");
+                            icsc_respond_to_status(icsc, icsc_reply_origin(icsc), icsc->recSender);
+                            break;
+                        case ICSC_SYS_SYNC:
+                            if (icsc->tdma != NULL) {
+                                icsc_tdma_sync(icsc, icsc->recLen, icsc->buffer);
+                            }
+                            break;
+                        case ICSC_SYS_RATE:
+                            icsc_rate_frame(icsc, icsc->recSender, icsc->recLen, icsc->buffer);
+                            break;
+                        case ICSC_SYS_BULK:
+                        case ICSC_SYS_BULK_NACK:
+                            if (icsc->bulk != NULL) {
+                                icsc_bulk_frame(icsc, icsc->recSender, icsc->recCommand, icsc->recLen, icsc->buffer);
+                            }
+                            break;
+                        case ICSC_SYS_RELAY:
+                            if (icsc->recLen >= 2) {
+                                icsc_debug("Relaying to station %d\n", (uint8_t)icsc->buffer[0]);
+                                icsc_relay_frame(icsc, icsc->buffer[0], icsc->recSender, icsc->buffer[1], icsc->recLen - 2, icsc->buffer + 2);
                             }
-                        }
+                            break;
+                    }
+
+                    if (icsc->discovery != NULL) {
+                        icsc_discover_seen(icsc, icsc->recSender);
+                    }
+
+                    if (icsc->rate != NULL && icsc->recCommand != ICSC_SYS_RATE) {
+                        icsc_rate_heard(icsc, icsc->recSender);
+                    }
+
+                    if (icsc->recCommand == ICSC_SYS_AGGR) {
+                        icsc_aggr_split(icsc, icsc->recStation, icsc->recSender, icsc->recLen, icsc->buffer);
                     } else {
-                        icsc_debug("Checksum isn't valid.\n");
+                        icsc_dispatch(icsc, icsc->recStation, icsc->recSender, icsc->recCommand, icsc->recLen, icsc->buffer, icsc->recInQueue);
                     }
-                } 
-                icsc_reset(icsc);
+
+                    ICSC_PROBE3(dispatch_end, icsc, icsc->recSender, icsc->recCommand);
+                } else {
+                    icsc_debug("Checksum isn't valid.\n");
+                    icsc->stats.checksumErrors++;
+                    if (icsc->monitor != NULL) {
+                        icsc_monitor_frame(icsc, ICSC_MONITOR_CHECKSUM);
+                    }
+                }
+            } else {
+                icsc->stats.framingErrors++;
+                if (icsc->monitor != NULL) {
+                    icsc_monitor_frame(icsc, ICSC_MONITOR_FRAMING);
+                }
+            }
+            icsc_reset(icsc);
+    }
+}
+
+// Give up on a frame whose remaining bytes have not arrived in time, so
+// that a lost byte cannot leave the parser waiting forever.
+static void icsc_check_timeout(icsc_ptr icsc, uint64_t now) {
+    if (icsc->recPhase != 0 && icsc->recDeadline != 0 && now > icsc->recDeadline) {
+        icsc_debug("Frame timed out in phase %d\n", icsc->recPhase);
+        icsc->stats.rxTimeouts++;
+        if (icsc->monitor != NULL) {
+            icsc_monitor_frame(icsc, ICSC_MONITOR_TIMEOUT);
         }
-            
+        icsc_reset(icsc);
     }
+}
 
-    return 0;
+// Wait for data on the link, or for icsc_wake(). Being woken looks like
+// a timeout.
+static int icsc_wait(icsc_ptr icsc, unsigned long timeout) {
+    struct pollfd pfd[2];
+    uint64_t count;
+    int rc;
+
+    if (icsc->wakeFd < 0) {
+        return icsc->transport->wait(icsc->transportData, timeout);
+    }
+
+    pfd[0].fd = icsc->transport->fd(icsc->transportData);
+    pfd[0].events = POLLIN;
+    pfd[1].fd = icsc->wakeFd;
+    pfd[1].events = POLLIN;
+    rc = poll(pfd, 2, (timeout + 999) / 1000);
+    if (rc < 0) {
+        return (errno == EINTR) ? 0 : -1;
+    }
+    if (pfd[1].revents & POLLIN) {
+        if (read(icsc->wakeFd, &count, sizeof(count)) < 0) {
+            icsc_debug("Cannot clear wakeup: %s\n", strerror(errno));
+        }
+    }
+    if (pfd[0].revents & POLLIN) {
+        return 1;
+    }
+    return (pfd[0].revents & (POLLHUP | POLLERR | POLLNVAL)) ? -1 : 0;
+}
+
+// Make the read thread come back from waiting for data straight away.
+static void icsc_wake(icsc_ptr icsc) {
+    uint64_t one = 1;
+
+    if (icsc->wakeFd >= 0) {
+        if (write(icsc->wakeFd, &one, sizeof(one)) < 0) {
+            icsc_debug("Cannot wake read thread: %s\n", strerror(errno));
+        }
+    } else if (icsc->transport->wake != NULL) {
+        icsc->transport->wake(icsc->transportData);
+    }
+}
+
+int icsc_process(icsc_ptr icsc, unsigned long timeout) {
+    uint8_t buf[256];
+    ssize_t len;
+    uint64_t now;
+    int rc;
+    int i;
+
+    if (icsc == NULL) {
+        return -1;
+    }
+
+    if (icsc->transportData == NULL) {
+        return -1;
+    }
+
+    if (icsc->threadless) {
+        icsc->processThread = pthread_self();
+    }
+
+    if (icsc->recPhase != 0 && icsc->recDeadline != 0) {
+        now = icsc_micros();
+        if (now < icsc->recDeadline && icsc->recDeadline - now < timeout) {
+            timeout = icsc->recDeadline - now + 1;
+        }
+    }
+    if (icsc->flow != NULL && icsc_flow_blocked(icsc) && timeout > ICSC_FLOW_RECHECK_TIME) {
+        timeout = ICSC_FLOW_RECHECK_TIME;
+    }
+
+    rc = icsc_wait(icsc, timeout);
+    if (rc <= 0) {
+        pthread_mutex_lock(&icsc->parseMutex);
+        icsc_check_timeout(icsc, icsc_micros());
+        if (icsc->rate != NULL) {
+            icsc_rate_check(icsc, 0);
+        }
+        pthread_mutex_unlock(&icsc->parseMutex);
+        if (icsc->flow != NULL) {
+            icsc_flow_check(icsc);
+        }
+        return rc;
+    }
+
+    // icsc_reconfigure() takes this to change settings between reads.
+    // Bytes that are already here may be the rest of a frame that arrived
+    // in time while we were late reading it, so they are always parsed. A
+    // frame only times out above, when a wait ends with nothing to read.
+    pthread_mutex_lock(&icsc->parseMutex);
+    do {
+        len = icsc->transport->read(icsc->transportData, buf, sizeof(buf));
+        for (i = 0; i < len; i++) {
+            icsc_receive(icsc, buf[i]);
+        }
+        if (icsc->rate != NULL && len >= 0) {
+            icsc_rate_check(icsc, len);
+        }
+    } while (len == sizeof(buf));
+    pthread_mutex_unlock(&icsc->parseMutex);
+
+    if (icsc->flow != NULL) {
+        icsc_flow_check(icsc);
+    }
+    return (len < 0) ? -1 : 0;
 }
 
 static void *icsc_read_thread(void *arg) {
@@ -220,15 +887,75 @@ static void *icsc_read_thread(void *arg) {
 
     icsc_debug("Read thread executing\n");
 
-    icsc->readThreadRunning = 1;
-    while (icsc->readThreadRunning == 1) {
-        icsc_process(icsc, 100000); // 100ms timeout
+    while (__atomic_load_n(&icsc->readThreadRunning, __ATOMIC_ACQUIRE)) {
+        if (icsc_process(icsc, 100000) < 0) { // 100ms timeout
+            // The link has hung up or failed, and would only fail again
+            // straight away. Sending still reports its own errors.
+            icsc_error("Link failed; no longer receiving\n");
+            break;
+        }
     }
 
     icsc_debug("Read thread finishing\n");
+    return NULL;
 }
 
-int icsc_register_command(icsc_ptr icsc, char command, callbackFunction func) {
+int icsc_get_fd(icsc_ptr icsc, short *events) {
+    if (icsc == NULL || icsc->transportData == NULL || icsc->transport->fd == NULL) {
+        return -1;
+    }
+    if (events != NULL) {
+        *events = POLLIN;
+    }
+    return icsc->transport->fd(icsc->transportData);
+}
+
+int icsc_poll_once(icsc_ptr icsc) {
+    int rc;
+
+    if (icsc == NULL || !icsc->threadless) {
+        return -1;
+    }
+
+    // Someone is already reading, so there is nothing for us to do.
+    if (__atomic_exchange_n(&icsc->processing, 1, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+    rc = icsc_process(icsc, 0);
+    __atomic_store_n(&icsc->processing, 0, __ATOMIC_RELEASE);
+
+    if (icsc->aggr != NULL) {
+        icsc_aggr_poll(icsc);
+    }
+    return rc;
+}
+
+long icsc_next_timeout(icsc_ptr icsc) {
+    uint64_t next = 0;
+    uint64_t now;
+
+    if (icsc == NULL) {
+        return -1;
+    }
+
+    if (icsc->recPhase != 0 && icsc->recDeadline != 0) {
+        next = icsc->recDeadline + 1;
+    }
+    if (icsc->rate != NULL && (next == 0 || icsc_rate_next(icsc) < next)) {
+        next = icsc_rate_next(icsc);
+    }
+    if (icsc->aggr != NULL && icsc_aggr_next(icsc) != 0 && (next == 0 || icsc_aggr_next(icsc) < next)) {
+        next = icsc_aggr_next(icsc);
+    }
+
+    if (next == 0) {
+        return -1;
+    }
+    now = icsc_micros();
+    return next > now ? (long)(next - now) : 0;
+}
+
+static int icsc_add_command(icsc_ptr icsc, char command, callbackFunction func, callbackArgFunction funcArg, callbackStationFunction funcStation, void *arg) {
     command_ptr newcmd;
     command_ptr scan;
 
@@ -241,6 +968,9 @@ int icsc_register_command(icsc_ptr icsc, char command, callbackFunction func) {
 
     newcmd->commandCode = command;
     newcmd->callback = func;
+    newcmd->callbackArg = funcArg;
+    newcmd->callbackStation = funcStation;
+    newcmd->arg = arg;
     newcmd->next = NULL;
 
     if (icsc->commandList == NULL) {
@@ -256,6 +986,18 @@ int icsc_register_command(icsc_ptr icsc, char command, callbackFunction func) {
     return 0;
 }
 
+int icsc_register_command(icsc_ptr icsc, char command, callbackFunction func) {
+    return icsc_add_command(icsc, command, func, NULL, NULL, NULL);
+}
+
+int icsc_register_command_arg(icsc_ptr icsc, char command, callbackArgFunction func, void *arg) {
+    return icsc_add_command(icsc, command, NULL, func, NULL, arg);
+}
+
+int icsc_register_command_station(icsc_ptr icsc, char command, callbackStationFunction func, void *arg) {
+    return icsc_add_command(icsc, command, NULL, NULL, func, arg);
+}
+
 int icsc_unregister_command(icsc_ptr icsc, char command) {
     command_ptr scan;
     command_ptr tmp;
@@ -286,8 +1028,30 @@ int icsc_unregister_command(icsc_ptr icsc, char command) {
     return 0;
 }
 
-icsc_ptr icsc_init_de(const char *uart, unsigned long baud, uint8_t station, int de) {
+int icsc_unregister_command_arg(icsc_ptr icsc, char command, callbackArgFunction func, void *arg) {
+    command_ptr *scan;
+    command_ptr tmp;
+
+    if (icsc == NULL) {
+        return -1;
+    }
+
+    for (scan = &icsc->commandList; *scan; scan = &(*scan)->next) {
+        if ((*scan)->commandCode == command && (*scan)->callbackArg == func && (*scan)->arg == arg) {
+            icsc_debug("Unregistered command for code '%c'\n", command);
+            tmp = (*scan)->next;
+            free(*scan);
+            *scan = tmp;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+static icsc_ptr icsc_open(const icsc_transport_t *transport, const char *path, unsigned long baud, uint8_t station, int de, int threaded) {
     icsc_ptr newicsc;
+    void *data;
     int rc;
 
     newicsc = (icsc_ptr)calloc(1, sizeof(icsc_t));
@@ -299,29 +1063,36 @@ icsc_ptr icsc_init_de(const char *uart, unsigned long baud, uint8_t station, int
 
     icsc_debug("Endpoint allocated\n");
 
-    // First try and open the UART.
-    newicsc->uartFD = icsc_serial_open(uart, baud);
-    if (newicsc->uartFD < 0) {
+    // First try and open the transport.
+    data = transport->open(path, baud);
+    if (data == NULL) {
         free(newicsc);
         return NULL;
     }
 
-    icsc_debug("UART %s Opened. FD: %d\n", uart, newicsc->uartFD);
+    icsc_debug("%s transport %s opened\n", transport->name, path);
 
+    newicsc->transport = transport;
+    newicsc->transportData = data;
+    newicsc->baud = baud;
     newicsc->station = station;
     newicsc->dePin = de;
+    newicsc->rxTimeout = ICSC_RX_TIMEOUT;
+    newicsc->wakeFd = -1;
+    ICSC_MEMBER_SET(newicsc, station);
+    ICSC_MEMBER_SET(newicsc, ICSC_BROADCAST);
 
     // If we have a GPIO pin specified then open it and set it to listen mode.
     if (newicsc->dePin >= 0) {
         rc = icsc_gpio_open(newicsc->dePin, ICSC_GPIO_OUTPUT);
         if (rc < 0) {
-            icsc_serial_close(newicsc->uartFD);
+            transport->close(data);
             free(newicsc);
             return NULL;
         }
         rc = icsc_gpio_write(newicsc->dePin, 0);
         if (rc < 0) {
-            icsc_serial_close(newicsc->uartFD);
+            transport->close(data);
             free(newicsc);
             return NULL;
         }
@@ -332,26 +1103,58 @@ icsc_ptr icsc_init_de(const char *uart, unsigned long baud, uint8_t station, int
     icsc_debug("Starting read thread\n");
 
     pthread_mutex_init(&newicsc->uartMutex, NULL);
+    pthread_mutex_init(&newicsc->parseMutex, NULL);
+    pthread_mutex_init(&newicsc->routeMutex, NULL);
+    pthread_cond_init(&newicsc->routeCond, NULL);
+    pthread_mutex_init(&newicsc->replyMutex, NULL);
+    pthread_mutex_init(&newicsc->txMutex, NULL);
+    pthread_cond_init(&newicsc->txCond, NULL);
+
+    pthread_condattr_t condattr;
+    pthread_condattr_init(&condattr);
+    pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
+    pthread_cond_init(&newicsc->replyCond, &condattr);
+    pthread_condattr_destroy(&condattr);
+
+    newicsc->started = icsc_micros();
+
+    if (!threaded) {
+        icsc_debug("No read thread; the application polls\n");
+        newicsc->threadless = 1;
+        return newicsc;
+    }
 
     pthread_attr_t attr;
     rc = pthread_attr_init(&attr);
     if (rc != 0) {
         fprintf(stderr, "ICSC: Cannot start read thread: %s\n", strerror(errno));
-        icsc_serial_close(newicsc->uartFD);
+        transport->close(data);
         free(newicsc);
         return NULL;
     }
 
+    // Lets icsc_close() and icsc_reconfigure() interrupt the wait for data.
+    // Links without a descriptor are woken through the transport instead.
+    if (transport->fd != NULL) {
+        newicsc->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (newicsc->wakeFd < 0) {
+            icsc_debug("No wakeup for the read thread: %s\n", strerror(errno));
+        }
+    }
+
+    // Set before the thread starts so an early icsc_close() is not missed.
+    newicsc->readThreadRunning = 1;
     rc = pthread_create(&newicsc->readThread, &attr, &icsc_read_thread, newicsc);
     if (rc != 0) {
         fprintf(stderr, "ICSC: Cannot start read thread: %s\n", strerror(errno));
-        icsc_serial_close(newicsc->uartFD);
+        if (newicsc->wakeFd >= 0) {
+            close(newicsc->wakeFd);
+        }
+        transport->close(data);
         free(newicsc);
         return NULL;
     }
 
-    pthread_detach(newicsc->readThread);
-
     pthread_attr_destroy(&attr);
 
     icsc_debug("Read thread started OK\n");
@@ -359,6 +1162,107 @@ icsc_ptr icsc_init_de(const char *uart, unsigned long baud, uint8_t station, int
     return newicsc;
 }
 
+icsc_ptr icsc_init_transport(const icsc_transport_t *transport, const char *path, unsigned long baud, uint8_t station, int de) {
+    return icsc_open(transport, path, baud, station, de, 1);
+}
+
+icsc_ptr icsc_init_threadless(const icsc_transport_t *transport, const char *path, unsigned long baud, uint8_t station, int de) {
+    return icsc_open(transport, path, baud, station, de, 0);
+}
+
+int icsc_get_config(icsc_ptr icsc, icsc_config_t *config) {
+    if (icsc == NULL || config == NULL) {
+        return -1;
+    }
+
+    config->baud = icsc->baud;
+    config->station = icsc->station;
+    config->de = icsc->dePin;
+    config->rxTimeout = icsc->rxTimeout;
+    return 0;
+}
+
+int icsc_reconfigure(icsc_ptr icsc, const icsc_config_t *config) {
+    icsc_gpiomem_ptr oldMem = NULL;
+    uint8_t oldStation;
+    int rc = 0;
+
+    if (icsc == NULL || config == NULL) {
+        return -1;
+    }
+
+    if (config->station == ICSC_BROADCAST || config->station >= ICSC_GROUP_FIRST) {
+        icsc_error("Station %d is not a station address\n", config->station);
+        return -1;
+    }
+
+    // Get the new pin ready first so a failure changes nothing.
+    if (config->de != icsc->dePin && config->de >= 0) {
+        if (icsc_gpio_open(config->de, ICSC_GPIO_OUTPUT) < 0 || icsc_gpio_write(config->de, 0) < 0) {
+            return -1;
+        }
+    }
+
+    // Stop the parser between reads, then let any frame being sent finish.
+    // Callbacks send while holding the parser, so it must be taken first.
+    pthread_mutex_lock(&icsc->parseMutex);
+    icsc_tx_acquire(icsc, ICSC_PRIORITY_NORMAL);
+    pthread_mutex_lock(&icsc->uartMutex);
+
+    if (config->baud != icsc->baud && icsc->transport->set_baud != NULL) {
+        rc = icsc->transport->set_baud(icsc->transportData, config->baud);
+    }
+
+    oldStation = icsc->station;
+    if (rc == 0) {
+        icsc->baud = config->baud;
+        icsc->rxTimeout = config->rxTimeout;
+
+        if (config->de != icsc->dePin) {
+            // A register mapping is for the old pin only. The old pin itself
+            // is left driven low, as icsc_close() leaves it.
+            oldMem = icsc->deMem;
+            icsc->deMem = NULL;
+            icsc->dePin = config->de;
+        }
+
+        if (config->station != oldStation) {
+            __atomic_and_fetch(&icsc->members[oldStation >> 3], ~(1 << (oldStation & 7)), __ATOMIC_RELAXED);
+            __atomic_or_fetch(&icsc->members[config->station >> 3], 1 << (config->station & 7), __ATOMIC_RELAXED);
+            icsc->station = config->station;
+        }
+
+        // Whatever was half received belongs to the old settings.
+        icsc_reset(icsc);
+    } else if (config->de != icsc->dePin && config->de >= 0) {
+        icsc_gpio_close(config->de);
+    }
+
+    pthread_mutex_unlock(&icsc->uartMutex);
+    icsc_tx_release(icsc);
+    pthread_mutex_unlock(&icsc->parseMutex);
+
+    if (rc < 0) {
+        icsc_error("Cannot change baud rate: %s\n", strerror(errno));
+        return -1;
+    }
+
+    icsc_gpiomem_close(oldMem);
+
+    // The read thread may be waiting with a timeout worked out from the
+    // old settings.
+    icsc_wake(icsc);
+
+    if (config->station != oldStation) {
+        return icsc_members_changed(icsc);
+    }
+    return 0;
+}
+
+icsc_ptr icsc_init_de(const char *uart, unsigned long baud, uint8_t station, int de) {
+    return icsc_init_transport(&icsc_transport_serial, uart, baud, station, de);
+}
+
 icsc_ptr icsc_init(const char *uart, unsigned long baud, uint8_t station) {
     return icsc_init_de(uart, baud, station, -1);
 }
@@ -388,6 +1292,21 @@ int icsc_send_char(icsc_ptr icsc, uint8_t station, char command, int8_t data) {
 }
 
 
+int icsc_send_relay(icsc_ptr icsc, uint8_t gateway, uint8_t station, char command, uint8_t len, const char *data) {
+    char relay[255];
+
+    if (len > 253) {
+        return -1;
+    }
+
+    relay[0] = station;
+    relay[1] = command;
+    if (len > 0) {
+        memcpy(relay + 2, data, len);
+    }
+    return icsc_send_raw(icsc, icsc->station, gateway, ICSC_SYS_RELAY, len + 2, relay);
+}
+
 int icsc_broadcast_array(icsc_ptr icsc, char command, uint8_t len, const char *data) {
     return icsc_send_raw(icsc, icsc->station, ICSC_BROADCAST, command, len, data);
 }
@@ -413,17 +1332,36 @@ int icsc_broadcast_char(icsc_ptr icsc, char command, int8_t data) {
 }
 
 int icsc_close(icsc_ptr icsc) {
-    void *res;
     if (icsc == NULL) {
         return -1;
     }
 
     icsc_debug("Closing ICSC channel\n");
 
-    icsc->readThreadRunning = 0;
-    pthread_join(icsc->readThread, &res);
+    if (icsc->discovery != NULL) {
+        icsc_discover_stop(icsc);
+    }
+
+    if (icsc->tdma != NULL) {
+        icsc_tdma_stop(icsc);
+    }
+
+    if (icsc->aggr != NULL) {
+        icsc_flush(icsc);
+        icsc_aggr_free(icsc);
+    }
+
+    if (!icsc->threadless) {
+        __atomic_store_n(&icsc->readThreadRunning, 0, __ATOMIC_RELEASE);
+        icsc_wake(icsc);
+        pthread_join(icsc->readThread, NULL);
+
+        icsc_debug("Read thread joined\n");
+    }
 
-    icsc_debug("Read thread joined\n");
+    if (icsc->wakeFd >= 0) {
+        close(icsc->wakeFd);
+    }
 
     if (icsc->commandList != NULL) {
         command_ptr scan;
@@ -438,12 +1376,32 @@ int icsc_close(icsc_ptr icsc) {
 
     }
 
+    icsc_route_free(icsc);
+    free(icsc->statusExt);
+    free(icsc->discovery);
+    free(icsc->priorities);
+    free(icsc->tdma);
+    icsc_rate_free(icsc);
+    icsc_conflate_free(icsc);
+    free(icsc->flow);
+    icsc_bulk_free(icsc);
+    icsc_monitor_free(icsc);
+    icsc_recv_free(icsc);
+    icsc_gpiomem_close(icsc->deMem);
+
+    icsc->transport->close(icsc->transportData);
+
     free(icsc);
     icsc_debug("Memory freed up\n");
     return 0;
 }
 
 int icsc_reset(icsc_ptr icsc) {
+    if (icsc->recInQueue) {
+        // The slot belongs to the receive queue and is simply reused.
+        icsc->buffer = NULL;
+        icsc->recInQueue = 0;
+    }
     if (icsc->buffer != NULL) {
         free(icsc->buffer);
         icsc->buffer = NULL;
@@ -454,7 +1412,7 @@ int icsc_reset(icsc_ptr icsc) {
     icsc->recCommand = 0;
     icsc->recCS = 0;
     icsc->recCalcCS = 0;
-    pthread_mutex_unlock(&icsc->uartMutex);
+    __atomic_store_n(&icsc->rxBusy, 0, __ATOMIC_RELAXED);
     return 0;
 }
 
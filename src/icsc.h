@@ -54,6 +54,16 @@ extern "C" {
 #define ICSC_SYS_QSTAT  0x07
 #define ICSC_SYS_RSTAT  0x08
 #define ICSC_SYS_RELAY  0x09
+#define ICSC_SYS_SYNC   0x0A
+#define ICSC_SYS_RATE   0x0B
+#define ICSC_SYS_AGGR   0x0C
+#define ICSC_SYS_BULK   0x0D
+#define ICSC_SYS_BULK_NACK 0x0E
+
+// Station numbers from here up are group addresses. See icsc_join_group().
+#define ICSC_GROUP_FIRST 0xE0
+#define ICSC_GROUP_LAST  0xFF
+#define ICSC_GROUP(n)    (ICSC_GROUP_FIRST + (n))
 
 //When this is used during registerCommand all message will pushed
 //to the callback function
@@ -69,18 +79,109 @@ extern "C" {
 //Increase or decrease the number to your needs
 #define ICSC_SOH_START_COUNT 1
 
+// The largest frame that can appear on the wire: SOH(s), station, sender,
+// command, length, STX, 255 bytes of payload, ETX, checksum and EOT.
+#define ICSC_MAX_FRAME (ICSC_SOH_START_COUNT + 8 + 255)
+
+// Microseconds a frame may run over its own frame time before the receiver
+// gives up on it. Covers scheduling and UART FIFO delays. It only gives up
+// once the link has gone quiet, so a reader that is late does not lose a
+// frame whose end is already waiting to be read.
+#define ICSC_RX_TIMEOUT 20000
+
+// Transmit priority classes, most urgent first. See icsc_set_priority().
+#define ICSC_PRIORITY_CONTROL 0
+#define ICSC_PRIORITY_NORMAL 1
+#define ICSC_PRIORITY_BULK 2
+#define ICSC_PRIORITY_COUNT 3
+
 struct icsc_command;
+struct icsc_route;
 
 typedef struct icsc_command command_t;
 typedef struct icsc_command *command_ptr;
+typedef struct icsc_route icsc_route_t;
+
+struct icsc_waiter;
+struct icsc_status_ext;
+struct icsc_discovery;
+struct icsc_recv_queue;
+struct icsc_tdma;
+struct icsc_rate;
+struct icsc_conflate;
+struct icsc_monitor;
+struct icsc_flow;
+struct icsc_aggr;
+struct icsc_bulk;
+
+/*! \brief Running totals kept by every ICSC context */
+typedef struct {
+    uint32_t rxFrames;          /*!< Valid frames received for this context (including relayed ones) */
+    uint32_t rxBytes;           /*!< Payload bytes in those frames */
+    uint32_t txFrames;          /*!< Frames written to the link */
+    uint32_t txBytes;           /*!< Payload bytes in those frames */
+    uint32_t checksumErrors;    /*!< Frames dropped because the checksum was wrong */
+    uint32_t framingErrors;     /*!< Frames dropped because ETX or EOT was missing */
+    uint32_t rxTimeouts;        /*!< Frames abandoned because the rest of the frame never arrived */
+    uint32_t txErrors;          /*!< Frames that could not be written to the link */
+    uint32_t rxOverruns;        /*!< Frames not queued because the receive queue was full */
+    uint32_t txRefused;         /*!< Sends refused by icsc_try_send_array() above the high-water mark */
+    uint32_t controlFrames;     /*!< Frames sent in the control priority class */
+    uint32_t controlWaitMax;    /*!< Longest time a control frame waited for the link, in microseconds */
+    uint64_t controlWaitTotal;  /*!< Total time control frames waited for the link, in microseconds */
+} icsc_stats_t;
+
+/*! \brief Operations that connect an ICSC context to the link it talks over
+ *
+ *  The library ships icsc_transport_serial (the default, used by icsc_init()
+ *  and icsc_init_de()), icsc_transport_socket and icsc_transport_memory.
+ *  Further links can be added by filling in a structure of this type and
+ *  passing it to icsc_init_transport().
+ */
+typedef struct {
+    /*! Name of the transport, used in debug messages */
+    const char *name;
+    /*! Open the link. Returns private data passed to the other operations, or NULL on error. */
+    void *(*open)(const char *path, unsigned long baud);
+    /*! Read up to len bytes that have already arrived without blocking. Returns the number read, or -1 on error. */
+    ssize_t (*read)(void *data, uint8_t *buf, size_t len);
+    /*! Write all len bytes. Returns len, or -1 on error. */
+    ssize_t (*write)(void *data, const uint8_t *buf, size_t len);
+    /*! Wait until everything written has left the link. Returns 0, or -1 on error. */
+    int (*drain)(void *data);
+    /*! Wait up to timeout microseconds for data. Returns 1 if data is available, 0 on timeout, -1 on error. */
+    int (*wait)(void *data, unsigned long timeout);
+    /*! Close the link and free the private data. */
+    void (*close)(void *data);
+    /*! Change the baud rate once everything written has left. Returns 0, or -1 on error. NULL if the link has no baud rate. */
+    int (*set_baud)(void *data, unsigned long baud);
+    /*! Bytes written but not yet sent. Returns the count, or -1 on error. NULL if the link cannot tell. */
+    int (*outq)(void *data);
+    /*! A descriptor that polls readable when data arrives. NULL if the link has none. */
+    int (*fd)(void *data);
+    /*! Make a wait in progress, or the next one, return at once. Only used when fd is NULL; may be NULL. */
+    void (*wake)(void *data);
+} icsc_transport_t;
+
+/*! \brief Settings that icsc_reconfigure() can change on a running context */
+typedef struct {
+    unsigned long baud;         /*!< The baud rate symbolic name in the form Bxxxx */
+    uint8_t station;            /*!< The station number of this device */
+    int de;                     /*!< The GPIO number of the RS-485 DE pin, or -1 for none */
+    unsigned long rxTimeout;    /*!< Microseconds a frame may run over its frame time, normally ICSC_RX_TIMEOUT */
+} icsc_config_t;
 
 typedef struct {
-    int uartFD;
+    const icsc_transport_t *transport;
+    void *transportData;
+    unsigned long baud;
     int dePin;
+    struct icsc_gpiomem *deMem;
     command_ptr commandList;
     uint8_t station;
+    uint8_t members[32];
 
-    char header[5];
+    char header[6];
 
     char *buffer;
 
@@ -92,19 +193,76 @@ typedef struct {
     uint8_t recSender;
     uint8_t recCS;
     uint8_t recCalcCS;
+    uint64_t recDeadline;
+    uint8_t rxBusy;
+    unsigned long rxTimeout;
+    pthread_mutex_t parseMutex;
 
     pthread_t readThread;
     int readThreadRunning;
+    int wakeFd;
+    uint8_t threadless;
+    uint8_t processing;
+    pthread_t processThread;
     pthread_mutex_t uartMutex;
+
+    icsc_route_t **routes;
+    pthread_mutex_t routeMutex;
+    pthread_cond_t routeCond;
+    uint8_t recForward;
+
+    icsc_stats_t stats;
+    uint64_t started;
+    uint32_t txWaiting;
+    uint32_t txPending;
+    struct icsc_flow *flow;
+    struct icsc_aggr *aggr;
+    struct icsc_bulk *bulk;
+    uint8_t *priorities;
+    pthread_mutex_t txMutex;
+    pthread_cond_t txCond;
+    uint8_t txBusy;
+    uint32_t txTicket[ICSC_PRIORITY_COUNT];
+    uint32_t txServing[ICSC_PRIORITY_COUNT];
+    struct icsc_status_ext *statusExt;
+
+    struct icsc_waiter *waiters;
+    pthread_mutex_t replyMutex;
+    pthread_cond_t replyCond;
+
+    struct icsc_discovery *discovery;
+
+    struct icsc_recv_queue *recvQueue;
+    uint8_t recInQueue;
+
+    struct icsc_tdma *tdma;
+
+    struct icsc_rate *rate;
+
+    struct icsc_conflate *conflate;
+
+    uint8_t promiscuous;
+    uint8_t recMonitorOnly;
+    struct icsc_monitor *monitor;
 } icsc_t, *icsc_ptr;
 
 // Format of command callback functions
 typedef void(*callbackFunction)(icsc_ptr, unsigned char, char, unsigned char, char *);
 
+// Format of command callback functions that take a user supplied argument
+typedef void(*callbackArgFunction)(icsc_ptr, unsigned char, char, unsigned char, char *, void *);
+
+// Format of command callback functions that are also told which station
+// the frame was addressed to
+typedef void(*callbackStationFunction)(icsc_ptr, unsigned char, unsigned char, char, unsigned char, char *, void *);
+
 // Structure to store command code / function pairs as a linked list
 struct icsc_command {
     char commandCode;
     callbackFunction callback;
+    callbackArgFunction callbackArg;
+    callbackStationFunction callbackStation;
+    void *arg;
     struct icsc_command *next;
 };
 
@@ -147,6 +305,85 @@ extern int icsc_gpio_close(int num);
 
 /** @} */
 
+/* gpiomem.c */
+
+/** \defgroup gpiomem
+ *  \brief Drive a GPIO through the SoC's registers instead of sysfs.
+ *
+ *  Setting a pin through sysfs costs a system call and several
+ *  microseconds, which widens the gap between frames at high baud rates.
+ *  Mapping the GPIO set and clear registers turns it into a single store.
+ *  Each SoC has its own register layout.
+ * @{
+ */
+
+#define ICSC_GPIOMEM_MAX_BANKS 8
+
+#define ICSC_GPIOMEM_NONE 0 /*!< Leave the pin direction alone */
+#define ICSC_GPIOMEM_FSEL 1 /*!< Three function select bits per pin, ten pins per word, from the first bank */
+#define ICSC_GPIOMEM_OE   2 /*!< One output enable bit per pin in each bank, clear for an output */
+
+/*! Where a SoC keeps its GPIO registers. Pins are numbered as sysfs does,
+ *  32 to a bank, and each bank's registers are at its base plus the
+ *  register offset. Offsets are bytes into the device. */
+typedef struct {
+    const char *name;
+    const char *device;                          /*!< /dev/gpiomem, /dev/mem or anything else that can be mapped */
+    int banks;
+    uint64_t base[ICSC_GPIOMEM_MAX_BANKS];
+    uint32_t set;                                /*!< Write ones to drive pins high */
+    uint32_t clear;                              /*!< Write ones to drive pins low */
+    uint32_t level;                              /*!< Reads the pin levels */
+    uint32_t direction;
+    int directionType;
+} icsc_gpiomem_layout_t;
+
+typedef struct icsc_gpiomem *icsc_gpiomem_ptr;
+
+/*! Raspberry Pi 1 to 4, through /dev/gpiomem */
+extern const icsc_gpiomem_layout_t icsc_gpiomem_bcm2835;
+
+/*! BeagleBone, through /dev/mem */
+extern const icsc_gpiomem_layout_t icsc_gpiomem_am335x;
+
+/*! \brief Pick the register layout for the board we are running on.
+ *  \return The layout, or NULL if the SoC is not known.
+ */
+extern const icsc_gpiomem_layout_t *icsc_gpiomem_detect();
+
+/*! \brief Map the registers for a GPIO and make it an output.
+ *  \param layout The SoC's register layout
+ *  \param num GPIO number
+ *  \return A handle for the pin, or NULL on error.
+ */
+extern icsc_gpiomem_ptr icsc_gpiomem_open(const icsc_gpiomem_layout_t *layout, int num);
+
+/*! \brief Set a mapped GPIO to high or low.
+ *  \param gpio The pin
+ *  \param level 1 for logic high or 0 for logic low
+ */
+extern void icsc_gpiomem_write(icsc_gpiomem_ptr gpio, int level);
+
+/*! \brief Read the level of a mapped GPIO.
+ *  \param gpio The pin
+ *  \return 1 if the GPIO reads high, 0 if it reads low.
+ */
+extern int icsc_gpiomem_read(icsc_gpiomem_ptr gpio);
+
+/*! \brief Unmap a GPIO. Its level and direction are left as they are.
+ *  \param gpio The pin
+ */
+extern void icsc_gpiomem_close(icsc_gpiomem_ptr gpio);
+
+/*! \brief Switch the DE pin of a context over to register access.
+ *  \param icsc The ICSC context, which must have a DE pin
+ *  \param layout The SoC's register layout, or NULL to detect it
+ *  \return 0 on success or -1 on error, in which case DE stays on sysfs.
+ */
+extern int icsc_set_de_gpiomem(icsc_ptr icsc, const icsc_gpiomem_layout_t *layout);
+
+/** @} */
+
 /* serial.c */
 /** \defgroup serial
  *  \brief Helper functions to make working with serial devices easier.
@@ -191,6 +428,33 @@ extern void icsc_serial_flush(int fd);
  */
 extern int icsc_serial_write(int fd, uint8_t c);
 
+/*! \brief Write a block of bytes to a serial port
+ *  \param fd The file descriptor of the port opened by icsc_serial_open()
+ *  \param data The bytes to write to the port
+ *  \param len The number of bytes to write
+ *  \return 0 if all the bytes were written, -1 on error.
+ */
+extern int icsc_serial_write_array(int fd, const uint8_t *data, size_t len);
+
+/*! \brief Convert a symbolic baud rate into bits per second
+ *  \param baud Symbolic baud rate in the form Bxxx (e.g., B115200)
+ *  \return The baud rate in bits per second, or 0 if it is not known.
+ */
+extern unsigned long icsc_serial_baud_rate(unsigned long baud);
+
+/*! \brief Convert a baud rate in bits per second into its symbolic form
+ *  \param rate Baud rate in bits per second (e.g., 115200)
+ *  \return The symbolic baud rate (e.g., B115200), or 0 if it is not supported.
+ */
+extern unsigned long icsc_serial_baud_symbol(unsigned long rate);
+
+/*! \brief Change the baud rate of an open serial port
+ *  \param fd The file descriptor of the port opened by icsc_serial_open()
+ *  \param baud The new baud rate as a termios constant (e.g., B115200)
+ *  \return 0 on success, -1 on error.
+ */
+extern int icsc_serial_set_baud(int fd, unsigned long baud);
+
 /*! \brief Close the serial port
  *  \param fd The file descriptor of the port opened by icsc_serial_open()
  *  \return nothing
@@ -214,6 +478,30 @@ extern void icsc_serial_close(int fd);
  */
 extern int icsc_register_command(icsc_ptr icsc, char command, callbackFunction func);
 
+/*! \brief Register a new command callback that is passed an extra argument
+ *  \param icsc Pointer to an icsc context created using icsc_init() or icsc_init_de()
+ *  \param command The character to use for the command
+ *  \param func The callback function to call when the command is received
+ *  \param arg The argument to pass to the callback function
+ *  \return 0 if the command was registered successfully, otherwise -1 on an error.
+ */
+extern int icsc_register_command_arg(icsc_ptr icsc, char command, callbackArgFunction func, void *arg);
+
+/*! \brief Register a new command callback that is also passed the station the
+ *         frame was addressed to
+ *
+ *  The callback is called with the context, the destination station, the
+ *  sender, the command, the length, the data and arg. The destination is
+ *  this station, one claimed with icsc_claim_station(), a group or
+ *  ICSC_BROADCAST.
+ *  \param icsc Pointer to an icsc context created using icsc_init() or icsc_init_de()
+ *  \param command The character to use for the command
+ *  \param func The callback function to call when the command is received
+ *  \param arg The argument to pass to the callback function
+ *  \return 0 if the command was registered successfully, otherwise -1 on an error.
+ */
+extern int icsc_register_command_station(icsc_ptr icsc, char command, callbackStationFunction func, void *arg);
+
 /*! \brief Unregister an old command character.
  *  \param icsc Pointer to an icsc context created using icsc_init() or icsc_init_de()
  *  \param command The command character to unregister
@@ -221,8 +509,253 @@ extern int icsc_register_command(icsc_ptr icsc, char command, callbackFunction f
  */
 extern int icsc_unregister_command(icsc_ptr icsc, char command);
 
+/*! \brief Unregister one callback registered with icsc_register_command_arg()
+ *
+ *  Other callbacks for the same command are left alone.
+ *  \param icsc Pointer to an icsc context created using icsc_init() or icsc_init_de()
+ *  \param command The command character it was registered for
+ *  \param func The callback function
+ *  \param arg The argument it was registered with
+ *  \return 0 if the callback was unregistered, otherwise -1 if it was not registered.
+ */
+extern int icsc_unregister_command_arg(icsc_ptr icsc, char command, callbackArgFunction func, void *arg);
+
 /** @}*/
 
+/** \defgroup receiving
+ *  \brief Pulling received frames from a queue instead of using callbacks
+ *
+ *  Once the receive queue is enabled, every frame addressed to the context
+ *  is received straight into a slot of a ring, as well as being passed to
+ *  any registered callbacks. icsc_recv() and icsc_recv_many() hand out
+ *  views of the queued frames without copying them. A frame's data stays
+ *  valid until it is passed to icsc_release(). Slots are reused in the
+ *  order they were filled, so a frame that is held on to stops the ones
+ *  after it from being reused.
+ * @{
+ */
+
+/*! \brief A received frame */
+typedef struct {
+    uint8_t station;    /*!< The station the frame was addressed to */
+    uint8_t sender;     /*!< The station that sent the frame */
+    char command;       /*!< The command */
+    uint8_t len;        /*!< The length of the data */
+    const char *data;   /*!< The data, valid until the frame is released */
+    uint32_t slot;      /*!< The queue slot holding the frame */
+} icsc_message_t;
+
+/*! \brief The most frames a receive queue can hold */
+#define ICSC_RECV_MAX_DEPTH 65536
+
+/*! \brief Enable the receive queue
+ *  \param icsc Pointer to an icsc context created using icsc_init() or icsc_init_de()
+ *  \param depth The number of frames the queue can hold, rounded up to a
+ *         power of two, up to ICSC_RECV_MAX_DEPTH
+ *  \return 0 on success, -1 on error.
+ */
+extern int icsc_recv_enable(icsc_ptr icsc, int depth);
+
+/*! \brief Take the next frame from the receive queue
+ *  \param icsc Pointer to an icsc context with the receive queue enabled
+ *  \param msg Where to store the frame
+ *  \param timeout Microseconds to wait for a frame if the queue is empty.
+ *         In threadless mode the link is read while waiting, unless
+ *         another thread is already reading it.
+ *  \return 1 if a frame was taken, 0 on timeout or -1 on error.
+ */
+extern int icsc_recv(icsc_ptr icsc, icsc_message_t *msg, unsigned long timeout);
+
+/*! \brief Take as many frames as are waiting, up to a limit
+ *  \param icsc Pointer to an icsc context with the receive queue enabled
+ *  \param msgs Array to store the frames in
+ *  \param max The number of entries in the array
+ *  \param timeout Microseconds to wait for a frame if the queue is empty
+ *  \return The number of frames taken, or -1 on error.
+ */
+extern int icsc_recv_many(icsc_ptr icsc, icsc_message_t *msgs, int max, unsigned long timeout);
+
+/*! \brief Hand a frame's slot back to the receive queue
+ *  \param icsc Pointer to the icsc context the frame came from
+ *  \param msg The frame to release
+ *  \return 0 on success, -1 on error.
+ */
+extern int icsc_release(icsc_ptr icsc, const icsc_message_t *msg);
+
+/** @} */
+
+/** \defgroup conflation
+ *  \brief Keeping only the newest value of high-rate commands
+ *
+ *  A conflated (station, command) pair is not passed to callbacks or the
+ *  receive queue. Instead each frame overwrites a single slot holding the
+ *  newest payload, which consumers read when they need it. A notifier can
+ *  be started to say that something has changed, at most once per
+ *  interval, however many frames arrived.
+ * @{
+ */
+
+/*! \brief Called by the notifier when any conflated value has changed */
+typedef void (*icsc_conflate_callback)(icsc_ptr icsc, void *arg);
+
+/*! \brief Keep only the newest value of a command from a station
+ *  \param icsc Pointer to an icsc context created using icsc_init() or icsc_init_de()
+ *  \param station The sending station
+ *  \param command The command
+ *  \return 0 on success, -1 on error.
+ */
+extern int icsc_conflate(icsc_ptr icsc, uint8_t station, char command);
+
+/*! \brief Read the newest value of a conflated command
+ *  \param icsc Pointer to an icsc context created using icsc_init() or icsc_init_de()
+ *  \param station The sending station
+ *  \param command The command
+ *  \param data Where to copy the payload; must hold 255 bytes
+ *  \param len Where to store the length of the payload, or NULL
+ *  \param version If not NULL, the version last read. Nothing is copied if
+ *         the value has not changed since, and the new version is stored.
+ *  \return 1 if a value was copied, 0 if there is no new value, -1 on error.
+ */
+extern int icsc_conflate_read(icsc_ptr icsc, uint8_t station, char command, void *data, uint8_t *len, uint32_t *version);
+
+/*! \brief Start calling a function when conflated values change
+ *  \param icsc Pointer to an icsc context created using icsc_init() or icsc_init_de()
+ *  \param callback The function to call from the notifier thread
+ *  \param arg Passed to the callback
+ *  \param interval The shortest time between calls, in microseconds
+ *  \return 0 on success, -1 on error.
+ */
+extern int icsc_conflate_notify(icsc_ptr icsc, icsc_conflate_callback callback, void *arg, unsigned long interval);
+
+/** @} */
+
+/** \defgroup monitor
+ *  \brief Watching all the traffic on a bus
+ *
+ *  A monitor callback is given every frame the context receives, valid or
+ *  not, with its addressing intact. In promiscuous mode that includes
+ *  frames addressed to other stations, which are not passed to the command
+ *  callbacks. A passive context never transmits, not even answers to
+ *  pings, so it can watch a bus without disturbing it.
+ * @{
+ */
+
+#define ICSC_PROMISCUOUS_OFF        0   /*!< Only receive frames for this station */
+#define ICSC_PROMISCUOUS_ON         1   /*!< Pass every frame to the monitor */
+#define ICSC_PROMISCUOUS_PASSIVE    2   /*!< As ICSC_PROMISCUOUS_ON, and never transmit */
+
+#define ICSC_MONITOR_OK             0   /*!< A valid frame */
+#define ICSC_MONITOR_CHECKSUM       1   /*!< A frame with the wrong checksum */
+#define ICSC_MONITOR_FRAMING        2   /*!< A frame missing its ETX or EOT */
+#define ICSC_MONITOR_TIMEOUT        3   /*!< A frame that stopped part way through */
+
+/*! \brief A frame seen by the monitor */
+typedef struct {
+    uint8_t station;    /*!< The station the frame was addressed to */
+    uint8_t sender;     /*!< The station that sent it */
+    char command;       /*!< The command */
+    uint8_t len;        /*!< The length of the payload */
+    const char *data;   /*!< The payload, or NULL unless status is ICSC_MONITOR_OK */
+    int status;         /*!< ICSC_MONITOR_OK or the reason the frame was dropped */
+    uint64_t when;      /*!< Monotonic time the frame ended, in microseconds */
+} icsc_monitor_frame_t;
+
+/*! \brief Called from the read thread with every frame received */
+typedef void (*icsc_monitor_callback)(icsc_ptr icsc, const icsc_monitor_frame_t *frame, void *arg);
+
+/*! \brief Set the monitor callback
+ *
+ *  It can be changed while frames are arriving. Each frame goes to one
+ *  callback with its own arg, though a frame that is being passed to the
+ *  old callback may still be in it when this returns.
+ *  \param icsc Pointer to an icsc context created using icsc_init() or icsc_init_de()
+ *  \param callback The function to call, or NULL to stop monitoring
+ *  \param arg Passed to the callback
+ *  \return 0 on success, -1 on error.
+ */
+extern int icsc_set_monitor(icsc_ptr icsc, icsc_monitor_callback callback, void *arg);
+
+/*! \brief Choose which frames reach the monitor, and whether to transmit
+ *  \param icsc Pointer to an icsc context created using icsc_init() or icsc_init_de()
+ *  \param mode ICSC_PROMISCUOUS_OFF, ICSC_PROMISCUOUS_ON or ICSC_PROMISCUOUS_PASSIVE
+ *  \return 0 on success, -1 on error.
+ */
+extern int icsc_set_promiscuous(icsc_ptr icsc, int mode);
+
+/** @} */
+
+/** \defgroup relay
+ *  \brief Functions for forwarding frames between ICSC endpoints
+ *
+ *  Each endpoint can hold a routing table mapping remote station addresses
+ *  to another (egress) endpoint. Frames received for a routed station are
+ *  forwarded by the read thread directly onto the egress endpoint without
+ *  being dispatched to any callbacks. A frame sent to us with the
+ *  ICSC_SYS_RELAY command is unwrapped and forwarded in the same way: the
+ *  first payload byte is the final destination, the second is the command
+ *  to deliver, and the rest is the data.
+ *
+ *  A frame is never forwarded back out of the endpoint it arrived on, nor
+ *  onto an endpoint through which its sender is itself routed. Both cases
+ *  are counted as loops and the frame is dropped.
+ *
+ *  Forwarding happens on the ingress read thread and waits for the egress
+ *  endpoint's turn on its bus, so a slow or busy egress bus holds up
+ *  receiving on the ingress bus for as long as each write takes.
+ *
+ *  Routes must be removed before the egress endpoint is closed. Removing
+ *  a route, or pointing it at another endpoint, waits for any frame being
+ *  forwarded through it to finish.
+ * @{
+ */
+
+/*! \brief Counters kept for every route */
+typedef struct {
+    uint32_t frames;    /*!< Frames forwarded */
+    uint32_t bytes;     /*!< Payload bytes forwarded */
+    uint32_t loops;     /*!< Frames dropped by the loop protection */
+    uint32_t errors;    /*!< Frames that could not be written to the egress endpoint */
+} icsc_route_stats_t;
+
+/*! \brief Route a remote station through another endpoint
+ *  \param icsc Pointer to the icsc context the frames arrive on
+ *  \param station The remote station address to route
+ *  \param egress The endpoint to forward frames for that station to
+ *  \return 0 on success or -1 on error.
+ */
+extern int icsc_route_add(icsc_ptr icsc, uint8_t station, icsc_ptr egress);
+
+/*! \brief Remove a route
+ *  \param icsc Pointer to the icsc context the route was added to
+ *
+ *  Once this returns nothing is being written through the route, so the
+ *  egress endpoint may be closed.
+ *  \param station The remote station address
+ *  \return 0 on success or -1 if there was no such route.
+ */
+extern int icsc_route_remove(icsc_ptr icsc, uint8_t station);
+
+/*! \brief Read the counters of a route
+ *  \param icsc Pointer to the icsc context the route was added to
+ *  \param station The remote station address
+ *  \param stats Where to store the counters
+ *  \return 0 on success or -1 if there is no such route.
+ */
+extern int icsc_route_stats(icsc_ptr icsc, uint8_t station, icsc_route_stats_t *stats);
+
+/*! \brief Ask a gateway station to relay a frame onto another bus segment
+ *  \param icsc Pointer to an icsc context created using icsc_init() or icsc_init_de()
+ *  \param gateway The station that holds the route to the destination
+ *  \param station The final destination station
+ *  \param command Command character to trigger at the final destination
+ *  \param len The length of the data (at most 253 bytes)
+ *  \param data The data to send
+ *  \return 0 on success, -1 on error.
+ */
+extern int icsc_send_relay(icsc_ptr icsc, uint8_t gateway, uint8_t station, char command, uint8_t len, const char *data);
+
+/** @} */
+
 /** \defgroup Initialization
  *  \brief Functions used for initializing and finisging with an ICSC instance
  *  @{
@@ -253,6 +786,147 @@ extern icsc_ptr icsc_init(const char *uart, unsigned long baud, uint8_t station)
  */
 extern int icsc_close(icsc_ptr icsc);
 
+/*! \brief Create a new ICSC context on any transport and start listening for messages.
+ *  \param transport The transport to use (e.g., &icsc_transport_memory)
+ *  \param path The transport specific name of the link to open
+ *  \param baud The baud rate symbolic name in the form Bxxxx, if the transport uses one
+ *  \param station The station number of this device
+ *  \param de The GPIO number to use for the RS-485 DE pin, or -1 for none.
+ *  \return The pointer to the newly created context.
+ */
+extern icsc_ptr icsc_init_transport(const icsc_transport_t *transport, const char *path, unsigned long baud, uint8_t station, int de);
+
+/*! \brief Read the settings a context is running with
+ *  \param icsc Pointer to an icsc context created using icsc_init() or icsc_init_de()
+ *  \param config Filled in with the current settings
+ *  \return 0 on success or -1 on error.
+ */
+extern int icsc_get_config(icsc_ptr icsc, icsc_config_t *config);
+
+/*! \brief Change the baud rate, station number, DE pin and receive timeout
+ *         without closing the context
+ *
+ *  The change happens between frames: the read thread is paused once it
+ *  has finished with what it has read, and any frame being sent finishes
+ *  first. The port stays open and the read thread keeps running, so no
+ *  traffic is lost beyond a frame that was half received. Fill in the
+ *  structure with icsc_get_config() and change what is needed. Must not be
+ *  called from a command callback.
+ *  \param icsc Pointer to an icsc context created using icsc_init() or icsc_init_de()
+ *  \param config The new settings
+ *  \return 0 on success, or -1 on error, in which case nothing has changed.
+ */
+extern int icsc_reconfigure(icsc_ptr icsc, const icsc_config_t *config);
+
+/** @} */
+
+/** \defgroup threadless
+ *  \brief Driving a context from an existing event loop instead of a read thread
+ *
+ *  A context created with icsc_init_threadless() starts no read thread.
+ *  The application polls the descriptor from icsc_get_fd() in its own loop
+ *  (epoll, libuv, asio and so on) and calls icsc_poll_once() when it is
+ *  readable or when the time from icsc_next_timeout() has passed. Callbacks
+ *  then run on the loop's thread.
+ *
+ *  Functions that wait for an answer or a frame, such as
+ *  icsc_query_status(), icsc_recv() with a timeout and icsc_bulk_send(),
+ *  read the link themselves while they wait, unless they are called from
+ *  a callback. Helpers with threads of their own, such as background
+ *  discovery, do the same, so their answers are dispatched on their thread.
+ *  @{
+ */
+
+/*! \brief Create a new ICSC context on any transport without a read thread
+ *  \param transport The transport to use (e.g., &icsc_transport_serial)
+ *  \param path The transport specific name of the link to open
+ *  \param baud The baud rate symbolic name in the form Bxxxx, if the transport uses one
+ *  \param station The station number of this device
+ *  \param de The GPIO number to use for the RS-485 DE pin, or -1 for none.
+ *  \return The pointer to the newly created context.
+ */
+extern icsc_ptr icsc_init_threadless(const icsc_transport_t *transport, const char *path, unsigned long baud, uint8_t station, int de);
+
+/*! \brief Get the descriptor to poll
+ *  \param icsc Pointer to an icsc context created using icsc_init_threadless()
+ *  \param events Set to the poll() events to wait for, if not NULL
+ *  \return The descriptor, or -1 if the transport has none, in which case
+ *          icsc_poll_once() must be called regularly.
+ */
+extern int icsc_get_fd(icsc_ptr icsc, short *events);
+
+/*! \brief Receive and dispatch whatever has arrived, and run any timers that are due
+ *
+ *  Never blocks waiting for data.
+ *  \param icsc Pointer to an icsc context created using icsc_init_threadless()
+ *  \return 0 on success, or -1 on error, including the link hanging up
+ *          (for example icscd exiting). Stop polling the descriptor then.
+ */
+extern int icsc_poll_once(icsc_ptr icsc);
+
+/*! \brief Get how long the loop may sleep before calling icsc_poll_once() with no data
+ *  \param icsc Pointer to an icsc context created using icsc_init_threadless()
+ *  \return The time in microseconds, 0 if a timer is already due, or -1 if
+ *          nothing is waiting on a timer.
+ */
+extern long icsc_next_timeout(icsc_ptr icsc);
+
+/** @} */
+
+/** \defgroup transport
+ *  \brief The links an ICSC context can talk over
+ *  @{
+ */
+
+/*! \brief A serial port. The path names the device (e.g., /dev/ttyAMA0). */
+extern const icsc_transport_t icsc_transport_serial;
+
+/*! \brief A connected Unix domain stream socket. The path names the socket and the baud rate is ignored. */
+extern const icsc_transport_t icsc_transport_socket;
+
+/*! \brief An in-process bus. Every context opened with the same path is on the
+ *         same bus and receives what the others write. The baud rate is ignored.
+ *         No system calls are made unless a reader has to sleep.
+ */
+extern const icsc_transport_t icsc_transport_memory;
+
+/** @} */
+
+/** \defgroup daemon
+ *  \brief Sharing one bus between several local processes through icscd
+ *
+ *  The icscd daemon owns the UART and serves local clients over a Unix
+ *  domain socket. icsc_connect() returns a normal context, so the sending
+ *  and callback functions work exactly as they do on a directly opened
+ *  port. The daemon only passes a client the frames that match its station
+ *  and command subscriptions.
+ *  @{
+ */
+
+/*! \brief The socket icscd listens on unless told otherwise */
+#define ICSC_DAEMON_SOCKET "/var/run/icscd.sock"
+
+/*! \brief Connect to a running icscd daemon
+ *
+ *  The new client is subscribed to frames addressed to its own station
+ *  and to broadcasts, for all commands.
+ *
+ *  \param path The path of the daemon's socket, or NULL for ICSC_DAEMON_SOCKET
+ *  \param station The station number of this client
+ *  \return The pointer to the newly created context, or NULL on error.
+ */
+extern icsc_ptr icsc_connect(const char *path, uint8_t station);
+
+/*! \brief Change which frames the daemon passes to this client
+ *  \param icsc Pointer to an icsc context created using icsc_connect()
+ *  \param stations 256-bit map (32 bytes) of destination stations to receive,
+ *         or NULL to leave the station subscriptions unchanged
+ *  \param commands 256-bit map (32 bytes) of commands to receive,
+ *         or NULL to leave the command subscriptions unchanged
+ *  \return 0 on success, -1 on error or if the context is not connected to icscd.
+ */
+extern int icsc_subscribe(icsc_ptr icsc, const uint8_t *stations, const uint8_t *commands);
+
 /** @} */
 
 
@@ -261,6 +935,24 @@ extern int icsc_close(icsc_ptr icsc);
  *  @{
  */
 
+/*! \brief A frame buffer whose payload can be filled in place before sending */
+typedef struct {
+    uint8_t data[ICSC_MAX_FRAME];
+} icsc_frame_t;
+
+/*! \brief The payload area of an icsc_frame_t */
+#define ICSC_FRAME_PAYLOAD(f) ((f)->data + ICSC_SOH_START_COUNT + 5)
+
+/*! \brief Send a frame whose payload has already been written with ICSC_FRAME_PAYLOAD()
+ *  \param icsc Pointer to an icsc context created using icsc_init() or icsc_init_de()
+ *  \param frame The frame buffer holding the payload
+ *  \param station Destination station to send to
+ *  \param command Command character to trigger at the remote station
+ *  \param len The length of the payload
+ *  \return 0 on success, -1 on error.
+ */
+extern int icsc_send_frame(icsc_ptr icsc, icsc_frame_t *frame, uint8_t station, char command, uint8_t len);
+
 /*! \brief Send an array of data (or struct as if it were an array) to a remote station
  *  \param icsc Pointer to an icsc context created using icsc_init() or icsc_init_de()
  *  \param station Destination station to send to
@@ -307,6 +999,130 @@ extern int icsc_send_int(icsc_ptr icsc, uint8_t station, char command, int16_t d
  */
 extern int icsc_send_char(icsc_ptr icsc, uint8_t station, char command, int8_t data);
 
+/*! \brief Choose the priority class frames with a command are sent in
+ *
+ *  When several threads are waiting to send, frames in a more urgent class
+ *  always go first; frames in the same class go in the order they were
+ *  sent. A frame already on the wire is never interrupted, so a control
+ *  frame waits for at most one frame time when no other control frames are
+ *  queued, even while long transfers are being sent frame by frame. All
+ *  commands start in ICSC_PRIORITY_NORMAL.
+ *  \param icsc Pointer to an icsc context created using icsc_init() or icsc_init_de()
+ *  \param command The command
+ *  \param priority ICSC_PRIORITY_CONTROL, ICSC_PRIORITY_NORMAL or ICSC_PRIORITY_BULK
+ *  \return 0 on success, -1 on error.
+ */
+extern int icsc_set_priority(icsc_ptr icsc, char command, int priority);
+
+/** @} */
+
+/** \defgroup flow
+ *  \brief Backpressure for producers that can send faster than the link
+ *
+ *  The backlog is the bytes of frames waiting for the link plus whatever
+ *  the kernel still holds in the link's output queue. icsc_try_send_array()
+ *  refuses to add to it once it reaches the high-water mark, and the
+ *  writable callback says when it has fallen to the low-water mark, so a
+ *  producer can slow down or drop stale data instead of queueing it.
+ *
+ *  On a serial port each frame is drained to the wire before the next
+ *  one may start, so the output queue is close to empty between frames
+ *  and the backlog is mostly frames waiting their turn. On a socket the
+ *  queue drains on its own, so while a send is refused the read thread
+ *  checks it every 10 ms and calls back once it is low enough. In
+ *  threadless mode each call to icsc_poll_once() checks it.
+ *  @{
+ */
+
+/*! \brief The default high-water mark in bytes */
+#define ICSC_TX_HIGH_WATER (ICSC_MAX_FRAME * 4)
+
+/*! \brief The default low-water mark in bytes */
+#define ICSC_TX_LOW_WATER ICSC_MAX_FRAME
+
+/*! \brief Called when the backlog falls to the low-water mark after a send was refused */
+typedef void (*icsc_writable_callback)(icsc_ptr icsc, void *arg);
+
+/*! \brief Get the transmit backlog
+ *  \param icsc Pointer to an icsc context created using icsc_init() or icsc_init_de()
+ *  \return The number of bytes waiting to be sent, or -1 on error.
+ */
+extern int icsc_tx_pending(icsc_ptr icsc);
+
+/*! \brief Set the backlog at which sends are refused and at which they may resume
+ *  \param icsc Pointer to an icsc context created using icsc_init() or icsc_init_de()
+ *  \param high Refuse sends once this many bytes are waiting
+ *  \param low Call the writable callback once no more than this many bytes are waiting
+ *  \return 0 on success, -1 on error.
+ */
+extern int icsc_set_tx_watermarks(icsc_ptr icsc, uint32_t high, uint32_t low);
+
+/*! \brief Set the function called when sending may resume
+ *
+ *  The callback runs on whichever thread's frame brought the backlog down,
+ *  once for each time sends started being refused. It may send.
+ *  \param icsc Pointer to an icsc context created using icsc_init() or icsc_init_de()
+ *  \param callback The function to call, or NULL for none
+ *  \param arg Passed to the callback
+ *  \return 0 on success, -1 on error.
+ */
+extern int icsc_set_writable(icsc_ptr icsc, icsc_writable_callback callback, void *arg);
+
+/*! \brief Send an array of data unless the backlog is at the high-water mark
+ *
+ *  A frame that is accepted waits for the link like any other send.
+ *  \param icsc Pointer to an icsc context created using icsc_init() or icsc_init_de()
+ *  \param station Destination station to send to
+ *  \param command Command character to trigger at the remote station
+ *  \param len The length of the array or size of the struct
+ *  \param data The data to send
+ *  \return 0 on success, -1 on error with errno set to EAGAIN if the send was refused.
+ */
+extern int icsc_try_send_array(icsc_ptr icsc, uint8_t station, char command, uint8_t len, const char *data);
+
+/** @} */
+
+/** \defgroup aggregation
+ *  \brief Packing small messages for the same station into one frame
+ *
+ *  Every frame carries ten bytes of framing and a turnaround, which is
+ *  most of the bus time for messages of a few bytes. Messages sent with
+ *  icsc_queue_array() wait up to the coalescing delay for others to the
+ *  same station and then go as one ICSC_SYS_AGGR frame. The receiver
+ *  splits it up again, and each message reaches the callbacks and the
+ *  receive queue as if it had been sent on its own. Both ends must be
+ *  using this library.
+ *  @{
+ */
+
+/*! \brief Turn on aggregation, or change its settings
+ *  \param icsc Pointer to an icsc context created using icsc_init() or icsc_init_de()
+ *  \param delay How long a message may wait for others, in microseconds
+ *  \param maxLen Send as soon as the payload reaches this many bytes, or 0 for the largest frame
+ *  \return 0 on success, -1 on error.
+ */
+extern int icsc_aggregate(icsc_ptr icsc, unsigned long delay, uint8_t maxLen);
+
+/*! \brief Queue an array of data to be sent to a remote station along with others
+ *
+ *  Messages to the same station are delivered in the order they were
+ *  queued, including those too large to share a frame, which go on their
+ *  own. They are not in order with messages sent directly.
+ *  \param icsc Pointer to an icsc context with aggregation turned on
+ *  \param station Destination station to send to
+ *  \param command Command character to trigger at the remote station
+ *  \param len The length of the array or size of the struct
+ *  \param data The data to send
+ *  \return 0 on success, -1 on error or for an ICSC_SYS_* command.
+ */
+extern int icsc_queue_array(icsc_ptr icsc, uint8_t station, char command, uint8_t len, const char *data);
+
+/*! \brief Send every queued message now
+ *  \param icsc Pointer to an icsc context with aggregation turned on
+ *  \return 0 on success, -1 on error.
+ */
+extern int icsc_flush(icsc_ptr icsc);
+
 /** @} */
 
 
@@ -358,6 +1174,363 @@ extern int icsc_broadcast_int(icsc_ptr icsc, char command, int16_t data);
 extern int icsc_broadcast_char(icsc_ptr icsc, char command, int8_t data);
 /** @} */
 
+/** \defgroup groups
+ *  \brief Sending one frame to a chosen set of stations
+ *
+ *  Station numbers ICSC_GROUP_FIRST to ICSC_GROUP_LAST are group
+ *  addresses. A frame sent to a group with the usual sending functions
+ *  reaches every station that has joined it, and every other station drops
+ *  it as soon as the header arrives, without receiving the payload.
+ *  @{
+ */
+
+/*! \brief Start receiving frames sent to a group
+ *
+ *  On a context connected to icscd, this replaces the station
+ *  subscription with this station, broadcasts and the joined groups.
+ *  \param icsc Pointer to an icsc context created using icsc_init() or icsc_init_de()
+ *  \param group A station number from ICSC_GROUP_FIRST to ICSC_GROUP_LAST
+ *  \return 0 on success, -1 on error.
+ */
+extern int icsc_join_group(icsc_ptr icsc, uint8_t group);
+
+/*! \brief Stop receiving frames sent to a group
+ *  \param icsc Pointer to an icsc context created using icsc_init() or icsc_init_de()
+ *  \param group A station number from ICSC_GROUP_FIRST to ICSC_GROUP_LAST
+ *  \return 0 on success, -1 on error.
+ */
+extern int icsc_leave_group(icsc_ptr icsc, uint8_t group);
+
+/*! \brief See whether a context receives frames sent to a group
+ *  \param icsc Pointer to an icsc context created using icsc_init() or icsc_init_de()
+ *  \param group A station number from ICSC_GROUP_FIRST to ICSC_GROUP_LAST
+ *  \return 1 if it has joined the group, 0 if not, or -1 on error.
+ */
+extern int icsc_in_group(icsc_ptr icsc, uint8_t group);
+
+/** @} */
+
+/** \defgroup virtual
+ *  \brief Answering for more than one station number
+ *
+ *  A context can claim further station numbers besides its own, so one
+ *  port and read thread can stand in for a whole population of simulated
+ *  or proxied devices. Frames addressed to any claimed station are
+ *  received as if addressed to this one. Pings and status queries are
+ *  answered from the station they were sent to. Callbacks registered with
+ *  icsc_register_command_station() are told which one that was, and
+ *  icsc_send_array_from() replies as it.
+ *  @{
+ */
+
+/*! \brief Start answering for another station number
+ *  \param icsc Pointer to an icsc context created using icsc_init() or icsc_init_de()
+ *  \param station A station number below ICSC_GROUP_FIRST, other than ICSC_BROADCAST
+ *  \return 0 on success, -1 on error.
+ */
+extern int icsc_claim_station(icsc_ptr icsc, uint8_t station);
+
+/*! \brief Stop answering for a claimed station number
+ *  \param icsc Pointer to an icsc context created using icsc_init() or icsc_init_de()
+ *  \param station A station number claimed with icsc_claim_station()
+ *  \return 0 on success, or -1 on error or if it is the context's own station.
+ */
+extern int icsc_release_station(icsc_ptr icsc, uint8_t station);
+
+/*! \brief Replace every claimed station number at once
+ *  \param icsc Pointer to an icsc context created using icsc_init() or icsc_init_de()
+ *  \param stations A 32-byte bitmap with bit n set to answer for station n,
+ *         or NULL for none. Bits for ICSC_BROADCAST, groups and the
+ *         context's own station are ignored.
+ *  \return 0 on success, -1 on error.
+ */
+extern int icsc_set_stations(icsc_ptr icsc, const uint8_t *stations);
+
+/*! \brief Send an array of data from a claimed station
+ *  \param icsc Pointer to an icsc context created using icsc_init() or icsc_init_de()
+ *  \param origin The context's own station or one it has claimed
+ *  \param station The station number to send to
+ *  \param command Command character to trigger at the remote station
+ *  \param len The number of bytes to send
+ *  \param data The data to send
+ *  \return 0 on success, -1 on error.
+ */
+extern int icsc_send_array_from(icsc_ptr icsc, uint8_t origin, uint8_t station, char command, uint8_t len, const char *data);
+
+/** @} */
+
+
+/** \defgroup status
+ *  \brief Counters and remote status queries
+ *
+ *  Every context answers ICSC_SYS_QSTAT from its read thread with an
+ *  ICSC_SYS_RSTAT frame carrying a compact status block: uptime, frame and
+ *  error counters, queue depths and an optional application extension.
+ *  The application never sees the query.
+ *  @{
+ */
+
+/*! \brief The version of the status block this library sends */
+#define ICSC_STATUS_VERSION 1
+
+/*! \brief The largest application extension a status block can carry */
+#define ICSC_STATUS_EXT_MAX 128
+
+/*! \brief A status block received from a remote station */
+typedef struct {
+    uint8_t station;            /*!< The station that answered */
+    uint8_t version;            /*!< Status block version, or 0 if the station did not answer */
+    uint32_t uptime;            /*!< Seconds since the remote context was created */
+    uint32_t rxFrames;          /*!< Valid frames the station has received */
+    uint32_t txFrames;          /*!< Frames the station has sent */
+    uint32_t checksumErrors;    /*!< Frames the station dropped with a bad checksum */
+    uint32_t framingErrors;     /*!< Frames the station dropped with missing framing */
+    uint16_t rxQueue;           /*!< Received frames waiting to be consumed */
+    uint16_t txQueue;           /*!< Frames waiting to be sent */
+    uint8_t extLen;             /*!< Length of the application extension */
+    uint8_t ext[ICSC_STATUS_EXT_MAX]; /*!< The application extension */
+} icsc_status_t;
+
+/*! \brief Read the counters of a context
+ *  \param icsc Pointer to an icsc context created using icsc_init() or icsc_init_de()
+ *  \param stats Where to store the counters
+ *  \return 0 on success, -1 on error.
+ */
+extern int icsc_get_stats(icsc_ptr icsc, icsc_stats_t *stats);
+
+/*! \brief Set the application extension sent with every status block
+ *
+ *  The extension is published as a snapshot, so the read thread never waits
+ *  for the application and never sends a half updated extension. Only one
+ *  thread may update the extension of a context.
+ *
+ *  \param icsc Pointer to an icsc context created using icsc_init() or icsc_init_de()
+ *  \param data The extension data
+ *  \param len The length of the extension, at most ICSC_STATUS_EXT_MAX
+ *  \return 0 on success, -1 on error.
+ */
+extern int icsc_set_status_ext(icsc_ptr icsc, const void *data, uint8_t len);
+
+/*! \brief Collect the status of a number of remote stations
+ *
+ *  The stations are queried one at a time so that their answers never
+ *  collide on a shared bus.
+ *
+ *  \param icsc Pointer to an icsc context created using icsc_init() or icsc_init_de()
+ *  \param stations The stations to query
+ *  \param count The number of stations to query
+ *  \param results Array of count entries to receive the status blocks
+ *  \param timeout Microseconds to wait for each station to answer
+ *  \return The number of stations that answered, or -1 on error.
+ */
+extern int icsc_query_status(icsc_ptr icsc, const uint8_t *stations, int count, icsc_status_t *results, unsigned long timeout);
+
+/** @} */
+
+/** \defgroup discovery
+ *  \brief Finding out which stations are live on a bus
+ *
+ *  Stations are found by sending ICSC_SYS_PING and timing the ICSC_SYS_PONG
+ *  that comes back. How long to wait for each answer is worked out from the
+ *  baud rate and the length of the two frames, plus a small allowance for
+ *  the remote station to turn the line around.
+ *
+ *  By default stations are pinged one at a time, so every absent address
+ *  costs a full timeout: about 3.5 ms at 115200 baud, or 0.9 s to sweep
+ *  all 254 addresses. ICSC_DISCOVER_PIPELINE sends the pings back-to-back
+ *  and waits once, which is much quicker but needs a full-duplex link.
+ *  @{
+ */
+
+/*! \brief Send every ping before collecting the answers. Only use this on
+ *         full-duplex links, where the answers cannot collide with the pings. */
+#define ICSC_DISCOVER_PIPELINE 0x01
+
+/*! \brief Time in microseconds a remote station is allowed to start answering */
+#define ICSC_TURNAROUND_TIME 2000
+
+/*! \brief A live station */
+typedef struct {
+    uint8_t station;    /*!< The station address */
+    uint32_t rtt;       /*!< Measured round trip time of a ping in microseconds, or 0 if not yet measured */
+    uint32_t age;       /*!< Microseconds since the station was last heard from */
+} icsc_station_info_t;
+
+/*! \brief Sweep a range of addresses for live stations
+ *  \param icsc Pointer to an icsc context created using icsc_init() or icsc_init_de()
+ *  \param first The first address to try
+ *  \param last The last address to try
+ *  \param flags 0 or ICSC_DISCOVER_PIPELINE
+ *  \param table Array to receive the live stations
+ *  \param max The number of entries in the table
+ *  \return The number of live stations found, or -1 on error.
+ */
+extern int icsc_discover(icsc_ptr icsc, uint8_t first, uint8_t last, int flags, icsc_station_info_t *table, int max);
+
+/*! \brief Keep a table of live stations up to date in the background
+ *
+ *  One station is pinged every interval, cycling through the range.
+ *  Stations that have been heard from since the last cycle are skipped, so
+ *  a busy bus carries almost no extra traffic.
+ *
+ *  \param icsc Pointer to an icsc context created using icsc_init() or icsc_init_de()
+ *  \param first The first address to watch
+ *  \param last The last address to watch
+ *  \param interval Microseconds between pings
+ *  \return 0 on success, -1 on error.
+ */
+extern int icsc_discover_start(icsc_ptr icsc, uint8_t first, uint8_t last, unsigned long interval);
+
+/*! \brief Stop background discovery
+ *  \param icsc Pointer to an icsc context
+ *  \return 0 on success, -1 if discovery was not running.
+ */
+extern int icsc_discover_stop(icsc_ptr icsc);
+
+/*! \brief Read the table kept by background discovery
+ *  \param icsc Pointer to an icsc context
+ *  \param table Array to receive the live stations
+ *  \param max The number of entries in the table
+ *  \return The number of live stations, or -1 if discovery is not running.
+ */
+extern int icsc_discover_table(icsc_ptr icsc, icsc_station_info_t *table, int max);
+
+/** @} */
+
+/** \defgroup tdma
+ *  \brief Time-slotted access to a bus
+ *
+ *  In TDMA mode one master broadcasts an ICSC_SYS_SYNC frame at the start
+ *  of every cycle. The sync carries the cycle number, the master's clock,
+ *  the number of slots and the slot length. Each station is given a slot,
+ *  and its frames are held until that slot comes round, so stations never
+ *  talk over each other. A slot is long enough for one frame with the
+ *  largest payload the master was told about, plus the turnaround time;
+ *  frames only go if they finish before their slot ends. Frames from
+ *  contexts without a slot are not held.
+ *
+ *  Because every frame waits for its slot, a station that answers pings or
+ *  status queries does so from its read thread in its own slot.
+ *  @{
+ */
+
+/*! \brief Start broadcasting sync frames
+ *  \param icsc Pointer to an icsc context created using icsc_init() or icsc_init_de()
+ *  \param slots The number of slots in a cycle
+ *  \param maxLen The largest payload a slot must hold
+ *  \return 0 on success, -1 on error.
+ */
+extern int icsc_tdma_master(icsc_ptr icsc, uint8_t slots, uint8_t maxLen);
+
+/*! \brief Set the slot this context sends in
+ *  \param icsc Pointer to an icsc context created using icsc_init() or icsc_init_de()
+ *  \param slot The slot, counting from 0, or -1 to send without waiting
+ *  \return 0 on success, -1 on error.
+ */
+extern int icsc_tdma_slot(icsc_ptr icsc, int slot);
+
+/*! \brief Leave TDMA mode, stopping the sync frames on the master
+ *  \param icsc Pointer to an icsc context created using icsc_init() or icsc_init_de()
+ *  \return 0 on success, -1 on error.
+ */
+extern int icsc_tdma_stop(icsc_ptr icsc);
+
+/*! \brief Read the current cycle and the master's clock
+ *  \param icsc Pointer to an icsc context created using icsc_init() or icsc_init_de()
+ *  \param cycle Where to store the cycle number, or NULL
+ *  \param masterTime Where to store the master's clock in microseconds, or NULL
+ *  \return 0 on success, -1 if no recent sync has been heard.
+ */
+extern int icsc_tdma_time(icsc_ptr icsc, uint32_t *cycle, uint64_t *masterTime);
+
+/** @} */
+
+/** \defgroup bulk
+ *  \brief Sending one large block of data to many stations at once
+ *
+ *  The sender broadcasts the block once, in numbered ICSC_SYS_BULK
+ *  fragments, and then polls the receivers. Each receiver missing
+ *  fragments answers with an ICSC_SYS_BULK_NACK holding a bitmap of them,
+ *  in a turn set by its station number so the answers do not collide.
+ *  Only the fragments someone is missing are sent again, so the transfer
+ *  takes about as long for forty stations as for one.
+ *
+ *  The sender stops once two polls in a row go unanswered. Receivers that
+ *  hear neither poll are not noticed.
+ *  @{
+ */
+
+/*! \brief Send a block of data to a set of stations
+ *  \param icsc Pointer to an icsc context created using icsc_init() or icsc_init_de()
+ *  \param station Where to send the fragments: ICSC_BROADCAST or a group
+ *  \param first The lowest station number that will be receiving
+ *  \param last The highest station number that will be receiving
+ *  \param data The block to send
+ *  \param len Its length in bytes, up to 65535 fragments of 245 bytes
+ *  \param timeout How long to keep repairing, in microseconds
+ *  \return 0 once two polls in a row go unanswered, or -1 on error or timeout.
+ */
+extern int icsc_bulk_send(icsc_ptr icsc, uint8_t station, uint8_t first, uint8_t last, const void *data, uint32_t len, unsigned long timeout);
+
+/*! \brief Get ready to receive a block into a buffer
+ *
+ *  Fragments of the next transfer that arrive are stored straight into
+ *  the buffer, which belongs to the library until icsc_bulk_wait() returns.
+ *  \param icsc Pointer to an icsc context created using icsc_init() or icsc_init_de()
+ *  \param buffer Where to put the block
+ *  \param size The size of the buffer; larger transfers are ignored
+ *  \return 0 on success, -1 on error.
+ */
+extern int icsc_bulk_accept(icsc_ptr icsc, void *buffer, uint32_t size);
+
+/*! \brief Wait for a block to arrive
+ *
+ *  Missing fragments are asked for from this thread, so a receiver must be
+ *  waiting here for the transfer to be repaired.
+ *  \param icsc Pointer to an icsc context after icsc_bulk_accept()
+ *  \param timeout How long to wait, in microseconds
+ *  \return The size of the block, or -1 on error or timeout.
+ */
+extern long icsc_bulk_wait(icsc_ptr icsc, unsigned long timeout);
+
+/** @} */
+
+/** \defgroup rate
+ *  \brief Negotiating a faster baud rate on a point-to-point link
+ *
+ *  Both ends of a link open it at a common base rate and list the rates
+ *  their hardware can run with icsc_rate_allow(). icsc_negotiate_rate()
+ *  then sends the peer its list in an ICSC_SYS_RATE frame. The peer picks
+ *  the fastest rate on both lists, answers, and switches. The initiator
+ *  switches too and confirms at the new rate. The peer answers, and keeps
+ *  its own rollback armed until the initiator acknowledges that answer or
+ *  sends it anything else at the new rate. If any step does not get
+ *  through, both sides go back to the old rate on their own.
+ *
+ *  While a faster rate is in use, each side watches its receive errors
+ *  and the bytes that are not part of any valid frame. If too many turn
+ *  up, it falls back to the base rate. The other side sees the same
+ *  garbage and does the same. Because every byte that is not part of a
+ *  frame for this context counts, this only suits links with two stations.
+ *  @{
+ */
+
+/*! \brief Set the rates this context may switch to
+ *  \param icsc Pointer to an icsc context created using icsc_init() or icsc_init_de()
+ *  \param rates The allowed baud rates as termios constants (e.g., B115200)
+ *  \param count The number of rates
+ *  \return 0 on success, -1 on error.
+ */
+extern int icsc_rate_allow(icsc_ptr icsc, const unsigned long *rates, int count);
+
+/*! \brief Switch a link to the fastest rate both ends allow
+ *  \param icsc Pointer to an icsc context created using icsc_init() or icsc_init_de()
+ *  \param station The station at the other end of the link
+ *  \return The baud rate in use afterwards as a termios constant, or 0 on error.
+ */
+extern unsigned long icsc_negotiate_rate(icsc_ptr icsc, uint8_t station);
+
+/** @} */
 
 /** \defgroup debugging
  *  \brief Functions used for debugging and error reporting
@@ -0,0 +1,261 @@
+/** @file icsc.hpp
+ *  @brief Header-only C++ wrapper for the ICSC library
+ *
+ *  icsc::Endpoint owns an ICSC context for its lifetime and adds typed
+ *  sending and typed command handlers on top of icsc_send_array() and
+ *  icsc_register_command_arg():
+ *
+ *      struct SetPoint { uint8_t channel; uint8_t flags; int16_t low; int16_t high; };
+ *
+ *      void setPoint(icsc::Endpoint &ep, uint8_t from, const SetPoint &sp);
+ *
+ *      icsc::Endpoint ep("/dev/ttyAMA0", B115200, 50);
+ *      ep.on<'S', SetPoint>(setPoint);     // handler chosen at run time
+ *      ep.on<'S', SetPoint, setPoint>();   // handler fixed at compile time
+ *      ep.send(100, 'S', SetPoint{2, 0, -40, 85});
+ *
+ *  A payload is the bytes of the value, so a type must have no padding for
+ *  the same message to mean the same thing on both ends, and both ends must
+ *  lay the struct out alike. icsc::is_packed<T> checks this at compile time.
+ *  Where the layout has to be fixed whatever the compiler, use icsc-schema.
+ *
+ *  Payloads are sent in little-endian order. Arithmetic types are converted
+ *  automatically. On big-endian hosts other types need an
+ *  icsc_byteswap(T &) overload, found by argument dependent lookup, that
+ *  swaps each of their fields; on little-endian hosts nothing is needed and
+ *  no conversion code is generated. Handlers are plain function pointers
+ *  and each message is decoded on the stack, so no memory is allocated per
+ *  message.
+ */
+
+#ifndef _ICSC_HPP
+#define _ICSC_HPP
+
+#include <stdexcept>
+#include <type_traits>
+#include <cstring>
+#include <cstdint>
+
+#include "icsc.h"
+
+namespace icsc {
+
+/*! \brief Whether T can be sent as its bytes: no padding and no bytes that
+ *         do not take part in its value. Floating point members cannot be
+ *         checked, so specialise this to std::true_type for a struct that
+ *         holds them once you have made sure it has no padding. */
+template<typename T>
+struct is_packed : std::integral_constant<bool,
+#if __cplusplus >= 201703L
+    std::is_arithmetic<T>::value || std::has_unique_object_representations<T>::value
+#else
+    std::is_arithmetic<T>::value || __has_unique_object_representations(T)
+#endif
+> {};
+
+namespace detail {
+
+typedef std::integral_constant<bool, __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__> little_endian;
+
+template<typename T>
+inline void swap_bytes(T &value, std::true_type /* arithmetic */) {
+    unsigned char *p = reinterpret_cast<unsigned char *>(&value);
+    for (std::size_t i = 0; i < sizeof(T) / 2; i++) {
+        unsigned char c = p[i];
+        p[i] = p[sizeof(T) - 1 - i];
+        p[sizeof(T) - 1 - i] = c;
+    }
+}
+
+template<typename T>
+inline void swap_bytes(T &value, std::false_type /* arithmetic */) {
+    icsc_byteswap(value);
+}
+
+template<typename T>
+inline void to_wire(T &, std::true_type /* little endian */) {
+}
+
+template<typename T>
+inline void to_wire(T &value, std::false_type /* little endian */) {
+    swap_bytes(value, std::is_arithmetic<T>());
+}
+
+// Converting from little-endian is the same operation as converting to it.
+template<typename T>
+inline void to_wire(T &value) {
+    to_wire(value, little_endian());
+}
+
+template<typename T>
+inline void check_type() {
+    static_assert(std::is_trivially_copyable<T>::value, "ICSC payloads must be trivially copyable");
+    static_assert(is_packed<T>::value, "ICSC payloads must not have padding; see icsc::is_packed");
+    static_assert(sizeof(T) <= 255, "ICSC payloads are at most 255 bytes");
+}
+
+} // namespace detail
+
+class Endpoint {
+    public:
+        /*! \brief Open an endpoint on a serial port */
+        Endpoint(const char *uart, unsigned long baud, uint8_t station, int de = -1) {
+            open(icsc_init_de(uart, baud, station, de));
+        }
+
+        /*! \brief Open an endpoint on any transport */
+        Endpoint(const icsc_transport_t *transport, const char *path, unsigned long baud, uint8_t station, int de = -1) {
+            open(icsc_init_transport(transport, path, baud, station, de));
+        }
+
+        /*! \brief Take ownership of a context that is already open */
+        explicit Endpoint(icsc_ptr icsc) {
+            open(icsc);
+        }
+
+        ~Endpoint() {
+            icsc_close(_icsc);
+        }
+
+        // The C callbacks hold a pointer to the endpoint, so it cannot move.
+        Endpoint(const Endpoint &) = delete;
+        Endpoint &operator=(const Endpoint &) = delete;
+
+        /*! \brief The underlying C context, for use with the C API */
+        icsc_ptr get() const {
+            return _icsc;
+        }
+
+        uint8_t station() const {
+            return _icsc->station;
+        }
+
+        /*! \brief Send a value to a remote station */
+        template<typename T>
+        int send(uint8_t station, char command, const T &value) {
+            detail::check_type<T>();
+            icsc_frame_t frame;
+            T wire = value;
+            detail::to_wire(wire);
+            std::memcpy(ICSC_FRAME_PAYLOAD(&frame), &wire, sizeof(T));
+            return icsc_send_frame(_icsc, &frame, station, command, sizeof(T));
+        }
+
+        /*! \brief Send a value to all remote stations */
+        template<typename T>
+        int broadcast(char command, const T &value) {
+            return send(ICSC_BROADCAST, command, value);
+        }
+
+        /*! \brief Send a command with no payload */
+        int send(uint8_t station, char command) {
+            return icsc_send_array(_icsc, station, command, 0, NULL);
+        }
+
+        /*! \brief Call a handler whenever Cmd arrives with a payload of type T */
+        template<char Cmd, typename T>
+        int on(void (*handler)(Endpoint &, uint8_t, const T &)) {
+            detail::check_type<T>();
+            Slot &slot = _slots[(uint8_t)Cmd];
+            slot.function = reinterpret_cast<void (*)()>(handler);
+            slot.thunk = &Endpoint::dynamic_thunk<T>;
+            return attach(Cmd);
+        }
+
+        /*! \brief Call Handler whenever Cmd arrives with a payload of type T. The
+         *         handler is bound at compile time and can be inlined. */
+        template<char Cmd, typename T, void (*Handler)(Endpoint &, uint8_t, const T &)>
+        int on() {
+            detail::check_type<T>();
+            Slot &slot = _slots[(uint8_t)Cmd];
+            slot.function = NULL;
+            slot.thunk = &Endpoint::static_thunk<T, Handler>;
+            return attach(Cmd);
+        }
+
+        /*! \brief Stop handling Cmd. Callbacks registered for it through the C
+         *         API are left alone. */
+        template<char Cmd>
+        int off() {
+            Slot &slot = _slots[(uint8_t)Cmd];
+            if (slot.thunk == NULL) {
+                return -1;
+            }
+            slot.thunk = NULL;
+            slot.function = NULL;
+            if (!slot.attached) {
+                return 0;
+            }
+            slot.attached = false;
+            return icsc_unregister_command_arg(_icsc, Cmd, &Endpoint::dispatch, this);
+        }
+
+    private:
+        struct Slot {
+            void (*thunk)(Endpoint &, const Slot &, uint8_t, const char *, uint8_t);
+            void (*function)();
+            bool attached;
+        };
+
+        icsc_ptr _icsc;
+        Slot _slots[256];
+
+        void open(icsc_ptr icsc) {
+            if (icsc == NULL) {
+                throw std::runtime_error("Unable to open ICSC endpoint");
+            }
+            _icsc = icsc;
+            std::memset(_slots, 0, sizeof(_slots));
+        }
+
+        int attach(char command) {
+            Slot &slot = _slots[(uint8_t)command];
+            if (slot.attached) {
+                return 0;
+            }
+            if (icsc_register_command_arg(_icsc, command, &Endpoint::dispatch, this) < 0) {
+                slot.thunk = NULL;
+                return -1;
+            }
+            slot.attached = true;
+            return 0;
+        }
+
+        template<typename T>
+        static bool decode(const char *data, uint8_t len, T &value) {
+            if (len != sizeof(T)) {
+                return false;
+            }
+            std::memcpy(&value, data, sizeof(T));
+            detail::to_wire(value);
+            return true;
+        }
+
+        template<typename T>
+        static void dynamic_thunk(Endpoint &ep, const Slot &slot, uint8_t from, const char *data, uint8_t len) {
+            T value;
+            if (decode(data, len, value)) {
+                reinterpret_cast<void (*)(Endpoint &, uint8_t, const T &)>(slot.function)(ep, from, value);
+            }
+        }
+
+        template<typename T, void (*Handler)(Endpoint &, uint8_t, const T &)>
+        static void static_thunk(Endpoint &ep, const Slot &, uint8_t from, const char *data, uint8_t len) {
+            T value;
+            if (decode(data, len, value)) {
+                Handler(ep, from, value);
+            }
+        }
+
+        static void dispatch(icsc_ptr, unsigned char from, char command, unsigned char len, char *data, void *arg) {
+            Endpoint *ep = static_cast<Endpoint *>(arg);
+            const Slot &slot = ep->_slots[(uint8_t)command];
+            if (slot.thunk != NULL) {
+                slot.thunk(*ep, slot, from, data, len);
+            }
+        }
+};
+
+} // namespace icsc
+
+#endif
@@ -0,0 +1,217 @@
+/** @file icsc_private.h
+ *  @brief Internal functions shared between the library's source files
+ */
+
+#ifndef _ICSC_PRIVATE_H
+#define _ICSC_PRIVATE_H
+
+#include <time.h>
+
+#include "icsc.h"
+
+/* Monotonic time in microseconds */
+static inline uint64_t icsc_micros() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* icsc.c */
+
+/* Whether frames addressed to a station number are for this context: its
+ * own station, broadcasts and the groups it has joined. */
+#define ICSC_MEMBER(icsc, n) (__atomic_load_n(&(icsc)->members[(n) >> 3], __ATOMIC_RELAXED) & (1 << ((n) & 7)))
+#define ICSC_MEMBER_SET(icsc, n) ((icsc)->members[(n) >> 3] |= (1 << ((n) & 7)))
+
+/* Assemble a complete wire frame into frame, which must hold at least
+ * ICSC_MAX_FRAME bytes. Returns the number of bytes used. */
+extern int icsc_build_frame(uint8_t *frame, uint8_t origin, uint8_t station, uint8_t command, uint8_t len, const char *data);
+
+/* Put an assembled frame on the wire, taking care of the UART lock and DE. */
+extern int icsc_write_frame(icsc_ptr icsc, const uint8_t *frame, int len);
+
+/* Write an assembled frame straight to the link, skipping the priority
+ * arbiter and TDMA slots. */
+extern int icsc_write_link(icsc_ptr icsc, const uint8_t *frame, int len);
+
+/* Send a frame with an arbitrary origin address. */
+extern int icsc_send_raw(icsc_ptr icsc, uint8_t origin, uint8_t station, char command, uint8_t len, const char *data);
+
+/* Return the receive state machine to looking for a header. */
+extern int icsc_reset(icsc_ptr icsc);
+
+/* A thread waiting for a particular frame to arrive, usually the answer
+ * to a request it has sent. Add the waiter before sending the request so
+ * that a fast answer is not missed. */
+typedef struct icsc_waiter {
+    uint8_t station;
+    uint8_t command;
+    int done;
+    uint8_t len;
+    char data[255];
+    uint64_t when;
+    struct icsc_waiter *next;
+} icsc_waiter_t;
+
+extern void icsc_waiter_add(icsc_ptr icsc, icsc_waiter_t *waiter, uint8_t station, uint8_t command);
+
+/* Wait until the frame arrives or the timeout (in microseconds) expires,
+ * then remove the waiter. Returns 1 if the frame arrived, 0 otherwise. */
+extern int icsc_waiter_wait(icsc_ptr icsc, icsc_waiter_t *waiter, unsigned long timeout);
+
+/* Time in microseconds to transmit a frame with len bytes of payload at the
+ * context's baud rate. Transports without a baud rate take no time. */
+extern unsigned long icsc_frame_time(icsc_ptr icsc, uint8_t len);
+
+/* Wait up to timeout microseconds for data, then read and parse whatever
+ * has arrived. This is the body of the read thread; threadless contexts
+ * call it from whichever thread is waiting. Returns -1 once the link has
+ * hung up or failed. */
+extern int icsc_process(icsc_ptr icsc, unsigned long timeout);
+
+/* Called by the read thread with every valid frame addressed to us. */
+extern void icsc_waiter_complete(icsc_ptr icsc, uint8_t sender, uint8_t command, uint8_t len, const char *data);
+
+/* Hand a received message to the waiters, conflation slots, callbacks
+ * and, if inQueue says it is already in the receive queue slot, the
+ * consumer. Returns 0 if conflation kept it, 1 otherwise. */
+extern int icsc_dispatch(icsc_ptr icsc, uint8_t station, uint8_t sender, char command, uint8_t len, char *data, int inQueue);
+
+/* relay.c */
+
+/* Return 1 if there is a route for the station, 0 otherwise. */
+extern int icsc_route_exists(icsc_ptr icsc, uint8_t station);
+
+/* Forward a frame received on icsc through the route for station. */
+extern int icsc_relay_frame(icsc_ptr icsc, uint8_t station, uint8_t sender, uint8_t command, uint8_t len, const char *data);
+
+/* Release the routing table when the endpoint is closed. */
+extern void icsc_route_free(icsc_ptr icsc);
+
+/* status.c */
+
+/* Answer an ICSC_SYS_QSTAT query from origin, the station it was sent to. */
+extern int icsc_respond_to_status(icsc_ptr icsc, uint8_t origin, uint8_t station);
+
+/* discover.c */
+
+/* Called by the read thread with the sender of every valid frame. */
+extern void icsc_discover_seen(icsc_ptr icsc, uint8_t station);
+
+/* tdma.c */
+
+/* Hold a frame with len bytes of payload until it fits in our slot.
+ * Returns 0 when it may be sent, -1 if it never can be. */
+extern int icsc_tdma_wait(icsc_ptr icsc, uint8_t len);
+
+/* Called by the read thread with every ICSC_SYS_SYNC frame. */
+extern void icsc_tdma_sync(icsc_ptr icsc, uint8_t len, const char *data);
+
+/* rate.c */
+
+/* Called by the read thread with every ICSC_SYS_RATE frame. */
+extern void icsc_rate_frame(icsc_ptr icsc, uint8_t sender, uint8_t len, const char *data);
+
+/* Called by the read thread with every other valid frame for us, so a
+ * switch is kept once the initiator is heard from at the new rate. */
+extern void icsc_rate_heard(icsc_ptr icsc, uint8_t sender);
+
+/* Called by the read thread with the number of bytes read, after they
+ * have been parsed, and on every timeout. Rolls back unconfirmed switches
+ * and falls back to the base rate when the link turns bad. */
+extern void icsc_rate_check(icsc_ptr icsc, ssize_t bytes);
+
+/* When icsc_rate_check() next has something to do, as a monotonic time
+ * in microseconds. */
+extern uint64_t icsc_rate_next(icsc_ptr icsc);
+
+extern void icsc_rate_free(icsc_ptr icsc);
+
+/* conflate.c */
+
+/* Store the frame in its conflation slot, if it has one. Returns 1 if it
+ * did, 0 if the frame should be dispatched as usual. */
+extern int icsc_conflate_update(icsc_ptr icsc, uint8_t station, char command, uint8_t len, const char *data);
+
+extern void icsc_conflate_free(icsc_ptr icsc);
+
+/* monitor.c */
+
+/* Pass the frame being received to the monitor callback. Only the header
+ * fields are filled in unless the frame is valid. */
+extern void icsc_monitor_frame(icsc_ptr icsc, int status);
+
+extern void icsc_monitor_free(icsc_ptr icsc);
+
+/* aggregate.c */
+
+/* Dispatch each message in an ICSC_SYS_AGGR frame in turn. */
+extern void icsc_aggr_split(icsc_ptr icsc, uint8_t station, uint8_t sender, uint8_t len, char *data);
+
+/* Send whatever has waited out the coalescing delay. For threadless
+ * contexts, which have no aggregation thread. */
+extern void icsc_aggr_poll(icsc_ptr icsc);
+
+/* When icsc_aggr_poll() next has something to send, as a monotonic time
+ * in microseconds, or 0 if nothing is waiting. */
+extern uint64_t icsc_aggr_next(icsc_ptr icsc);
+
+extern void icsc_aggr_free(icsc_ptr icsc);
+
+/* bulk.c */
+
+/* Called by the read thread with every ICSC_SYS_BULK and
+ * ICSC_SYS_BULK_NACK frame. */
+extern void icsc_bulk_frame(icsc_ptr icsc, uint8_t sender, uint8_t command, uint8_t len, const char *data);
+
+extern void icsc_bulk_free(icsc_ptr icsc);
+
+/* flow.c */
+
+/* Call the writable callback if a send was refused and the backlog has
+ * since fallen to the low-water mark. */
+extern void icsc_flow_check(icsc_ptr icsc);
+
+/* Whether a send has been refused and the writable callback not yet made.
+ * A socket's output queue drains without any further send, so the read
+ * thread polls at least this often, in microseconds, while it is set. */
+extern int icsc_flow_blocked(icsc_ptr icsc);
+
+#define ICSC_FLOW_RECHECK_TIME 10000
+
+/* recv.c */
+
+/* Return the payload buffer of the next free slot in the receive queue,
+ * or NULL if the queue is full. The slot is only handed to the consumer
+ * once it is published. */
+extern char *icsc_recv_claim(icsc_ptr icsc);
+extern void icsc_recv_publish(icsc_ptr icsc, uint8_t station, uint8_t sender, uint8_t command, uint8_t len);
+
+/* Number of received frames not yet taken by the consumer. */
+extern int icsc_recv_depth(icsc_ptr icsc);
+
+extern void icsc_recv_free(icsc_ptr icsc);
+
+/* transport.c */
+
+/* Building blocks for transports that sit on a file descriptor. The private
+ * data is the descriptor itself, which icsc_fd_wrap() makes non-blocking. */
+extern void *icsc_fd_wrap(int fd);
+extern ssize_t icsc_fd_read(void *data, uint8_t *buf, size_t len);
+extern ssize_t icsc_fd_write(void *data, const uint8_t *buf, size_t len);
+extern int icsc_fd_wait(void *data, unsigned long timeout);
+extern int icsc_fd_outq(void *data);
+extern int icsc_fd_get(void *data);
+extern void icsc_fd_close(void *data);
+
+/* client.c */
+
+/* Daemon control frames are addressed from a station to itself, which
+ * never happens on a real bus, and carry ICSC_CMD_SYS as their command.
+ * The payload is a flags byte saying which maps follow, a 256-bit station
+ * map and a 256-bit command map. */
+#define ICSC_DAEMON_FILTER_STATIONS 0x01
+#define ICSC_DAEMON_FILTER_COMMANDS 0x02
+#define ICSC_DAEMON_FILTER_LEN 65
+
+#endif
@@ -0,0 +1,80 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+
+#include "icsc.h"
+#include "icsc_private.h"
+#include "config.h"
+
+// The callback and its argument never change once published, so the read
+// thread always sees a matching pair. Setting a new one swaps in a new
+// struct. The read thread may still be using the old one, so it is kept,
+// linked from its replacement, until the context is closed.
+struct icsc_monitor {
+    icsc_monitor_callback callback;
+    void *arg;
+    struct icsc_monitor *replaced;
+};
+
+int icsc_set_monitor(icsc_ptr icsc, icsc_monitor_callback callback, void *arg) {
+    struct icsc_monitor *m;
+
+    if (icsc == NULL) {
+        return -1;
+    }
+
+    if (callback == NULL && __atomic_load_n(&icsc->monitor, __ATOMIC_ACQUIRE) == NULL) {
+        return 0;
+    }
+
+    m = (struct icsc_monitor *)calloc(1, sizeof(struct icsc_monitor));
+    if (m == NULL) {
+        icsc_error("Cannot allocate monitor: %s\n", strerror(errno));
+        return -1;
+    }
+    m->callback = callback;
+    m->arg = arg;
+
+    m->replaced = __atomic_exchange_n(&icsc->monitor, m, __ATOMIC_ACQ_REL);
+    return 0;
+}
+
+void icsc_monitor_free(icsc_ptr icsc) {
+    struct icsc_monitor *m = icsc->monitor;
+    struct icsc_monitor *next;
+
+    while (m != NULL) {
+        next = m->replaced;
+        free(m);
+        m = next;
+    }
+    icsc->monitor = NULL;
+}
+
+int icsc_set_promiscuous(icsc_ptr icsc, int mode) {
+    if (icsc == NULL || mode < ICSC_PROMISCUOUS_OFF || mode > ICSC_PROMISCUOUS_PASSIVE) {
+        return -1;
+    }
+    icsc->promiscuous = mode;
+    return 0;
+}
+
+void icsc_monitor_frame(icsc_ptr icsc, int status) {
+    struct icsc_monitor *m = __atomic_load_n(&icsc->monitor, __ATOMIC_ACQUIRE);
+    icsc_monitor_frame_t frame;
+
+    if (m->callback == NULL) {
+        return;
+    }
+
+    frame.station = icsc->recStation;
+    frame.sender = icsc->recSender;
+    frame.command = icsc->recCommand;
+    frame.len = icsc->recLen;
+    frame.data = (status == ICSC_MONITOR_OK) ? icsc->buffer : NULL;
+    frame.status = status;
+    frame.when = icsc_micros();
+
+    m->callback(icsc, &frame, m->arg);
+}
@@ -0,0 +1,45 @@
+/** @file probes.h
+ *  @brief USDT probes on the frame lifecycle
+ *
+ *  Built in with ./configure --enable-usdt. Otherwise every probe compiles
+ *  to nothing. All probes are in the "icsc" provider and take the context
+ *  pointer as their first argument:
+ *
+ *      rx_header(icsc, sender, station, command, len)
+ *      rx_payload(icsc, len)
+ *      rx_checksum(icsc, ok)
+ *      dispatch_start(icsc, sender, command)
+ *      dispatch_end(icsc, sender, command)
+ *      tx_start(icsc, station, command, len)
+ *      tx_lock(icsc)
+ *      de_assert(icsc)
+ *      tx_drained(icsc, rc)
+ *      de_release(icsc)
+ *
+ *  See tools/bpftrace for scripts that use them.
+ */
+
+#ifndef _ICSC_PROBES_H
+#define _ICSC_PROBES_H
+
+#ifdef ENABLE_USDT
+
+#include <sys/sdt.h>
+
+#define ICSC_PROBE1(name, a) DTRACE_PROBE1(icsc, name, a)
+#define ICSC_PROBE2(name, a, b) DTRACE_PROBE2(icsc, name, a, b)
+#define ICSC_PROBE3(name, a, b, c) DTRACE_PROBE3(icsc, name, a, b, c)
+#define ICSC_PROBE4(name, a, b, c, d) DTRACE_PROBE4(icsc, name, a, b, c, d)
+#define ICSC_PROBE5(name, a, b, c, d, e) DTRACE_PROBE5(icsc, name, a, b, c, d, e)
+
+#else
+
+#define ICSC_PROBE1(name, a)
+#define ICSC_PROBE2(name, a, b)
+#define ICSC_PROBE3(name, a, b, c)
+#define ICSC_PROBE4(name, a, b, c, d)
+#define ICSC_PROBE5(name, a, b, c, d, e)
+
+#endif
+
+#endif
@@ -0,0 +1,382 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <endian.h>
+#include <pthread.h>
+
+#include "icsc.h"
+#include "icsc_private.h"
+#include "config.h"
+
+// The first byte of every ICSC_SYS_RATE payload says what it is. Rates
+// follow as 32-bit little-endian bits per second.
+#define RATE_OFFER      1   // Rates the sender allows
+#define RATE_SWITCH     2   // The rate the sender is switching to
+#define RATE_REFUSE     3   // No faster rate is possible
+#define RATE_CONFIRM    4   // Sent at the new rate by the initiator
+#define RATE_CONFIRMED  5   // Sent at the new rate by the peer
+#define RATE_ACK        6   // The initiator heard RATE_CONFIRMED and is staying
+
+#define RATE_MAX_RATES  ((255 - 1) / 4)
+
+// How long the peer waits for the initiator to commit to the new rate
+// before going back to the old one, in microseconds. The initiator gives
+// up waiting for RATE_CONFIRMED at half this.
+#define RATE_CONFIRM_TIME 500000
+
+// RATE_ACK is not answered, so it is sent this many times.
+#define RATE_ACK_COUNT 2
+
+// How often the link is checked, and what makes it bad: at least this
+// many bad frames making up a tenth of all frames, or at least this many
+// bytes of garbage making up a quarter of all bytes.
+#define RATE_WINDOW       1000000
+#define RATE_BAD_FRAMES   3
+#define RATE_BAD_BYTES    64
+
+struct icsc_rate {
+    pthread_mutex_t mutex;
+    unsigned long base;
+    unsigned long allowed[RATE_MAX_RATES];
+    int count;
+
+    // A switch made by the peer side that the initiator has not yet
+    // committed to. Answering RATE_CONFIRM is not enough: if our
+    // RATE_CONFIRMED is lost the initiator goes back on its own.
+    unsigned long previous;
+    uint64_t deadline;
+    uint8_t initiator;
+    int confirmed;
+
+    // The link watch
+    uint64_t windowStart;
+    uint32_t rawBytes;
+    uint32_t frames;
+    uint32_t rxBytes;
+    uint32_t errors;
+};
+
+static uint32_t icsc_rate_errors(icsc_ptr icsc) {
+    return icsc->stats.checksumErrors + icsc->stats.framingErrors + icsc->stats.rxTimeouts;
+}
+
+static int icsc_rate_switch(icsc_ptr icsc, unsigned long baud) {
+    int rc;
+
+    if (baud == icsc->baud) {
+        return 0;
+    }
+
+    // Never change speed in the middle of a frame we are sending.
+    pthread_mutex_lock(&icsc->uartMutex);
+    rc = icsc->transport->set_baud(icsc->transportData, baud);
+    if (rc == 0) {
+        icsc_debug("Baud rate is now %lu\n", icsc_serial_baud_rate(baud));
+        icsc->baud = baud;
+    }
+    pthread_mutex_unlock(&icsc->uartMutex);
+    return rc;
+}
+
+static int icsc_rate_send(icsc_ptr icsc, uint8_t station, uint8_t op, const unsigned long *rates, int count) {
+    char data[1 + RATE_MAX_RATES * 4];
+    uint32_t v;
+    int i;
+
+    data[0] = op;
+    for (i = 0; i < count; i++) {
+        v = htole32(icsc_serial_baud_rate(rates[i]));
+        memcpy(&data[1 + i * 4], &v, 4);
+    }
+    return icsc_send_raw(icsc, icsc->station, station, ICSC_SYS_RATE, 1 + count * 4, data);
+}
+
+static unsigned long icsc_rate_get(const char *data, int index) {
+    uint32_t v;
+
+    memcpy(&v, &data[1 + index * 4], 4);
+    return icsc_serial_baud_symbol(le32toh(v));
+}
+
+static int icsc_rate_allowed(struct icsc_rate *r, unsigned long baud) {
+    int i;
+
+    for (i = 0; i < r->count; i++) {
+        if (r->allowed[i] == baud) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int icsc_rate_allow(icsc_ptr icsc, const unsigned long *rates, int count) {
+    struct icsc_rate *r;
+    int i;
+
+    if (icsc == NULL || rates == NULL || count < 0 || count > RATE_MAX_RATES) {
+        return -1;
+    }
+
+    if (icsc->transport->set_baud == NULL) {
+        icsc_error("The %s transport has no baud rate\n", icsc->transport->name);
+        return -1;
+    }
+
+    for (i = 0; i < count; i++) {
+        if (icsc_serial_baud_rate(rates[i]) == 0) {
+            icsc_error("Invalid baud rate\n");
+            return -1;
+        }
+    }
+
+    if (icsc->rate == NULL) {
+        r = (struct icsc_rate *)calloc(1, sizeof(struct icsc_rate));
+        if (r == NULL) {
+            icsc_error("Cannot allocate rate negotiation: %s\n", strerror(errno));
+            return -1;
+        }
+        pthread_mutex_init(&r->mutex, NULL);
+        r->base = icsc->baud;
+        r->windowStart = icsc_micros();
+        r->errors = icsc_rate_errors(icsc);
+        r->frames = icsc->stats.rxFrames;
+        r->rxBytes = icsc->stats.rxBytes;
+        __atomic_store_n(&icsc->rate, r, __ATOMIC_RELEASE);
+    }
+
+    r = icsc->rate;
+    pthread_mutex_lock(&r->mutex);
+    memcpy(r->allowed, rates, count * sizeof(unsigned long));
+    r->count = count;
+    pthread_mutex_unlock(&r->mutex);
+    return 0;
+}
+
+unsigned long icsc_negotiate_rate(icsc_ptr icsc, uint8_t station) {
+    struct icsc_rate *r;
+    icsc_waiter_t waiter;
+    unsigned long allowed[RATE_MAX_RATES];
+    unsigned long previous;
+    unsigned long baud;
+    unsigned long timeout;
+    uint64_t deadline;
+    uint64_t now;
+    int count;
+    int i;
+
+    if (icsc == NULL || icsc->rate == NULL) {
+        return 0;
+    }
+
+    r = icsc->rate;
+    pthread_mutex_lock(&r->mutex);
+    count = r->count;
+    memcpy(allowed, r->allowed, count * sizeof(unsigned long));
+    pthread_mutex_unlock(&r->mutex);
+
+    previous = icsc->baud;
+    timeout = icsc_frame_time(icsc, 1 + count * 4) + icsc_frame_time(icsc, 5) + ICSC_TURNAROUND_TIME;
+
+    icsc_waiter_add(icsc, &waiter, station, ICSC_SYS_RATE);
+    if (icsc_rate_send(icsc, station, RATE_OFFER, allowed, count) < 0) {
+        icsc_waiter_wait(icsc, &waiter, 0);
+        return 0;
+    }
+    if (!icsc_waiter_wait(icsc, &waiter, timeout) || waiter.len < 1) {
+        icsc_debug("No answer to rate offer from station %d\n", station);
+        return 0;
+    }
+
+    if (waiter.data[0] != RATE_SWITCH || waiter.len < 5) {
+        icsc_debug("Station %d refused a faster rate\n", station);
+        return previous;
+    }
+
+    baud = icsc_rate_get(waiter.data, 0);
+    if (baud == 0 || (baud != r->base && !icsc_rate_allowed(r, baud))) {
+        // The peer will time out and go back on its own.
+        icsc_error("Station %d chose a rate we do not allow\n", station);
+        return previous;
+    }
+
+    if (icsc_rate_switch(icsc, baud) < 0) {
+        return previous;
+    }
+
+    // Keep confirming until the peer answers at the new rate.
+    deadline = icsc_micros() + RATE_CONFIRM_TIME / 2;
+    timeout = icsc_frame_time(icsc, 5) * 2 + ICSC_TURNAROUND_TIME;
+    while ((now = icsc_micros()) < deadline) {
+        icsc_waiter_add(icsc, &waiter, station, ICSC_SYS_RATE);
+        icsc_rate_send(icsc, station, RATE_CONFIRM, &baud, 1);
+        if (icsc_waiter_wait(icsc, &waiter, timeout) && waiter.len >= 1 && waiter.data[0] == RATE_CONFIRMED) {
+            // Let the peer stop its rollback now that we are staying.
+            for (i = 0; i < RATE_ACK_COUNT; i++) {
+                icsc_rate_send(icsc, station, RATE_ACK, NULL, 0);
+            }
+            icsc_debug("Link to station %d now at %lu baud\n", station, icsc_serial_baud_rate(baud));
+            return baud;
+        }
+    }
+
+    icsc_debug("No confirmation from station %d; going back\n", station);
+    icsc_rate_switch(icsc, previous);
+    return previous;
+}
+
+void icsc_rate_frame(icsc_ptr icsc, uint8_t sender, uint8_t len, const char *data) {
+    struct icsc_rate *r = icsc->rate;
+    unsigned long baud = 0;
+    unsigned long offered;
+    int i;
+
+    if (len < 1) {
+        return;
+    }
+
+    switch (data[0]) {
+        case RATE_OFFER:
+            if (r != NULL) {
+                pthread_mutex_lock(&r->mutex);
+                for (i = 0; i < (len - 1) / 4; i++) {
+                    offered = icsc_rate_get(data, i);
+                    if (icsc_rate_allowed(r, offered) && icsc_serial_baud_rate(offered) > icsc_serial_baud_rate(baud)) {
+                        baud = offered;
+                    }
+                }
+                pthread_mutex_unlock(&r->mutex);
+            }
+
+            if (baud == 0 || baud == icsc->baud) {
+                icsc_rate_send(icsc, sender, RATE_REFUSE, NULL, 0);
+                break;
+            }
+
+            // The answer is drained at the old rate before we switch.
+            icsc_rate_send(icsc, sender, RATE_SWITCH, &baud, 1);
+            pthread_mutex_lock(&r->mutex);
+            r->previous = icsc->baud;
+            r->deadline = icsc_micros() + RATE_CONFIRM_TIME;
+            r->initiator = sender;
+            r->confirmed = 0;
+            pthread_mutex_unlock(&r->mutex);
+            if (icsc_rate_switch(icsc, baud) < 0) {
+                r->deadline = 0;
+            }
+            break;
+
+        case RATE_CONFIRM:
+            // Keep the rollback armed until the initiator shows it heard us.
+            if (r != NULL) {
+                pthread_mutex_lock(&r->mutex);
+                if (r->deadline != 0 && sender == r->initiator) {
+                    r->confirmed = 1;
+                }
+                pthread_mutex_unlock(&r->mutex);
+            }
+            baud = icsc->baud;
+            icsc_rate_send(icsc, sender, RATE_CONFIRMED, &baud, 1);
+            break;
+
+        case RATE_ACK:
+            if (r != NULL) {
+                pthread_mutex_lock(&r->mutex);
+                if (r->deadline != 0 && sender == r->initiator) {
+                    icsc_debug("Station %d committed to %lu baud\n", sender, icsc_serial_baud_rate(icsc->baud));
+                    r->deadline = 0;
+                }
+                pthread_mutex_unlock(&r->mutex);
+            }
+            break;
+    }
+}
+
+void icsc_rate_heard(icsc_ptr icsc, uint8_t sender) {
+    struct icsc_rate *r = icsc->rate;
+
+    // Other traffic from the initiator at the new rate means it kept it,
+    // even if every RATE_ACK was lost.
+    pthread_mutex_lock(&r->mutex);
+    if (r->deadline != 0 && r->confirmed && sender == r->initiator) {
+        r->deadline = 0;
+    }
+    pthread_mutex_unlock(&r->mutex);
+}
+
+void icsc_rate_check(icsc_ptr icsc, ssize_t bytes) {
+    struct icsc_rate *r = icsc->rate;
+    uint64_t now;
+    uint32_t frames;
+    uint32_t errors;
+    uint32_t good;
+    uint32_t noise;
+    unsigned long back = 0;
+
+    if (r == NULL) {
+        return;
+    }
+
+    if (bytes > 0) {
+        r->rawBytes += bytes;
+    }
+
+    now = icsc_micros();
+
+    pthread_mutex_lock(&r->mutex);
+    if (r->deadline != 0 && now > r->deadline) {
+        icsc_debug("Rate switch was not confirmed; going back\n");
+        back = r->previous;
+        r->deadline = 0;
+    }
+    pthread_mutex_unlock(&r->mutex);
+
+    if (back != 0) {
+        icsc_rate_switch(icsc, back);
+    }
+
+    if (now - r->windowStart < RATE_WINDOW) {
+        return;
+    }
+
+    frames = icsc->stats.rxFrames - r->frames;
+    errors = icsc_rate_errors(icsc) - r->errors;
+    good = frames * (ICSC_SOH_START_COUNT + 8) + (icsc->stats.rxBytes - r->rxBytes);
+    noise = r->rawBytes > good ? r->rawBytes - good : 0;
+
+    if (icsc->baud != r->base &&
+        ((errors >= RATE_BAD_FRAMES && errors * 10 >= frames + errors) ||
+         (noise >= RATE_BAD_BYTES && noise * 4 >= r->rawBytes))) {
+        icsc_error("Link is failing at %lu baud (%u bad frames, %u bytes of noise); falling back\n",
+            icsc_serial_baud_rate(icsc->baud), errors, noise);
+        icsc_rate_switch(icsc, r->base);
+    }
+
+    r->windowStart = now;
+    r->rawBytes = 0;
+    r->frames = icsc->stats.rxFrames;
+    r->rxBytes = icsc->stats.rxBytes;
+    r->errors = icsc_rate_errors(icsc);
+}
+
+uint64_t icsc_rate_next(icsc_ptr icsc) {
+    struct icsc_rate *r = icsc->rate;
+    uint64_t next;
+
+    pthread_mutex_lock(&r->mutex);
+    next = r->windowStart + RATE_WINDOW;
+    if (r->deadline != 0 && r->deadline < next) {
+        next = r->deadline + 1;
+    }
+    pthread_mutex_unlock(&r->mutex);
+    return next;
+}
+
+void icsc_rate_free(icsc_ptr icsc) {
+    if (icsc->rate == NULL) {
+        return;
+    }
+    pthread_mutex_destroy(&icsc->rate->mutex);
+    free(icsc->rate);
+    icsc->rate = NULL;
+}
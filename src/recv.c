@@ -0,0 +1,236 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "icsc.h"
+#include "icsc_private.h"
+#include "config.h"
+
+// The read thread receives frames straight into the slot at head and
+// publishes them by advancing head. The consumer hands out the slots from
+// read up to head, and tail follows the oldest slot not yet released. All
+// three counters only ever increase and wrap at 2^32. The depth is a power
+// of two so that a slot, its counter masked by depth - 1, stays in step
+// across the wrap.
+struct icsc_recv_slot {
+    uint8_t station;
+    uint8_t sender;
+    uint8_t command;
+    uint8_t len;
+    uint8_t released;
+    char data[255];
+};
+
+struct icsc_recv_queue {
+    uint32_t depth;
+    uint32_t mask;
+    uint32_t head;
+    uint32_t read;
+    uint32_t tail;
+    int waiting;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    struct icsc_recv_slot *slots;
+};
+
+int icsc_recv_enable(icsc_ptr icsc, int depth) {
+    struct icsc_recv_queue *q;
+    pthread_condattr_t attr;
+    uint32_t slots;
+
+    if (icsc == NULL || depth <= 0 || depth > ICSC_RECV_MAX_DEPTH) {
+        return -1;
+    }
+
+    for (slots = 1; slots < (uint32_t)depth; slots <<= 1);
+
+    if (icsc->recvQueue != NULL) {
+        icsc_error("Receive queue is already enabled\n");
+        return -1;
+    }
+
+    q = (struct icsc_recv_queue *)calloc(1, sizeof(struct icsc_recv_queue));
+    if (q == NULL) {
+        icsc_error("Cannot allocate receive queue: %s\n", strerror(errno));
+        return -1;
+    }
+
+    q->slots = (struct icsc_recv_slot *)calloc(slots, sizeof(struct icsc_recv_slot));
+    if (q->slots == NULL) {
+        icsc_error("Cannot allocate receive queue: %s\n", strerror(errno));
+        free(q);
+        return -1;
+    }
+    q->depth = slots;
+    q->mask = slots - 1;
+
+    pthread_mutex_init(&q->mutex, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&q->cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    __atomic_store_n(&icsc->recvQueue, q, __ATOMIC_RELEASE);
+    return 0;
+}
+
+char *icsc_recv_claim(icsc_ptr icsc) {
+    struct icsc_recv_queue *q = __atomic_load_n(&icsc->recvQueue, __ATOMIC_ACQUIRE);
+
+    if (q == NULL) {
+        return NULL;
+    }
+
+    if (q->head - __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) >= q->depth) {
+        icsc_debug("Receive queue is full\n");
+        icsc->stats.rxOverruns++;
+        return NULL;
+    }
+
+    return q->slots[q->head & q->mask].data;
+}
+
+void icsc_recv_publish(icsc_ptr icsc, uint8_t station, uint8_t sender, uint8_t command, uint8_t len) {
+    struct icsc_recv_queue *q = icsc->recvQueue;
+    struct icsc_recv_slot *slot = &q->slots[q->head & q->mask];
+
+    slot->station = station;
+    slot->sender = sender;
+    slot->command = command;
+    slot->len = len;
+    slot->released = 0;
+
+    // Pairs with the consumer setting waiting and then checking head, so
+    // either it sees the new frame or we see it waiting.
+    __atomic_store_n(&q->head, q->head + 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&q->waiting, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&q->mutex);
+        pthread_cond_signal(&q->cond);
+        pthread_mutex_unlock(&q->mutex);
+    }
+}
+
+int icsc_recv_depth(icsc_ptr icsc) {
+    struct icsc_recv_queue *q = __atomic_load_n(&icsc->recvQueue, __ATOMIC_ACQUIRE);
+
+    if (q == NULL) {
+        return 0;
+    }
+    return __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) - __atomic_load_n(&q->read, __ATOMIC_RELAXED);
+}
+
+int icsc_recv_many(icsc_ptr icsc, icsc_message_t *msgs, int max, unsigned long timeout) {
+    struct icsc_recv_queue *q;
+    struct icsc_recv_slot *slot;
+    struct timespec ts;
+    uint64_t deadline;
+    uint64_t now;
+    uint32_t head;
+    int count = 0;
+    int rc = 0;
+
+    if (icsc == NULL || msgs == NULL || icsc->recvQueue == NULL) {
+        return -1;
+    }
+
+    q = icsc->recvQueue;
+
+    // With no read thread nothing arrives unless we read it ourselves, as
+    // in icsc_waiter_wait().
+    if (icsc->threadless && timeout > 0 && !__atomic_exchange_n(&icsc->processing, 1, __ATOMIC_ACQUIRE)) {
+        deadline = icsc_micros() + timeout;
+        while (__atomic_load_n(&q->head, __ATOMIC_ACQUIRE) == __atomic_load_n(&q->read, __ATOMIC_RELAXED) &&
+               (now = icsc_micros()) < deadline) {
+            if (icsc_process(icsc, deadline - now) < 0) {
+                break;
+            }
+        }
+        __atomic_store_n(&icsc->processing, 0, __ATOMIC_RELEASE);
+        timeout = 0;
+    }
+
+    pthread_mutex_lock(&q->mutex);
+
+    head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+    if (head == q->read && timeout > 0) {
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        ts.tv_sec += timeout / 1000000;
+        ts.tv_nsec += (timeout % 1000000) * 1000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+
+        __atomic_store_n(&q->waiting, 1, __ATOMIC_SEQ_CST);
+        while (((head = __atomic_load_n(&q->head, __ATOMIC_SEQ_CST)) == q->read) && (rc == 0)) {
+            rc = pthread_cond_timedwait(&q->cond, &q->mutex, &ts);
+        }
+        __atomic_store_n(&q->waiting, 0, __ATOMIC_RELAXED);
+    }
+
+    while (q->read != head && count < max) {
+        slot = &q->slots[q->read & q->mask];
+        msgs[count].station = slot->station;
+        msgs[count].sender = slot->sender;
+        msgs[count].command = slot->command;
+        msgs[count].len = slot->len;
+        msgs[count].data = slot->data;
+        msgs[count].slot = q->read;
+        count++;
+        __atomic_store_n(&q->read, q->read + 1, __ATOMIC_RELAXED);
+    }
+
+    pthread_mutex_unlock(&q->mutex);
+    return count;
+}
+
+int icsc_recv(icsc_ptr icsc, icsc_message_t *msg, unsigned long timeout) {
+    return icsc_recv_many(icsc, msg, 1, timeout);
+}
+
+int icsc_release(icsc_ptr icsc, const icsc_message_t *msg) {
+    struct icsc_recv_queue *q;
+    uint32_t tail;
+
+    if (icsc == NULL || msg == NULL || icsc->recvQueue == NULL) {
+        return -1;
+    }
+
+    q = icsc->recvQueue;
+    pthread_mutex_lock(&q->mutex);
+
+    tail = q->tail;
+    if (msg->slot - tail >= q->read - tail || q->slots[msg->slot & q->mask].released) {
+        pthread_mutex_unlock(&q->mutex);
+        icsc_error("Frame is not held from this receive queue\n");
+        return -1;
+    }
+
+    q->slots[msg->slot & q->mask].released = 1;
+
+    // Slots are reused in order, so only the oldest ones can go back.
+    while (tail != q->read && q->slots[tail & q->mask].released) {
+        tail++;
+    }
+    __atomic_store_n(&q->tail, tail, __ATOMIC_RELEASE);
+
+    pthread_mutex_unlock(&q->mutex);
+    return 0;
+}
+
+void icsc_recv_free(icsc_ptr icsc) {
+    struct icsc_recv_queue *q = icsc->recvQueue;
+
+    if (q == NULL) {
+        return;
+    }
+
+    pthread_mutex_destroy(&q->mutex);
+    pthread_cond_destroy(&q->cond);
+    free(q->slots);
+    free(q);
+    icsc->recvQueue = NULL;
+}
@@ -0,0 +1,181 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "icsc.h"
+#include "icsc_private.h"
+#include "config.h"
+
+struct icsc_route {
+    icsc_ptr egress;
+    int inFlight;               // Frames being written to egress without the lock
+    icsc_route_stats_t stats;
+};
+
+int icsc_route_add(icsc_ptr icsc, uint8_t station, icsc_ptr egress) {
+    icsc_route_t *route;
+
+    if (icsc == NULL || egress == NULL) {
+        return -1;
+    }
+
+    if (egress == icsc) {
+        icsc_error("Cannot route station %d back out of the same endpoint\n", station);
+        return -1;
+    }
+
+    pthread_mutex_lock(&icsc->routeMutex);
+
+    if (icsc->routes == NULL) {
+        icsc->routes = (icsc_route_t **)calloc(256, sizeof(icsc_route_t *));
+        if (icsc->routes == NULL) {
+            pthread_mutex_unlock(&icsc->routeMutex);
+            icsc_error("Cannot allocate routing table: %s\n", strerror(errno));
+            return -1;
+        }
+    }
+
+    route = icsc->routes[station];
+    if (route == NULL) {
+        route = (icsc_route_t *)calloc(1, sizeof(icsc_route_t));
+        if (route == NULL) {
+            pthread_mutex_unlock(&icsc->routeMutex);
+            icsc_error("Cannot allocate route: %s\n", strerror(errno));
+            return -1;
+        }
+        icsc->routes[station] = route;
+    }
+    if (route->egress != egress) {
+        // The old egress may be closed as soon as we return.
+        while (route->inFlight > 0) {
+            pthread_cond_wait(&icsc->routeCond, &icsc->routeMutex);
+        }
+    }
+    route->egress = egress;
+
+    pthread_mutex_unlock(&icsc->routeMutex);
+
+    icsc_debug("Added route for station %d\n", station);
+    return 0;
+}
+
+int icsc_route_remove(icsc_ptr icsc, uint8_t station) {
+    icsc_route_t *route;
+
+    if (icsc == NULL) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&icsc->routeMutex);
+    if (icsc->routes == NULL || icsc->routes[station] == NULL) {
+        pthread_mutex_unlock(&icsc->routeMutex);
+        return -1;
+    }
+    route = icsc->routes[station];
+    icsc->routes[station] = NULL;
+    while (route->inFlight > 0) {
+        pthread_cond_wait(&icsc->routeCond, &icsc->routeMutex);
+    }
+    pthread_mutex_unlock(&icsc->routeMutex);
+
+    free(route);
+    icsc_debug("Removed route for station %d\n", station);
+    return 0;
+}
+
+int icsc_route_stats(icsc_ptr icsc, uint8_t station, icsc_route_stats_t *stats) {
+    int rc = -1;
+
+    if (icsc == NULL || stats == NULL) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&icsc->routeMutex);
+    if (icsc->routes != NULL && icsc->routes[station] != NULL) {
+        memcpy(stats, &icsc->routes[station]->stats, sizeof(icsc_route_stats_t));
+        rc = 0;
+    }
+    pthread_mutex_unlock(&icsc->routeMutex);
+    return rc;
+}
+
+int icsc_route_exists(icsc_ptr icsc, uint8_t station) {
+    int exists;
+
+    pthread_mutex_lock(&icsc->routeMutex);
+    exists = (icsc->routes != NULL) && (icsc->routes[station] != NULL);
+    pthread_mutex_unlock(&icsc->routeMutex);
+    return exists;
+}
+
+int icsc_relay_frame(icsc_ptr icsc, uint8_t station, uint8_t sender, uint8_t command, uint8_t len, const char *data) {
+    uint8_t frame[ICSC_MAX_FRAME];
+    icsc_route_t *route;
+    icsc_route_t *reverse;
+    icsc_ptr egress;
+    int flen;
+    int rc;
+
+    pthread_mutex_lock(&icsc->routeMutex);
+
+    if (icsc->routes == NULL || icsc->routes[station] == NULL) {
+        pthread_mutex_unlock(&icsc->routeMutex);
+        icsc_debug("No route to station %d\n", station);
+        return -1;
+    }
+
+    route = icsc->routes[station];
+
+    // The sender lives on the egress side, so this frame has already been
+    // there once. Sending it back would start it circulating.
+    reverse = icsc->routes[sender];
+    if ((route->egress == icsc) || (reverse != NULL && reverse->egress == route->egress)) {
+        route->stats.loops++;
+        pthread_mutex_unlock(&icsc->routeMutex);
+        icsc_debug("Dropping looped frame from %d to %d\n", sender, station);
+        return -1;
+    }
+
+    egress = route->egress;
+    route->inFlight++;
+    pthread_mutex_unlock(&icsc->routeMutex);
+
+    // Sending can wait for a whole frame on the egress link, so do it
+    // without holding up other relays. The in-flight count keeps the
+    // route, and so egress, from going away until we are done.
+    flen = icsc_build_frame(frame, sender, station, command, len, data);
+    rc = icsc_write_frame(egress, frame, flen);
+
+    pthread_mutex_lock(&icsc->routeMutex);
+    if (rc == 0) {
+        route->stats.frames++;
+        route->stats.bytes += len;
+    } else {
+        route->stats.errors++;
+    }
+    if (--route->inFlight == 0) {
+        pthread_cond_broadcast(&icsc->routeCond);
+    }
+    pthread_mutex_unlock(&icsc->routeMutex);
+
+    icsc_debug("Forwarded frame from %d to %d\n", sender, station);
+    return rc;
+}
+
+void icsc_route_free(icsc_ptr icsc) {
+    int i;
+
+    if (icsc->routes == NULL) {
+        return;
+    }
+
+    for (i = 0; i < 256; i++) {
+        if (icsc->routes[i] != NULL) {
+            free(icsc->routes[i]);
+        }
+    }
+    free(icsc->routes);
+    icsc->routes = NULL;
+}
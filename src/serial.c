@@ -8,8 +8,10 @@
 #include <termios.h>
 #include <unistd.h>
 #include <errno.h>
+#include <poll.h>
 
 #include "icsc.h"
+#include "icsc_private.h"
 
 #include "config.h"
 
@@ -20,6 +22,126 @@
             options.c_cflag |= B;   \
             break;
 
+#define BAUD_ENTRY(R) { B##R, R },
+
+static const struct {
+    unsigned long symbol;
+    unsigned long rate;
+} baudTable[] = {
+#ifdef B50
+    BAUD_ENTRY(50)
+#endif
+#ifdef B75
+    BAUD_ENTRY(75)
+#endif
+#ifdef B110
+    BAUD_ENTRY(110)
+#endif
+#ifdef B134
+    BAUD_ENTRY(134)
+#endif
+#ifdef B150
+    BAUD_ENTRY(150)
+#endif
+#ifdef B200
+    BAUD_ENTRY(200)
+#endif
+#ifdef B300
+    BAUD_ENTRY(300)
+#endif
+#ifdef B600
+    BAUD_ENTRY(600)
+#endif
+#ifdef B1200
+    BAUD_ENTRY(1200)
+#endif
+#ifdef B1800
+    BAUD_ENTRY(1800)
+#endif
+#ifdef B2400
+    BAUD_ENTRY(2400)
+#endif
+#ifdef B4800
+    BAUD_ENTRY(4800)
+#endif
+#ifdef B9600
+    BAUD_ENTRY(9600)
+#endif
+#ifdef B19200
+    BAUD_ENTRY(19200)
+#endif
+#ifdef B38400
+    BAUD_ENTRY(38400)
+#endif
+#ifdef B57600
+    BAUD_ENTRY(57600)
+#endif
+#ifdef B115200
+    BAUD_ENTRY(115200)
+#endif
+#ifdef B230400
+    BAUD_ENTRY(230400)
+#endif
+#ifdef B460800
+    BAUD_ENTRY(460800)
+#endif
+#ifdef B500000
+    BAUD_ENTRY(500000)
+#endif
+#ifdef B576000
+    BAUD_ENTRY(576000)
+#endif
+#ifdef B921600
+    BAUD_ENTRY(921600)
+#endif
+#ifdef B1000000
+    BAUD_ENTRY(1000000)
+#endif
+#ifdef B1152000
+    BAUD_ENTRY(1152000)
+#endif
+#ifdef B1500000
+    BAUD_ENTRY(1500000)
+#endif
+#ifdef B2000000
+    BAUD_ENTRY(2000000)
+#endif
+#ifdef B2500000
+    BAUD_ENTRY(2500000)
+#endif
+#ifdef B3000000
+    BAUD_ENTRY(3000000)
+#endif
+#ifdef B3500000
+    BAUD_ENTRY(3500000)
+#endif
+#ifdef B4000000
+    BAUD_ENTRY(4000000)
+#endif
+};
+
+#define BAUD_TABLE_SIZE (sizeof(baudTable) / sizeof(baudTable[0]))
+
+unsigned long icsc_serial_baud_rate(unsigned long baud) {
+    size_t i;
+    for (i = 0; i < BAUD_TABLE_SIZE; i++) {
+        if (baudTable[i].symbol == baud) {
+            return baudTable[i].rate;
+        }
+    }
+    return 0;
+}
+
+unsigned long icsc_serial_baud_symbol(unsigned long rate) {
+    size_t i;
+    for (i = 0; i < BAUD_TABLE_SIZE; i++) {
+        if (baudTable[i].rate == rate) {
+            return baudTable[i].symbol;
+        }
+    }
+    return 0;
+}
+
 struct termios _savedOptions;
 int icsc_serial_open(const char *path, unsigned long baud) {
     int fd;
@@ -151,7 +273,7 @@ int icsc_serial_wait_available(int fd, unsigned long timeout) {
     FD_ZERO(&rfds);
     FD_SET(fd, &rfds);
     tv.tv_sec = timeout / 1000000;
-    tv.tv_usec = timeout & 1000000;
+    tv.tv_usec = timeout % 1000000;
     int retval = select(fd+1, &rfds, NULL, NULL, &tv);
     if (retval) {
         return 1; 
@@ -177,7 +299,7 @@ void icsc_serial_flush(int fd) {
     if (fd < 0) {
         return;
     }
-    fsync(fd);
+    tcdrain(fd);
 }   
 
 int icsc_serial_write(int fd, uint8_t c) {
@@ -185,7 +307,55 @@ int icsc_serial_write(int fd, uint8_t c) {
         return -1;
     }
     icsc_debug("Writing 0x%02x to fd %d\n", c, fd);
-    write(fd, &c, 1);
+    return icsc_serial_write_array(fd, &c, 1);
+}
+
+int icsc_serial_write_array(int fd, const uint8_t *data, size_t len) {
+    struct pollfd pfd;
+    ssize_t rc;
+    if (fd < 0) {
+        return -1;
+    }
+    while (len > 0) {
+        rc = write(fd, data, len);
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+                pfd.fd = fd;
+                pfd.events = POLLOUT;
+                poll(&pfd, 1, -1);
+                continue;
+            }
+            icsc_error("Unable to write to fd %d: %s\n", fd, strerror(errno));
+            return -1;
+        }
+        data += rc;
+        len -= rc;
+    }
+    return 0;
+}
+
+int icsc_serial_set_baud(int fd, unsigned long baud) {
+    struct termios options;
+
+    if (fd < 0 || icsc_serial_baud_rate(baud) == 0) {
+        return -1;
+    }
+
+    if (tcgetattr(fd, &options) != 0) {
+        icsc_error("Can't read serial settings: %s\n", strerror(errno));
+        return -1;
+    }
+
+    cfsetispeed(&options, baud);
+    cfsetospeed(&options, baud);
+
+    if (tcsetattr(fd, TCSADRAIN, &options) != 0) {
+        icsc_error("Can't change baud rate: %s\n", strerror(errno));
+        return -1;
+    }
     return 0;
 }
 
@@ -195,3 +365,28 @@ void icsc_serial_close(int fd) {
     }
     close(fd);
 }
+
+static void *icsc_serial_transport_open(const char *path, unsigned long baud) {
+    return icsc_fd_wrap(icsc_serial_open(path, baud));
+}
+
+static int icsc_serial_transport_drain(void *data) {
+    return tcdrain(*(int *)data);
+}
+
+static int icsc_serial_transport_set_baud(void *data, unsigned long baud) {
+    return icsc_serial_set_baud(*(int *)data, baud);
+}
+
+const icsc_transport_t icsc_transport_serial = {
+    .name = "serial",
+    .open = icsc_serial_transport_open,
+    .read = icsc_fd_read,
+    .write = icsc_fd_write,
+    .drain = icsc_serial_transport_drain,
+    .wait = icsc_fd_wait,
+    .close = icsc_fd_close,
+    .set_baud = icsc_serial_transport_set_baud,
+    .outq = icsc_fd_outq,
+    .fd = icsc_fd_get,
+};
@@ -0,0 +1,173 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <endian.h>
+
+#include "icsc.h"
+#include "icsc_private.h"
+#include "config.h"
+
+// Layout of the status block carried by ICSC_SYS_RSTAT. All values are
+// little-endian.
+#define STATUS_VERSION   0
+#define STATUS_EXTLEN    1
+#define STATUS_UPTIME    2
+#define STATUS_RXFRAMES  6
+#define STATUS_TXFRAMES  10
+#define STATUS_CSERRORS  14
+#define STATUS_FRERRORS  18
+#define STATUS_RXQUEUE   22
+#define STATUS_TXQUEUE   24
+#define STATUS_EXT       26
+
+// The application extension is published through a sequence lock. The
+// writer makes the sequence odd while it is copying, so the read thread
+// retries if the sequence was odd or changed while it copied.
+struct icsc_status_ext {
+    uint32_t sequence;
+    uint8_t len;
+    uint8_t data[ICSC_STATUS_EXT_MAX];
+};
+
+static void put16(char *p, uint16_t v) {
+    v = htole16(v);
+    memcpy(p, &v, 2);
+}
+
+static void put32(char *p, uint32_t v) {
+    v = htole32(v);
+    memcpy(p, &v, 4);
+}
+
+static uint16_t get16(const char *p) {
+    uint16_t v;
+    memcpy(&v, p, 2);
+    return le16toh(v);
+}
+
+static uint32_t get32(const char *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return le32toh(v);
+}
+
+int icsc_get_stats(icsc_ptr icsc, icsc_stats_t *stats) {
+    if (icsc == NULL || stats == NULL) {
+        return -1;
+    }
+    memcpy(stats, &icsc->stats, sizeof(icsc_stats_t));
+    return 0;
+}
+
+int icsc_set_status_ext(icsc_ptr icsc, const void *data, uint8_t len) {
+    struct icsc_status_ext *ext;
+
+    if (icsc == NULL || len > ICSC_STATUS_EXT_MAX) {
+        return -1;
+    }
+
+    ext = __atomic_load_n(&icsc->statusExt, __ATOMIC_ACQUIRE);
+    if (ext == NULL) {
+        ext = (struct icsc_status_ext *)calloc(1, sizeof(struct icsc_status_ext));
+        if (ext == NULL) {
+            icsc_error("Cannot allocate status extension: %s\n", strerror(errno));
+            return -1;
+        }
+    }
+
+    __atomic_add_fetch(&ext->sequence, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    ext->len = len;
+    memcpy(ext->data, data, len);
+    __atomic_add_fetch(&ext->sequence, 1, __ATOMIC_RELEASE);
+
+    __atomic_store_n(&icsc->statusExt, ext, __ATOMIC_RELEASE);
+    return 0;
+}
+
+int icsc_respond_to_status(icsc_ptr icsc, uint8_t origin, uint8_t station) {
+    struct icsc_status_ext *ext;
+    char block[STATUS_EXT + ICSC_STATUS_EXT_MAX];
+    uint32_t sequence;
+    uint8_t extLen = 0;
+
+    block[STATUS_VERSION] = ICSC_STATUS_VERSION;
+    put32(&block[STATUS_UPTIME], (icsc_micros() - icsc->started) / 1000000);
+    put32(&block[STATUS_RXFRAMES], icsc->stats.rxFrames);
+    put32(&block[STATUS_TXFRAMES], icsc->stats.txFrames);
+    put32(&block[STATUS_CSERRORS], icsc->stats.checksumErrors);
+    put32(&block[STATUS_FRERRORS], icsc->stats.framingErrors);
+    put16(&block[STATUS_RXQUEUE], icsc_recv_depth(icsc));
+    put16(&block[STATUS_TXQUEUE], __atomic_load_n(&icsc->txWaiting, __ATOMIC_RELAXED));
+
+    ext = __atomic_load_n(&icsc->statusExt, __ATOMIC_ACQUIRE);
+    if (ext != NULL) {
+        do {
+            sequence = __atomic_load_n(&ext->sequence, __ATOMIC_ACQUIRE);
+            if (sequence & 1) {
+                continue;
+            }
+            extLen = ext->len;
+            memcpy(&block[STATUS_EXT], ext->data, extLen);
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        } while ((sequence & 1) || (sequence != __atomic_load_n(&ext->sequence, __ATOMIC_RELAXED)));
+    }
+
+    block[STATUS_EXTLEN] = extLen;
+
+    return icsc_send_raw(icsc, origin, station, ICSC_SYS_RSTAT, STATUS_EXT + extLen, block);
+}
+
+static int icsc_decode_status(icsc_status_t *status, const char *block, uint8_t len) {
+    if (len < STATUS_EXT || block[STATUS_VERSION] == 0) {
+        return -1;
+    }
+
+    status->version = block[STATUS_VERSION];
+    status->uptime = get32(&block[STATUS_UPTIME]);
+    status->rxFrames = get32(&block[STATUS_RXFRAMES]);
+    status->txFrames = get32(&block[STATUS_TXFRAMES]);
+    status->checksumErrors = get32(&block[STATUS_CSERRORS]);
+    status->framingErrors = get32(&block[STATUS_FRERRORS]);
+    status->rxQueue = get16(&block[STATUS_RXQUEUE]);
+    status->txQueue = get16(&block[STATUS_TXQUEUE]);
+
+    // Newer versions may add fields in front of the extension, which
+    // always fills the end of the block.
+    status->extLen = block[STATUS_EXTLEN];
+    if (status->extLen > len - STATUS_EXT || status->extLen > ICSC_STATUS_EXT_MAX) {
+        status->extLen = 0;
+    }
+    memcpy(status->ext, block + len - status->extLen, status->extLen);
+    return 0;
+}
+
+int icsc_query_status(icsc_ptr icsc, const uint8_t *stations, int count, icsc_status_t *results, unsigned long timeout) {
+    icsc_waiter_t waiter;
+    int answered = 0;
+    int i;
+
+    if (icsc == NULL || stations == NULL || results == NULL) {
+        return -1;
+    }
+
+    for (i = 0; i < count; i++) {
+        memset(&results[i], 0, sizeof(icsc_status_t));
+        results[i].station = stations[i];
+
+        icsc_waiter_add(icsc, &waiter, stations[i], ICSC_SYS_RSTAT);
+        if (icsc_send_raw(icsc, icsc->station, stations[i], ICSC_SYS_QSTAT, 0, NULL) < 0) {
+            icsc_waiter_wait(icsc, &waiter, 0);
+            continue;
+        }
+
+        if (icsc_waiter_wait(icsc, &waiter, timeout) && (icsc_decode_status(&results[i], waiter.data, waiter.len) == 0)) {
+            answered++;
+        } else {
+            icsc_debug("No status from station %d\n", stations[i]);
+        }
+    }
+
+    return answered;
+}
@@ -0,0 +1,339 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <endian.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "icsc.h"
+#include "icsc_private.h"
+#include "config.h"
+
+// Layout of the ICSC_SYS_SYNC payload. All values are little-endian.
+#define SYNC_CYCLE      0
+#define SYNC_TIMESTAMP  4
+#define SYNC_SLOTS      12
+#define SYNC_SLOTTIME   13
+#define SYNC_LEN        17
+
+// Stations stop sending once this many syncs in a row have been missed.
+#define TDMA_MAX_MISSED 2
+
+// How long a frame waits for the first sync, in microseconds.
+#define TDMA_SYNC_WAIT 1000000
+
+// A cycle is the sync frame followed by one slot for each station:
+//
+//     | sync | slot 0 | slot 1 | ... | slot n-1 | sync | ...
+//
+// Every window includes the turnaround time, so a frame that fits in its
+// slot has finished before the next station starts. Cycle starts are in
+// our own clock; a station takes the start as the time the sync arrived
+// less the time it took to send. sentCycle and sentStart are the cycle and
+// the slot start of the last frame sent.
+struct icsc_tdma {
+    pthread_t thread;
+    int master;
+    int running;
+    int slot;
+    uint8_t slots;
+    uint32_t slotTime;
+    uint32_t syncTime;
+    uint32_t cycle;
+    uint64_t cycleStart;
+    uint64_t masterTime;
+    uint32_t sentCycle;
+    uint64_t sentStart;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+};
+
+static struct icsc_tdma *icsc_tdma_get(icsc_ptr icsc) {
+    struct icsc_tdma *t;
+    pthread_condattr_t attr;
+
+    if (icsc->tdma != NULL) {
+        return icsc->tdma;
+    }
+
+    t = (struct icsc_tdma *)calloc(1, sizeof(struct icsc_tdma));
+    if (t == NULL) {
+        icsc_error("Cannot allocate TDMA state: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    t->slot = -1;
+    t->syncTime = icsc_frame_time(icsc, SYNC_LEN) + ICSC_TURNAROUND_TIME;
+    pthread_mutex_init(&t->mutex, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&t->cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    __atomic_store_n(&icsc->tdma, t, __ATOMIC_RELEASE);
+    return t;
+}
+
+static uint64_t icsc_tdma_cycle_time(struct icsc_tdma *t) {
+    return t->syncTime + (uint64_t)t->slots * t->slotTime;
+}
+
+static int icsc_tdma_synced(struct icsc_tdma *t) {
+    return (t->slots != 0) && (icsc_micros() - t->cycleStart <= TDMA_MAX_MISSED * icsc_tdma_cycle_time(t));
+}
+
+static void icsc_sleep_until(uint64_t when) {
+    struct timespec ts;
+
+    ts.tv_sec = when / 1000000;
+    ts.tv_nsec = (when % 1000000) * 1000;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+static void *icsc_tdma_thread(void *arg) {
+    icsc_ptr icsc = (icsc_ptr)arg;
+    struct icsc_tdma *t = icsc->tdma;
+    uint8_t frame[ICSC_MAX_FRAME];
+    char sync[SYNC_LEN];
+    uint64_t start;
+    uint64_t v64;
+    uint32_t v32;
+    struct timespec ts;
+    int flen;
+
+    icsc_debug("TDMA master thread executing\n");
+
+    pthread_mutex_lock(&t->mutex);
+    while (t->running) {
+        start = icsc_micros();
+        t->cycle++;
+
+        v32 = htole32(t->cycle);
+        memcpy(&sync[SYNC_CYCLE], &v32, 4);
+        v64 = htole64(start);
+        memcpy(&sync[SYNC_TIMESTAMP], &v64, 8);
+        sync[SYNC_SLOTS] = t->slots;
+        v32 = htole32(t->slotTime);
+        memcpy(&sync[SYNC_SLOTTIME], &v32, 4);
+
+        t->cycleStart = start;
+        t->masterTime = start;
+        pthread_cond_broadcast(&t->cond);
+        pthread_mutex_unlock(&t->mutex);
+
+        // The sync owns the start of the cycle, so it does not queue behind
+        // frames waiting for their slots.
+        flen = icsc_build_frame(frame, icsc->station, ICSC_BROADCAST, ICSC_SYS_SYNC, SYNC_LEN, sync);
+        icsc_write_link(icsc, frame, flen);
+
+        pthread_mutex_lock(&t->mutex);
+        start += icsc_tdma_cycle_time(t);
+        ts.tv_sec = start / 1000000;
+        ts.tv_nsec = (start % 1000000) * 1000;
+        while (t->running && pthread_cond_timedwait(&t->cond, &t->mutex, &ts) == 0);
+    }
+    pthread_mutex_unlock(&t->mutex);
+
+    icsc_debug("TDMA master thread finishing\n");
+    return NULL;
+}
+
+int icsc_tdma_master(icsc_ptr icsc, uint8_t slots, uint8_t maxLen) {
+    struct icsc_tdma *t;
+
+    if (icsc == NULL || slots == 0) {
+        return -1;
+    }
+
+    if (icsc_frame_time(icsc, 0) == 0) {
+        icsc_error("TDMA needs a link with a baud rate\n");
+        return -1;
+    }
+
+    t = icsc_tdma_get(icsc);
+    if (t == NULL) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&t->mutex);
+    if (t->running) {
+        pthread_mutex_unlock(&t->mutex);
+        return -1;
+    }
+    t->master = 1;
+    t->slots = slots;
+    t->slotTime = icsc_frame_time(icsc, maxLen) + ICSC_TURNAROUND_TIME;
+    t->running = 1;
+    pthread_mutex_unlock(&t->mutex);
+
+    if (pthread_create(&t->thread, NULL, icsc_tdma_thread, icsc) != 0) {
+        icsc_error("Cannot start TDMA thread: %s\n", strerror(errno));
+        t->running = 0;
+        return -1;
+    }
+
+    return 0;
+}
+
+int icsc_tdma_slot(icsc_ptr icsc, int slot) {
+    struct icsc_tdma *t;
+
+    if (icsc == NULL || slot > 255) {
+        return -1;
+    }
+
+    t = icsc_tdma_get(icsc);
+    if (t == NULL) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&t->mutex);
+    t->slot = slot < 0 ? -1 : slot;
+    pthread_mutex_unlock(&t->mutex);
+    return 0;
+}
+
+int icsc_tdma_stop(icsc_ptr icsc) {
+    struct icsc_tdma *t;
+    int master;
+
+    if (icsc == NULL || icsc->tdma == NULL) {
+        return -1;
+    }
+
+    t = icsc->tdma;
+    pthread_mutex_lock(&t->mutex);
+    master = t->master && t->running;
+    t->running = 0;
+    t->master = 0;
+    t->slot = -1;
+    t->slots = 0;
+    pthread_cond_broadcast(&t->cond);
+    pthread_mutex_unlock(&t->mutex);
+
+    if (master) {
+        pthread_join(t->thread, NULL);
+    }
+    return 0;
+}
+
+int icsc_tdma_time(icsc_ptr icsc, uint32_t *cycle, uint64_t *masterTime) {
+    struct icsc_tdma *t;
+    uint64_t now = icsc_micros();
+
+    if (icsc == NULL || icsc->tdma == NULL) {
+        return -1;
+    }
+
+    t = icsc->tdma;
+    pthread_mutex_lock(&t->mutex);
+    if (!icsc_tdma_synced(t)) {
+        pthread_mutex_unlock(&t->mutex);
+        return -1;
+    }
+    if (cycle != NULL) {
+        *cycle = t->cycle;
+    }
+    if (masterTime != NULL) {
+        *masterTime = t->masterTime + (now - t->cycleStart);
+    }
+    pthread_mutex_unlock(&t->mutex);
+    return 0;
+}
+
+void icsc_tdma_sync(icsc_ptr icsc, uint8_t len, const char *data) {
+    struct icsc_tdma *t = icsc->tdma;
+    uint64_t now = icsc_micros();
+    uint64_t v64;
+    uint32_t v32;
+
+    if (len < SYNC_LEN) {
+        return;
+    }
+
+    pthread_mutex_lock(&t->mutex);
+    if (t->master) {
+        pthread_mutex_unlock(&t->mutex);
+        return;
+    }
+    memcpy(&v32, &data[SYNC_CYCLE], 4);
+    t->cycle = le32toh(v32);
+    memcpy(&v64, &data[SYNC_TIMESTAMP], 8);
+    t->masterTime = le64toh(v64);
+    t->slots = data[SYNC_SLOTS];
+    memcpy(&v32, &data[SYNC_SLOTTIME], 4);
+    t->slotTime = le32toh(v32);
+    t->cycleStart = now - icsc_frame_time(icsc, len);
+    pthread_cond_broadcast(&t->cond);
+    pthread_mutex_unlock(&t->mutex);
+}
+
+int icsc_tdma_wait(icsc_ptr icsc, uint8_t len) {
+    struct icsc_tdma *t = icsc->tdma;
+    unsigned long need = icsc_frame_time(icsc, len);
+    uint64_t cycleTime;
+    uint64_t start;
+    uint64_t now;
+    uint64_t n;
+    uint32_t cycle;
+    struct timespec ts;
+
+    pthread_mutex_lock(&t->mutex);
+
+    if (t->slot < 0) {
+        pthread_mutex_unlock(&t->mutex);
+        return 0;
+    }
+
+    // Wait for the first sync.
+    if (!icsc_tdma_synced(t)) {
+        now = icsc_micros() + TDMA_SYNC_WAIT;
+        ts.tv_sec = now / 1000000;
+        ts.tv_nsec = (now % 1000000) * 1000;
+        while (t->slot >= 0 && !icsc_tdma_synced(t)) {
+            if (pthread_cond_timedwait(&t->cond, &t->mutex, &ts) != 0) {
+                break;
+            }
+        }
+        if (t->slot < 0 || !icsc_tdma_synced(t)) {
+            pthread_mutex_unlock(&t->mutex);
+            icsc_error("No TDMA sync heard; frame not sent\n");
+            return -1;
+        }
+    }
+
+    if (t->slot >= t->slots || need + ICSC_TURNAROUND_TIME > t->slotTime) {
+        pthread_mutex_unlock(&t->mutex);
+        icsc_error("Frame does not fit in TDMA slot %d\n", t->slot);
+        return -1;
+    }
+
+    // Project forward from the last sync to the first slot the frame still
+    // fits in, so a missed sync does not cost a cycle.
+    cycleTime = icsc_tdma_cycle_time(t);
+    now = icsc_micros();
+    n = (now - t->cycleStart) / cycleTime;
+    start = t->cycleStart + n * cycleTime + t->syncTime + (uint64_t)t->slot * t->slotTime;
+    cycle = t->cycle + n;
+
+    // A sync that was read a little later than the one before moves our
+    // idea of the slot, but not the slot itself. Frames that follow one
+    // already sent in this cycle must fit in the slot as it was placed.
+    if (cycle == t->sentCycle && t->sentStart < start) {
+        start = t->sentStart;
+    }
+    if (now + need + ICSC_TURNAROUND_TIME > start + t->slotTime) {
+        start = t->cycleStart + (n + 1) * cycleTime + t->syncTime + (uint64_t)t->slot * t->slotTime;
+        cycle++;
+    }
+    t->sentCycle = cycle;
+    t->sentStart = start;
+
+    pthread_mutex_unlock(&t->mutex);
+
+    if (start > now) {
+        icsc_sleep_until(start);
+    }
+    return 0;
+}
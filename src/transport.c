@@ -0,0 +1,366 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "icsc.h"
+#include "icsc_private.h"
+#include "config.h"
+
+/* Operations shared by every transport built on a file descriptor */
+
+void *icsc_fd_wrap(int fd) {
+    int *data;
+
+    if (fd < 0) {
+        return NULL;
+    }
+
+    // Reads must never block the parser, and writes cope with EAGAIN.
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    data = (int *)malloc(sizeof(int));
+    if (data == NULL) {
+        icsc_error("Cannot allocate transport: %s\n", strerror(errno));
+        close(fd);
+        return NULL;
+    }
+    *data = fd;
+    return data;
+}
+
+ssize_t icsc_fd_read(void *data, uint8_t *buf, size_t len) {
+    ssize_t rc;
+
+    rc = read(*(int *)data, buf, len);
+    if (rc < 0) {
+        if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) {
+            return 0;
+        }
+        return -1;
+    }
+    if (rc == 0 && len > 0) {
+        // The other end has gone: icscd exited or the port hung up.
+        return -1;
+    }
+    return rc;
+}
+
+ssize_t icsc_fd_write(void *data, const uint8_t *buf, size_t len) {
+    if (icsc_serial_write_array(*(int *)data, buf, len) < 0) {
+        return -1;
+    }
+    return len;
+}
+
+int icsc_fd_wait(void *data, unsigned long timeout) {
+    struct pollfd pfd;
+    int rc;
+
+    pfd.fd = *(int *)data;
+    pfd.events = POLLIN;
+    rc = poll(&pfd, 1, (timeout + 999) / 1000);
+    if (rc < 0) {
+        return (errno == EINTR) ? 0 : -1;
+    }
+    if (pfd.revents & POLLIN) {
+        return 1;
+    }
+    // A hang-up with nothing left to read stays readable for ever.
+    return (pfd.revents & (POLLHUP | POLLERR | POLLNVAL)) ? -1 : 0;
+}
+
+int icsc_fd_outq(void *data) {
+    int queued;
+
+    if (ioctl(*(int *)data, TIOCOUTQ, &queued) < 0) {
+        return -1;
+    }
+    return queued;
+}
+
+int icsc_fd_get(void *data) {
+    return *(int *)data;
+}
+
+void icsc_fd_close(void *data) {
+    close(*(int *)data);
+    free(data);
+}
+
+/* Unix domain socket */
+
+static void *icsc_socket_open(const char *path, unsigned long baud) {
+    struct sockaddr_un addr;
+    int fd;
+
+    (void)baud;
+
+    if (path == NULL) {
+        icsc_error("No socket path given\n");
+        return NULL;
+    }
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        icsc_error("Socket path %s is too long\n", path);
+        return NULL;
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        icsc_error("Unable to create socket: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        icsc_error("Unable to connect to %s: %s\n", path, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    return icsc_fd_wrap(fd);
+}
+
+static int icsc_socket_drain(void *data) {
+    (void)data;
+    return 0;
+}
+
+const icsc_transport_t icsc_transport_socket = {
+    .name = "socket",
+    .open = icsc_socket_open,
+    .read = icsc_fd_read,
+    .write = icsc_fd_write,
+    .drain = icsc_socket_drain,
+    .wait = icsc_fd_wait,
+    .close = icsc_fd_close,
+    .outq = icsc_fd_outq,
+    .fd = icsc_fd_get,
+};
+
+/* In-process memory bus */
+
+#define MEMORY_RING_SIZE 65536
+
+struct memory_bus;
+
+typedef struct memory_node {
+    struct memory_bus *bus;
+    struct memory_node *next;
+    uint8_t ring[MEMORY_RING_SIZE];
+    size_t head;
+    size_t tail;
+    int waiting;
+    int woken;
+    pthread_cond_t cond;
+} memory_node_t;
+
+typedef struct memory_bus {
+    char *name;
+    memory_node_t *nodes;
+    pthread_mutex_t mutex;
+    struct memory_bus *next;
+} memory_bus_t;
+
+static memory_bus_t *memoryBuses = NULL;
+static pthread_mutex_t memoryBusesMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void *icsc_memory_open(const char *path, unsigned long baud) {
+    memory_bus_t *bus;
+    memory_node_t *node;
+    pthread_condattr_t attr;
+
+    (void)baud;
+
+    if (path == NULL) {
+        icsc_error("No memory bus name given\n");
+        return NULL;
+    }
+
+    node = (memory_node_t *)calloc(1, sizeof(memory_node_t));
+    if (node == NULL) {
+        icsc_error("Cannot allocate memory transport: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&node->cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    pthread_mutex_lock(&memoryBusesMutex);
+
+    for (bus = memoryBuses; bus; bus = bus->next) {
+        if (strcmp(bus->name, path) == 0) {
+            break;
+        }
+    }
+
+    if (bus == NULL) {
+        bus = (memory_bus_t *)calloc(1, sizeof(memory_bus_t));
+        if (bus == NULL || (bus->name = strdup(path)) == NULL) {
+            pthread_mutex_unlock(&memoryBusesMutex);
+            icsc_error("Cannot allocate memory bus: %s\n", strerror(errno));
+            free(bus);
+            free(node);
+            return NULL;
+        }
+        pthread_mutex_init(&bus->mutex, NULL);
+        bus->next = memoryBuses;
+        memoryBuses = bus;
+    }
+
+    pthread_mutex_lock(&bus->mutex);
+    node->bus = bus;
+    node->next = bus->nodes;
+    bus->nodes = node;
+    pthread_mutex_unlock(&bus->mutex);
+
+    pthread_mutex_unlock(&memoryBusesMutex);
+
+    return node;
+}
+
+static ssize_t icsc_memory_read(void *data, uint8_t *buf, size_t len) {
+    memory_node_t *node = (memory_node_t *)data;
+    size_t count = 0;
+
+    pthread_mutex_lock(&node->bus->mutex);
+    while ((count < len) && (node->tail != node->head)) {
+        buf[count++] = node->ring[node->tail];
+        node->tail = (node->tail + 1) % MEMORY_RING_SIZE;
+    }
+    pthread_mutex_unlock(&node->bus->mutex);
+
+    return count;
+}
+
+// Like a real line, bytes that arrive while a receiver's buffer is full are lost.
+static ssize_t icsc_memory_write(void *data, const uint8_t *buf, size_t len) {
+    memory_node_t *node = (memory_node_t *)data;
+    memory_node_t *scan;
+    size_t next;
+    size_t i;
+
+    pthread_mutex_lock(&node->bus->mutex);
+    for (scan = node->bus->nodes; scan; scan = scan->next) {
+        if (scan == node) {
+            continue;
+        }
+        for (i = 0; i < len; i++) {
+            next = (scan->head + 1) % MEMORY_RING_SIZE;
+            if (next == scan->tail) {
+                break;
+            }
+            scan->ring[scan->head] = buf[i];
+            scan->head = next;
+        }
+        if (scan->waiting) {
+            pthread_cond_signal(&scan->cond);
+        }
+    }
+    pthread_mutex_unlock(&node->bus->mutex);
+
+    return len;
+}
+
+static int icsc_memory_drain(void *data) {
+    (void)data;
+    return 0;
+}
+
+static int icsc_memory_wait(void *data, unsigned long timeout) {
+    memory_node_t *node = (memory_node_t *)data;
+    struct timespec ts;
+    int rc = 0;
+
+    pthread_mutex_lock(&node->bus->mutex);
+
+    if (node->tail == node->head) {
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        ts.tv_sec += timeout / 1000000;
+        ts.tv_nsec += (timeout % 1000000) * 1000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+
+        node->waiting = 1;
+        while ((node->tail == node->head) && (rc == 0) && !node->woken) {
+            rc = pthread_cond_timedwait(&node->cond, &node->bus->mutex, &ts);
+        }
+        node->waiting = 0;
+    }
+    node->woken = 0;
+
+    rc = (node->tail != node->head) ? 1 : 0;
+    pthread_mutex_unlock(&node->bus->mutex);
+    return rc;
+}
+
+static void icsc_memory_wake(void *data) {
+    memory_node_t *node = (memory_node_t *)data;
+
+    pthread_mutex_lock(&node->bus->mutex);
+    node->woken = 1;
+    pthread_cond_signal(&node->cond);
+    pthread_mutex_unlock(&node->bus->mutex);
+}
+
+static void icsc_memory_close(void *data) {
+    memory_node_t *node = (memory_node_t *)data;
+    memory_bus_t *bus = node->bus;
+    memory_node_t **scan;
+    memory_bus_t **bscan;
+
+    pthread_mutex_lock(&memoryBusesMutex);
+
+    pthread_mutex_lock(&bus->mutex);
+    for (scan = &bus->nodes; *scan; scan = &(*scan)->next) {
+        if (*scan == node) {
+            *scan = node->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&bus->mutex);
+
+    if (bus->nodes == NULL) {
+        for (bscan = &memoryBuses; *bscan; bscan = &(*bscan)->next) {
+            if (*bscan == bus) {
+                *bscan = bus->next;
+                break;
+            }
+        }
+        pthread_mutex_destroy(&bus->mutex);
+        free(bus->name);
+        free(bus);
+    }
+
+    pthread_mutex_unlock(&memoryBusesMutex);
+
+    pthread_cond_destroy(&node->cond);
+    free(node);
+}
+
+const icsc_transport_t icsc_transport_memory = {
+    .name = "memory",
+    .open = icsc_memory_open,
+    .read = icsc_memory_read,
+    .write = icsc_memory_write,
+    .drain = icsc_memory_drain,
+    .wait = icsc_memory_wait,
+    .close = icsc_memory_close,
+    .wake = icsc_memory_wake,
+};
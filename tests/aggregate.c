@@ -0,0 +1,83 @@
+/*
+ * Queue a mix of small and oversized messages for one station and check
+ * that they are packed together and still arrive in the order queued.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "icsc.h"
+#include "icsc_private.h"
+#include "config.h"
+#include "check.h"
+
+#define MESSAGES 300
+
+static volatile int received = 0;
+static volatile int outOfOrder = 0;
+static volatile int corrupt = 0;
+
+static void on_frame(icsc_ptr icsc, unsigned char sender, char command, unsigned char len, char *data) {
+    int seq;
+    int i;
+
+    (void)icsc; (void)sender;
+    seq = ((uint8_t)data[0] << 8) | (uint8_t)data[1];
+    if (seq != received) {
+        outOfOrder++;
+    }
+    if (len != (command == 'L' ? 200 : 4)) {
+        corrupt++;
+    }
+    for (i = 2; i < len; i++) {
+        if ((uint8_t)data[i] != (uint8_t)(seq + i)) {
+            corrupt++;
+            break;
+        }
+    }
+    received++;
+}
+
+int main() {
+    icsc_ptr a = icsc_init_transport(&icsc_transport_memory, "aggregate", B115200, 4, -1);
+    icsc_ptr b = icsc_init_transport(&icsc_transport_memory, "aggregate", B115200, 5, -1);
+    char data[200];
+    int seq;
+    int len;
+    int i;
+
+    CHECK(a != NULL && b != NULL);
+    icsc_register_command(b, 'S', on_frame);
+    icsc_register_command(b, 'L', on_frame);
+
+    CHECK(icsc_queue_array(a, 5, 'S', 4, "data") == -1);
+    CHECK(icsc_aggregate(a, 1000, 64) == 0);
+    CHECK(icsc_queue_array(a, 5, ICSC_SYS_PING, 0, NULL) == -1);
+
+    // Every tenth message is too big to be packed and goes on its own,
+    // while the aggregation thread flushes the small ones around it.
+    for (seq = 0; seq < MESSAGES; seq++) {
+        len = (seq % 10 == 9) ? 200 : 4;
+        data[0] = seq >> 8;
+        data[1] = seq;
+        for (i = 2; i < len; i++) {
+            data[i] = seq + i;
+        }
+        CHECK(icsc_queue_array(a, 5, len == 200 ? 'L' : 'S', len, data) == 0);
+        if (seq % 3 == 0) {
+            usleep(300);
+        }
+    }
+    CHECK(icsc_flush(a) == 0);
+
+    WAIT_FOR(received == MESSAGES, 2000);
+    CHECK(received == MESSAGES);
+    CHECK(outOfOrder == 0);
+    CHECK(corrupt == 0);
+    CHECK(b->stats.rxFrames < MESSAGES);
+
+    icsc_close(a);
+    icsc_close(b);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,119 @@
+/*
+ * Send a bulk transfer from a threadless context to a station on another
+ * memory bus, through a pump that loses one of the fragments, and check
+ * that the NACK for it is heard and the fragment sent again.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "icsc.h"
+#include "icsc_private.h"
+#include "config.h"
+#include "check.h"
+
+#define BLOCK 5000
+#define LOST 3
+
+static uint8_t block[BLOCK];
+static uint8_t got[BLOCK];
+static volatile int pumping = 1;
+static int dropped = 0;
+static int nacks = 0;
+static long received = 0;
+static icsc_ptr receiver;
+
+struct pipe {
+    void *from;
+    void *to;
+    uint8_t buf[ICSC_MAX_FRAME * 2];
+    int len;
+};
+
+// Pass whole frames on, except the first copy of one fragment.
+static void pump(struct pipe *p) {
+    ssize_t rc;
+    int flen;
+
+    rc = icsc_transport_memory.read(p->from, p->buf + p->len, sizeof(p->buf) - p->len);
+    if (rc > 0) {
+        p->len += rc;
+    }
+    while (p->len >= ICSC_SOH_START_COUNT + 5) {
+        flen = ICSC_SOH_START_COUNT + 8 + p->buf[ICSC_SOH_START_COUNT + 3];
+        if (p->len < flen) {
+            break;
+        }
+        if (p->buf[ICSC_SOH_START_COUNT + 2] == ICSC_SYS_BULK_NACK) {
+            nacks++;
+        }
+        if (p->buf[ICSC_SOH_START_COUNT + 2] == ICSC_SYS_BULK && p->buf[ICSC_SOH_START_COUNT + 5] == 1 &&
+            p->buf[ICSC_SOH_START_COUNT + 7] == LOST && !dropped) {
+            dropped = 1;
+        } else {
+            icsc_transport_memory.write(p->to, p->buf, flen);
+        }
+        memmove(p->buf, p->buf + flen, p->len - flen);
+        p->len -= flen;
+    }
+}
+
+static void *pump_thread(void *arg) {
+    struct pipe *pipes = (struct pipe *)arg;
+
+    while (pumping) {
+        pump(&pipes[0]);
+        pump(&pipes[1]);
+        usleep(100);
+    }
+    return NULL;
+}
+
+static void *receive_thread(void *arg) {
+    (void)arg;
+    received = icsc_bulk_wait(receiver, 2000000);
+    return NULL;
+}
+
+int main() {
+    icsc_ptr sender = icsc_init_threadless(&icsc_transport_memory, "bulk-a", B115200, 4, -1);
+    struct pipe pipes[2];
+    pthread_t pumpThread;
+    pthread_t receiveThread;
+    int i;
+
+    receiver = icsc_init_transport(&icsc_transport_memory, "bulk-b", B115200, 5, -1);
+    CHECK(sender != NULL && receiver != NULL);
+
+    memset(pipes, 0, sizeof(pipes));
+    pipes[0].from = icsc_transport_memory.open("bulk-a", 0);
+    pipes[0].to = icsc_transport_memory.open("bulk-b", 0);
+    pipes[1].from = pipes[0].to;
+    pipes[1].to = pipes[0].from;
+
+    for (i = 0; i < BLOCK; i++) {
+        block[i] = i * 7;
+    }
+
+    CHECK(icsc_bulk_accept(receiver, got, sizeof(got)) == 0);
+    pthread_create(&pumpThread, NULL, pump_thread, pipes);
+    pthread_create(&receiveThread, NULL, receive_thread, NULL);
+
+    CHECK(icsc_bulk_send(sender, ICSC_BROADCAST, 5, 5, block, BLOCK, 2000000) == 0);
+    pthread_join(receiveThread, NULL);
+    pumping = 0;
+    pthread_join(pumpThread, NULL);
+
+    CHECK(dropped == 1);
+    CHECK(nacks >= 1);
+    CHECK(received == BLOCK);
+    CHECK(memcmp(got, block, BLOCK) == 0);
+
+    icsc_transport_memory.close(pipes[0].from);
+    icsc_transport_memory.close(pipes[0].to);
+    icsc_close(sender);
+    icsc_close(receiver);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,30 @@
+/*
+ * Helpers shared by the tests. Each test is a program that returns
+ * non-zero if any check failed.
+ */
+
+#ifndef _ICSC_CHECK_H
+#define _ICSC_CHECK_H
+
+#include <stdio.h>
+#include <unistd.h>
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        failures++; \
+    } \
+} while (0)
+
+// Wait up to ms milliseconds for cond to become true, for results that
+// arrive on another thread.
+#define WAIT_FOR(cond, ms) do { \
+    int _waited; \
+    for (_waited = 0; !(cond) && _waited < (ms); _waited++) { \
+        usleep(1000); \
+    } \
+} while (0)
+
+#endif
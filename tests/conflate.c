@@ -0,0 +1,85 @@
+/*
+ * Flood a conflated command over a memory bus and check that only the
+ * newest value is kept, and that the notifier is rate limited.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "icsc.h"
+#include "icsc_private.h"
+#include "config.h"
+#include "check.h"
+
+#define VALUES 200
+
+static volatile int dispatched = 0;
+static volatile int other = 0;
+static volatile int notified = 0;
+
+static void on_value(icsc_ptr icsc, unsigned char sender, char command, unsigned char len, char *data) {
+    (void)icsc; (void)sender; (void)command; (void)len; (void)data;
+    __sync_fetch_and_add(&dispatched, 1);
+}
+
+static void on_other(icsc_ptr icsc, unsigned char sender, char command, unsigned char len, char *data) {
+    (void)icsc; (void)sender; (void)command; (void)len; (void)data;
+    __sync_fetch_and_add(&other, 1);
+}
+
+static void on_change(icsc_ptr icsc, void *arg) {
+    (void)icsc;
+    CHECK(arg == &notified);
+    __sync_fetch_and_add(&notified, 1);
+}
+
+int main() {
+    icsc_ptr a = icsc_init_transport(&icsc_transport_memory, "conflate", B115200, 4, -1);
+    icsc_ptr b = icsc_init_transport(&icsc_transport_memory, "conflate", B115200, 5, -1);
+    char data[255];
+    uint32_t version = 0;
+    uint64_t start;
+    uint64_t took;
+    uint8_t len = 0;
+    int i;
+
+    CHECK(a != NULL && b != NULL);
+    icsc_register_command(b, 'V', on_value);
+    icsc_register_command(b, 'O', on_other);
+
+    CHECK(icsc_conflate_read(b, 4, 'V', data, &len, NULL) == -1);
+    CHECK(icsc_conflate(b, 4, 'V') == 0);
+    CHECK(icsc_conflate_read(b, 4, 'V', data, &len, NULL) == 0);
+    CHECK(icsc_conflate_notify(b, on_change, (void *)&notified, 50000) == 0);
+
+    // Every value overwrites the last and none reach the callbacks.
+    start = icsc_micros();
+    for (i = 0; i < VALUES; i++) {
+        icsc_send_int(a, 5, 'V', i);
+        usleep(200);
+    }
+    icsc_send_array(a, 5, 'O', 1, "o");
+    WAIT_FOR(other == 1, 1000);
+    took = icsc_micros() - start;
+    CHECK(other == 1);
+    CHECK(dispatched == 0);
+    CHECK(icsc_conflate_read(b, 4, 'V', data, &len, &version) == 1);
+    CHECK(len == 2 && ((uint8_t)data[0] | ((uint8_t)data[1] << 8)) == VALUES - 1);
+    CHECK(version == VALUES);
+
+    // Nothing is copied again until a new value arrives.
+    CHECK(icsc_conflate_read(b, 4, 'V', data, &len, &version) == 0);
+    icsc_send_int(a, 5, 'V', 1000);
+    WAIT_FOR(icsc_conflate_read(b, 4, 'V', data, &len, &version) == 1, 1000);
+    CHECK(version == VALUES + 1);
+
+    // The notifier ran, but at most once per interval.
+    WAIT_FOR(notified > 0, 1000);
+    CHECK(notified > 0);
+    CHECK(notified <= (int)(took / 50000) + 3);
+
+    icsc_close(a);
+    icsc_close(b);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,169 @@
+/*
+ * Run icscd on a pseudo-terminal and check that it passes frames between
+ * the bus and its clients according to their subscriptions.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "icsc.h"
+#include "icsc_private.h"
+#include "config.h"
+#include "check.h"
+
+static volatile int receivedA = 0;
+static volatile int receivedB = 0;
+static volatile int lastSender = -1;
+
+static void on_a(icsc_ptr icsc, unsigned char sender, char command, unsigned char len, char *data) {
+    (void)icsc; (void)command; (void)len; (void)data;
+    lastSender = sender;
+    __sync_fetch_and_add(&receivedA, 1);
+}
+
+static void on_b(icsc_ptr icsc, unsigned char sender, char command, unsigned char len, char *data) {
+    (void)icsc; (void)command; (void)len; (void)data;
+    lastSender = sender;
+    __sync_fetch_and_add(&receivedB, 1);
+}
+
+// Whether the daemon is accepting connections yet.
+static int listening(const char *path) {
+    struct sockaddr_un addr;
+    int fd;
+    int rc;
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    rc = connect(fd, (struct sockaddr *)&addr, sizeof(addr));
+    close(fd);
+    return rc == 0;
+}
+
+// Read whatever the daemon puts on the bus within ms milliseconds.
+static int read_bus(int fd, uint8_t *buf, int max, int ms) {
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    int len = 0;
+    int rc;
+
+    while (len < max && poll(&pfd, 1, ms) > 0) {
+        rc = read(fd, buf + len, max - len);
+        if (rc <= 0) {
+            break;
+        }
+        len += rc;
+        ms = 50;
+    }
+    return len;
+}
+
+int main() {
+    char sock[] = "/tmp/icsc-daemon-XXXXXX";
+    char path[64];
+    char busName[64];
+    uint8_t frame[ICSC_MAX_FRAME];
+    uint8_t bus[ICSC_MAX_FRAME * 2];
+    uint8_t stations[32];
+    uint8_t commands[32];
+    icsc_ptr a;
+    icsc_ptr b;
+    icsc_ptr memory;
+    pid_t pid;
+    int status;
+    int master;
+    int len;
+
+    master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master < 0 || grantpt(master) < 0 || unlockpt(master) < 0) {
+        fprintf(stderr, "Cannot open a pseudo-terminal: %s\n", strerror(errno));
+        return 1;
+    }
+    if (mkdtemp(sock) == NULL) {
+        fprintf(stderr, "Cannot create %s: %s\n", sock, strerror(errno));
+        return 1;
+    }
+    snprintf(path, sizeof(path), "%s/icscd.sock", sock);
+
+    pid = fork();
+    if (pid == 0) {
+        // Our end of the terminal must close when we close it.
+        snprintf(busName, sizeof(busName), "%s", ptsname(master));
+        close(master);
+        execl(ICSCD, "icscd", "-d", busName, "-s", path, "-f", (char *)NULL);
+        fprintf(stderr, "Cannot run %s: %s\n", ICSCD, strerror(errno));
+        _exit(127);
+    }
+
+    WAIT_FOR(listening(path), 5000);
+    a = icsc_connect(path, 5);
+    b = icsc_connect(path, 6);
+    CHECK(a != NULL && b != NULL);
+    if (a == NULL || b == NULL) {
+        kill(pid, SIGTERM);
+        return 1;
+    }
+    icsc_register_command(a, 'A', on_a);
+    icsc_register_command(b, 'A', on_b);
+    icsc_register_command(b, 'B', on_b);
+    usleep(50000);
+
+    // A frame from the bus reaches only the client it is addressed to.
+    len = icsc_build_frame(frame, 9, 5, 'A', 2, "hi");
+    CHECK(write(master, frame, len) == len);
+    WAIT_FOR(receivedA == 1, 1000);
+    CHECK(receivedA == 1);
+    CHECK(receivedB == 0);
+    CHECK(lastSender == 9);
+
+    // A client's frame goes both to the bus and to the other client.
+    icsc_send_array(a, 6, 'A', 2, "yo");
+    WAIT_FOR(receivedB == 1, 1000);
+    CHECK(receivedB == 1);
+    CHECK(lastSender == 5);
+    len = icsc_build_frame(frame, 5, 6, 'A', 2, "yo");
+    CHECK(read_bus(master, bus, sizeof(bus), 1000) == len);
+    CHECK(memcmp(bus, frame, len) == 0);
+
+    // Narrowing the subscription to one command drops the others.
+    memset(stations, 0, sizeof(stations));
+    stations[6 >> 3] |= 1 << (6 & 7);
+    memset(commands, 0, sizeof(commands));
+    commands['B' >> 3] |= 1 << ('B' & 7);
+    CHECK(icsc_subscribe(b, stations, commands) == 0);
+    usleep(50000);
+    len = icsc_build_frame(frame, 9, 6, 'A', 1, "x");
+    CHECK(write(master, frame, len) == len);
+    len = icsc_build_frame(frame, 9, 6, 'B', 1, "x");
+    CHECK(write(master, frame, len) == len);
+    WAIT_FOR(receivedB == 2, 1000);
+    usleep(50000);
+    CHECK(receivedB == 2);
+
+    // Subscribing is refused anywhere but on a daemon connection.
+    memory = icsc_init_transport(&icsc_transport_memory, "daemon", B115200, 7, -1);
+    CHECK(icsc_subscribe(memory, stations, commands) == -1);
+    icsc_close(memory);
+
+    // Losing the bus stops the daemon with an error.
+    icsc_close(a);
+    icsc_close(b);
+    close(master);
+    CHECK(waitpid(pid, &status, 0) == pid);
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 1);
+
+    unlink(path);
+    rmdir(sock);
+    return failures ? 1 : 0;
+}
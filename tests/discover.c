@@ -0,0 +1,61 @@
+/*
+ * Sweep a memory bus for live stations one at a time, pipelined and in
+ * the background.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "icsc.h"
+#include "config.h"
+#include "check.h"
+
+static int found(const icsc_station_info_t *table, int count, uint8_t station) {
+    int i;
+
+    for (i = 0; i < count; i++) {
+        if (table[i].station == station) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// The memory bus is instant, but the baud rate still sets how long a ping
+// is waited for. A slow one leaves room for a loaded machine.
+int main() {
+    icsc_ptr a = icsc_init_transport(&icsc_transport_memory, "discover", B9600, 4, -1);
+    icsc_ptr b = icsc_init_transport(&icsc_transport_memory, "discover", B9600, 5, -1);
+    icsc_ptr c = icsc_init_transport(&icsc_transport_memory, "discover", B9600, 9, -1);
+    icsc_station_info_t table[16];
+    int count;
+
+    CHECK(a != NULL && b != NULL && c != NULL);
+
+    count = icsc_discover(a, 3, 12, 0, table, 16);
+    CHECK(count == 2);
+    CHECK(found(table, count, 5) && found(table, count, 9));
+
+    count = icsc_discover(a, 3, 12, ICSC_DISCOVER_PIPELINE, table, 16);
+    CHECK(count == 2);
+    CHECK(found(table, count, 5) && found(table, count, 9));
+
+    // The table is never overrun.
+    CHECK(icsc_discover(a, 3, 12, 0, table, 1) == 1);
+    CHECK(icsc_discover(a, 12, 3, 0, table, 16) == -1);
+
+    CHECK(icsc_discover_table(a, table, 16) == -1);
+    CHECK(icsc_discover_start(a, 3, 12, 1000) == 0);
+    WAIT_FOR(icsc_discover_table(a, table, 16) == 2, 2000);
+    count = icsc_discover_table(a, table, 16);
+    CHECK(count == 2);
+    CHECK(found(table, count, 5) && found(table, count, 9));
+    CHECK(icsc_discover_stop(a) == 0);
+    CHECK(icsc_discover_stop(a) == -1);
+
+    icsc_close(a);
+    icsc_close(b);
+    icsc_close(c);
+    return failures ? 1 : 0;
+}
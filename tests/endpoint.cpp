@@ -0,0 +1,113 @@
+/*
+ * Typed sending and handlers through icsc::Endpoint over a memory bus.
+ */
+
+#include <cstdio>
+#include <cstring>
+
+#include "icsc.hpp"
+#include "config.h"
+#include "check.h"
+
+struct SetPoint {
+    uint8_t channel;
+    uint8_t flags;
+    int16_t low;
+    int16_t high;
+};
+
+struct Padded {
+    uint8_t channel;
+    int16_t value;
+};
+
+struct Gains {
+    float gain[2];
+};
+
+namespace icsc {
+template<> struct is_packed<Gains> : std::true_type {};
+}
+
+static_assert(icsc::is_packed<SetPoint>::value, "SetPoint has no padding");
+static_assert(!icsc::is_packed<Padded>::value, "Padded has a padding byte");
+static_assert(icsc::is_packed<double>::value, "arithmetic types are packed");
+
+static volatile int dynamicCount = 0;
+static volatile int staticCount = 0;
+static volatile int longCount = 0;
+static volatile int gainCount = 0;
+static volatile int cCount = 0;
+static SetPoint lastSetPoint;
+static int32_t lastLong;
+static Gains lastGains;
+
+static void on_dynamic(icsc::Endpoint &, uint8_t, const SetPoint &sp) {
+    lastSetPoint = sp;
+    __sync_fetch_and_add(&dynamicCount, 1);
+}
+
+static void on_static(icsc::Endpoint &, uint8_t, const SetPoint &sp) {
+    lastSetPoint = sp;
+    __sync_fetch_and_add(&staticCount, 1);
+}
+
+static void on_long(icsc::Endpoint &, uint8_t, const int32_t &value) {
+    lastLong = value;
+    __sync_fetch_and_add(&longCount, 1);
+}
+
+static void on_gains(icsc::Endpoint &, uint8_t, const Gains &g) {
+    lastGains = g;
+    __sync_fetch_and_add(&gainCount, 1);
+}
+
+static void on_c(icsc_ptr, unsigned char, char, unsigned char, char *) {
+    __sync_fetch_and_add(&cCount, 1);
+}
+
+int main() {
+    icsc::Endpoint a(&icsc_transport_memory, "endpoint", B115200, 1);
+    icsc::Endpoint b(&icsc_transport_memory, "endpoint", B115200, 2);
+    Gains gains = { { 0.5f, -2.0f } };
+
+    CHECK((b.on<'S', SetPoint>(on_dynamic)) == 0);
+    CHECK((b.on<'T', SetPoint, on_static>()) == 0);
+    CHECK((b.on<'L', int32_t>(on_long)) == 0);
+    CHECK((b.on<'G', Gains>(on_gains)) == 0);
+
+    a.send(2, 'S', SetPoint{2, 0, -40, 85});
+    WAIT_FOR(dynamicCount == 1, 1000);
+    CHECK(dynamicCount == 1);
+    CHECK(lastSetPoint.channel == 2 && lastSetPoint.low == -40 && lastSetPoint.high == 85);
+
+    a.send(2, 'T', SetPoint{3, 1, -1, 1});
+    WAIT_FOR(staticCount == 1, 1000);
+    CHECK(staticCount == 1);
+    CHECK(lastSetPoint.channel == 3 && lastSetPoint.flags == 1);
+
+    // Interoperates with the C sending functions.
+    icsc_send_long(a.get(), 2, 'L', 123456);
+    WAIT_FOR(longCount == 1, 1000);
+    CHECK(lastLong == 123456);
+
+    a.send(2, 'G', gains);
+    WAIT_FOR(gainCount == 1, 1000);
+    CHECK(lastGains.gain[0] == 0.5f && lastGains.gain[1] == -2.0f);
+
+    // A payload of the wrong size is not passed to the handler.
+    a.send(2, 'L', (int16_t)5);
+    usleep(50000);
+    CHECK(longCount == 1);
+
+    // off() removes only the wrapper's own callback.
+    icsc_register_command(b.get(), 'L', on_c);
+    CHECK(b.off<'L'>() == 0);
+    CHECK(b.off<'L'>() == -1);
+    icsc_send_long(a.get(), 2, 'L', 7);
+    WAIT_FOR(cCount == 1, 1000);
+    CHECK(cCount == 1);
+    CHECK(longCount == 1);
+
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,109 @@
+/*
+ * Fill the output queue of a link that only empties when told to, and
+ * check that sends are refused at the high-water mark and that the
+ * writable callback says when they may resume.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "icsc.h"
+#include "config.h"
+#include "check.h"
+
+// A link whose output queue holds everything written until the test
+// empties it, as a socket does while the far end is not reading.
+static volatile int queued = 0;
+static int line;
+
+static void *queue_open(const char *path, unsigned long baud) {
+    (void)path; (void)baud;
+    return &line;
+}
+
+static ssize_t queue_read(void *data, uint8_t *buf, size_t len) {
+    (void)data; (void)buf; (void)len;
+    return 0;
+}
+
+static ssize_t queue_write(void *data, const uint8_t *buf, size_t len) {
+    (void)data; (void)buf;
+    __sync_fetch_and_add(&queued, len);
+    return len;
+}
+
+static int queue_drain(void *data) {
+    (void)data;
+    return 0;
+}
+
+static int queue_wait(void *data, unsigned long timeout) {
+    (void)data;
+    usleep(timeout < 1000 ? timeout : 1000);
+    return 0;
+}
+
+static void queue_close(void *data) {
+    (void)data;
+}
+
+static int queue_outq(void *data) {
+    (void)data;
+    return queued;
+}
+
+static const icsc_transport_t queueTransport = {
+    "queue", queue_open, queue_read, queue_write, queue_drain, queue_wait, queue_close, NULL, queue_outq, NULL, NULL
+};
+
+static volatile int writable = 0;
+
+static void on_writable(icsc_ptr icsc, void *arg) {
+    (void)icsc;
+    CHECK(arg == &writable);
+    __sync_fetch_and_add(&writable, 1);
+}
+
+int main() {
+    icsc_ptr icsc = icsc_init_transport(&queueTransport, "queue", B115200, 4, -1);
+    char data[60];
+    int flen = ICSC_SOH_START_COUNT + 8 + sizeof(data);
+
+    CHECK(icsc != NULL);
+    memset(data, 'x', sizeof(data));
+
+    CHECK(icsc_set_tx_watermarks(icsc, 20, 100) == -1);
+    CHECK(icsc_set_tx_watermarks(icsc, 2 * flen, 20) == 0);
+    CHECK(icsc_set_writable(icsc, on_writable, (void *)&writable) == 0);
+
+    // Sends are taken until the backlog reaches the high-water mark.
+    CHECK(icsc_try_send_array(icsc, 5, 'D', sizeof(data), data) == 0);
+    CHECK(icsc_tx_pending(icsc) == flen);
+    CHECK(icsc_try_send_array(icsc, 5, 'D', sizeof(data), data) == 0);
+    CHECK(icsc_tx_pending(icsc) == 2 * flen);
+    errno = 0;
+    CHECK(icsc_try_send_array(icsc, 5, 'D', sizeof(data), data) == -1);
+    CHECK(errno == EAGAIN);
+    CHECK(icsc_try_send_array(icsc, 5, 'D', sizeof(data), data) == -1);
+
+    // Draining part way is not enough; reaching the low-water mark calls
+    // back once, however many sends were refused.
+    queued = 50;
+    usleep(50000);
+    CHECK(writable == 0);
+    queued = 10;
+    WAIT_FOR(writable == 1, 1000);
+    usleep(50000);
+    CHECK(writable == 1);
+    CHECK(icsc_try_send_array(icsc, 5, 'D', sizeof(data), data) == 0);
+
+    // Plain sends are never refused.
+    CHECK(icsc_send_array(icsc, 5, 'D', sizeof(data), data) == 0);
+    CHECK(icsc_send_array(icsc, 5, 'D', sizeof(data), data) == 0);
+    CHECK(icsc_tx_pending(icsc) == 10 + 3 * flen);
+
+    icsc_close(icsc);
+    return failures ? 1 : 0;
+}
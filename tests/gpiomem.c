@@ -0,0 +1,124 @@
+/*
+ * Check the register writes of the gpiomem driver against a plain file
+ * mapped in place of the GPIO block.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "icsc.h"
+#include "config.h"
+#include "check.h"
+
+static char path[] = "/tmp/icsc-gpiomem-XXXXXX";
+static int fd = -1;
+
+static uint32_t reg(uint64_t offset) {
+    uint32_t v = 0;
+
+    if (pread(fd, &v, sizeof(v), offset) != sizeof(v)) {
+        fprintf(stderr, "Cannot read register 0x%llx: %s\n", (unsigned long long)offset, strerror(errno));
+        failures++;
+    }
+    return v;
+}
+
+static void set_reg(uint64_t offset, uint32_t v) {
+    if (pwrite(fd, &v, sizeof(v), offset) != sizeof(v)) {
+        fprintf(stderr, "Cannot write register 0x%llx: %s\n", (unsigned long long)offset, strerror(errno));
+        failures++;
+    }
+}
+
+static void check_pin(const icsc_gpiomem_layout_t *layout, int num) {
+    uint64_t bank = layout->base[num / 32];
+    uint32_t bit = 1 << (num % 32);
+    icsc_gpiomem_ptr g;
+
+    g = icsc_gpiomem_open(layout, num);
+    CHECK(g != NULL);
+    if (g == NULL) {
+        return;
+    }
+
+    icsc_gpiomem_write(g, 1);
+    CHECK(reg(bank + layout->set) == bit);
+    CHECK(reg(bank + layout->clear) == 0);
+
+    set_reg(bank + layout->set, 0);
+    icsc_gpiomem_write(g, 0);
+    CHECK(reg(bank + layout->clear) == bit);
+    CHECK(reg(bank + layout->set) == 0);
+    set_reg(bank + layout->clear, 0);
+
+    set_reg(bank + layout->level, bit);
+    CHECK(icsc_gpiomem_read(g) == 1);
+    set_reg(bank + layout->level, ~bit);
+    CHECK(icsc_gpiomem_read(g) == 0);
+    set_reg(bank + layout->level, 0);
+
+    icsc_gpiomem_close(g);
+}
+
+static void test_fsel(void) {
+    icsc_gpiomem_layout_t layout = icsc_gpiomem_bcm2835;
+
+    layout.device = path;
+
+    // GPIO12 is the third pin of the second function select word. Fill the
+    // word so both the bits to clear and the neighbours can be checked.
+    set_reg(0x04, 0xFFFFFFFF);
+    check_pin(&layout, 12);
+    CHECK(reg(0x04) == ((0xFFFFFFFF & ~(7 << 6)) | (1 << 6)));
+
+    // GPIO40 is in the second bank but its function select word is still
+    // counted from the first.
+    set_reg(0x10, 0);
+    check_pin(&layout, 40);
+    CHECK(reg(0x10) == 1);
+}
+
+static void test_oe(void) {
+    icsc_gpiomem_layout_t layout = icsc_gpiomem_am335x;
+    long page = sysconf(_SC_PAGESIZE);
+
+    // Two banks a page apart, so the second needs an offset mapping.
+    layout.device = path;
+    layout.banks = 2;
+    layout.base[0] = 0;
+    layout.base[1] = page;
+
+    set_reg(layout.base[1] + layout.direction, 0xFFFFFFFF);
+    check_pin(&layout, 35);
+    CHECK(reg(layout.base[1] + layout.direction) == ~(uint32_t)(1 << 3));
+    CHECK(reg(layout.base[0] + layout.direction) == 0);
+}
+
+int main() {
+    icsc_gpiomem_layout_t layout = icsc_gpiomem_bcm2835;
+
+    fd = mkstemp(path);
+    if (fd < 0) {
+        fprintf(stderr, "Cannot create %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    if (ftruncate(fd, 2 * sysconf(_SC_PAGESIZE)) < 0) {
+        fprintf(stderr, "Cannot size %s: %s\n", path, strerror(errno));
+        unlink(path);
+        return 1;
+    }
+
+    test_fsel();
+    test_oe();
+
+    // A pin past the last bank is refused before anything is mapped.
+    layout.device = path;
+    CHECK(icsc_gpiomem_open(&layout, 64) == NULL);
+
+    close(fd);
+    unlink(path);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,74 @@
+/*
+ * Send to a group address on a memory bus and check that only the members
+ * take the frame.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "icsc.h"
+#include "config.h"
+#include "check.h"
+
+#define GROUP ICSC_GROUP(3)
+
+static volatile int received[3];
+static volatile int lastStation = -1;
+
+static void on_frame(icsc_ptr icsc, unsigned char station, unsigned char sender, char command, unsigned char len, char *data, void *arg) {
+    (void)icsc; (void)sender; (void)command; (void)len; (void)data;
+    lastStation = station;
+    __sync_fetch_and_add(&received[*(int *)arg], 1);
+}
+
+int main() {
+    static int ids[3] = { 0, 1, 2 };
+    icsc_ptr a = icsc_init_transport(&icsc_transport_memory, "groups", B115200, 4, -1);
+    icsc_ptr members[3];
+    icsc_stats_t stats;
+    int i;
+
+    CHECK(a != NULL);
+    for (i = 0; i < 3; i++) {
+        members[i] = icsc_init_transport(&icsc_transport_memory, "groups", B115200, 5 + i, -1);
+        CHECK(members[i] != NULL);
+        icsc_register_command_station(members[i], 'G', on_frame, &ids[i]);
+    }
+
+    CHECK(icsc_join_group(members[0], 5) == -1);
+    CHECK(icsc_join_group(members[0], GROUP) == 0);
+    CHECK(icsc_join_group(members[1], GROUP) == 0);
+    CHECK(icsc_in_group(members[0], GROUP) == 1);
+    CHECK(icsc_in_group(members[2], GROUP) == 0);
+    CHECK(icsc_in_group(members[2], 5) == -1);
+
+    // Members take the frame and see it was for the group. The others drop
+    // it at the header, so it never counts as received.
+    icsc_send_array(a, GROUP, 'G', 4, "data");
+    WAIT_FOR(received[0] == 1 && received[1] == 1, 1000);
+    usleep(20000);
+    CHECK(received[0] == 1 && received[1] == 1 && received[2] == 0);
+    CHECK(lastStation == GROUP);
+    CHECK(icsc_get_stats(members[2], &stats) == 0);
+    CHECK(stats.rxFrames == 0);
+
+    // A station that leaves stops getting them.
+    CHECK(icsc_leave_group(members[0], GROUP) == 0);
+    CHECK(icsc_in_group(members[0], GROUP) == 0);
+    icsc_send_array(a, GROUP, 'G', 4, "data");
+    WAIT_FOR(received[1] == 2, 1000);
+    usleep(20000);
+    CHECK(received[0] == 1 && received[1] == 2 && received[2] == 0);
+
+    // Frames to the station itself still arrive as before.
+    icsc_send_array(a, 5, 'G', 4, "data");
+    WAIT_FOR(received[0] == 2, 1000);
+    CHECK(received[0] == 2 && lastStation == 5);
+
+    icsc_close(a);
+    for (i = 0; i < 3; i++) {
+        icsc_close(members[i]);
+    }
+    return failures ? 1 : 0;
+}
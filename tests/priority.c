@@ -0,0 +1,116 @@
+/*
+ * Hold the link while frames of every priority class queue up behind it,
+ * and check the order they are written in when it is let go.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "icsc.h"
+#include "icsc_private.h"
+#include "config.h"
+#include "check.h"
+
+// A link that records the command of every frame written to it, and holds
+// the first write until it is released.
+static char written[16];
+static volatile int writes = 0;
+static volatile int held = 1;
+static int line;
+
+static void *gate_open(const char *path, unsigned long baud) {
+    (void)path; (void)baud;
+    return &line;
+}
+
+static ssize_t gate_read(void *data, uint8_t *buf, size_t len) {
+    (void)data; (void)buf; (void)len;
+    return 0;
+}
+
+static ssize_t gate_write(void *data, const uint8_t *buf, size_t len) {
+    (void)data;
+    if (writes < (int)sizeof(written)) {
+        written[writes] = buf[ICSC_SOH_START_COUNT + 2];
+    }
+    __sync_fetch_and_add(&writes, 1);
+    while (held) {
+        usleep(1000);
+    }
+    return len;
+}
+
+static int gate_drain(void *data) {
+    (void)data;
+    return 0;
+}
+
+static int gate_wait(void *data, unsigned long timeout) {
+    (void)data;
+    usleep(timeout < 1000 ? timeout : 1000);
+    return 0;
+}
+
+static void gate_close(void *data) {
+    (void)data;
+}
+
+static const icsc_transport_t gateTransport = {
+    "gate", gate_open, gate_read, gate_write, gate_drain, gate_wait, gate_close, NULL, NULL, NULL, NULL
+};
+
+static icsc_ptr icsc;
+
+static void *send_command(void *arg) {
+    char command = *(char *)arg;
+
+    CHECK(icsc_send_array(icsc, 5, command, 1, "x") == 0);
+    return NULL;
+}
+
+// Start a sender and wait until it is queued for the link.
+static void queue(pthread_t *thread, char *command, int waiting) {
+    pthread_create(thread, NULL, send_command, command);
+    WAIT_FOR(__atomic_load_n(&icsc->txWaiting, __ATOMIC_RELAXED) == waiting, 1000);
+    CHECK(icsc->txWaiting == waiting);
+}
+
+int main() {
+    static char commands[] = "LBBNNC";
+    pthread_t threads[sizeof(commands) - 1];
+    icsc_stats_t stats;
+    int i;
+
+    icsc = icsc_init_transport(&gateTransport, "gate", B115200, 4, -1);
+    CHECK(icsc != NULL);
+
+    CHECK(icsc_set_priority(icsc, 'C', ICSC_PRIORITY_COUNT) == -1);
+    CHECK(icsc_set_priority(icsc, 'C', ICSC_PRIORITY_CONTROL) == 0);
+    CHECK(icsc_set_priority(icsc, 'B', ICSC_PRIORITY_BULK) == 0);
+    CHECK(icsc_set_priority(icsc, 'L', ICSC_PRIORITY_BULK) == 0);
+
+    // The first frame takes the link, then bulk, normal and control frames
+    // queue behind it in that order.
+    pthread_create(&threads[0], NULL, send_command, &commands[0]);
+    WAIT_FOR(writes == 1, 1000);
+    for (i = 1; i < (int)sizeof(commands) - 1; i++) {
+        queue(&threads[i], &commands[i], i);
+    }
+
+    held = 0;
+    for (i = 0; i < (int)sizeof(commands) - 1; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    // The most urgent class goes first, and each class keeps its order.
+    CHECK(writes == 6);
+    CHECK(memcmp(written, "LCNNBB", 6) == 0);
+
+    CHECK(icsc_get_stats(icsc, &stats) == 0);
+    CHECK(stats.controlWaitMax > 0);
+
+    icsc_close(icsc);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,149 @@
+/*
+ * Negotiate a faster rate over a two-station link that garbles every byte
+ * sent at a rate the other end is not listening at.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "icsc.h"
+#include "icsc_private.h"
+#include "config.h"
+#include "check.h"
+
+// Each end of the link is a memory bus node with a baud rate of its own.
+struct end {
+    void *node;
+    unsigned long baud;
+    int stuck;
+};
+
+static struct end ends[2];
+
+static void *speed_open(const char *path, unsigned long baud) {
+    struct end *e = &ends[path[0] == '1'];
+
+    e->node = icsc_transport_memory.open("rate", 0);
+    e->baud = baud;
+    return e;
+}
+
+static ssize_t speed_read(void *data, uint8_t *buf, size_t len) {
+    return icsc_transport_memory.read(((struct end *)data)->node, buf, len);
+}
+
+static ssize_t speed_write(void *data, const uint8_t *buf, size_t len) {
+    struct end *e = (struct end *)data;
+    struct end *peer = &ends[e == &ends[0]];
+    uint8_t garbled[ICSC_MAX_FRAME];
+    size_t i;
+
+    if (peer->baud == e->baud || len > sizeof(garbled)) {
+        return icsc_transport_memory.write(e->node, buf, len);
+    }
+    for (i = 0; i < len; i++) {
+        garbled[i] = buf[i] ^ 0xA5;
+    }
+    icsc_transport_memory.write(e->node, garbled, len);
+    return len;
+}
+
+static int speed_drain(void *data) {
+    return icsc_transport_memory.drain(((struct end *)data)->node);
+}
+
+static int speed_wait(void *data, unsigned long timeout) {
+    return icsc_transport_memory.wait(((struct end *)data)->node, timeout);
+}
+
+static void speed_close(void *data) {
+    icsc_transport_memory.close(((struct end *)data)->node);
+}
+
+static int speed_set_baud(void *data, unsigned long baud) {
+    struct end *e = (struct end *)data;
+
+    if (e->stuck) {
+        return -1;
+    }
+    e->baud = baud;
+    return 0;
+}
+
+static void speed_wake(void *data) {
+    icsc_transport_memory.wake(((struct end *)data)->node);
+}
+
+static const icsc_transport_t speedTransport = {
+    "speed", speed_open, speed_read, speed_write, speed_drain, speed_wait, speed_close, speed_set_baud, NULL, NULL, speed_wake
+};
+
+static volatile int received = 0;
+
+static void on_frame(icsc_ptr icsc, unsigned char sender, char command, unsigned char len, char *data) {
+    (void)icsc; (void)sender; (void)command; (void)len; (void)data;
+    __sync_fetch_and_add(&received, 1);
+}
+
+int main() {
+    icsc_ptr a = icsc_init_transport(&speedTransport, "0", B115200, 4, -1);
+    icsc_ptr b = icsc_init_transport(&speedTransport, "1", B115200, 5, -1);
+    icsc_ptr memory = icsc_init_transport(&icsc_transport_memory, "rate-memory", B115200, 6, -1);
+    unsigned long ratesA[] = { B230400, B460800, B921600 };
+    unsigned long ratesB[] = { B230400, B460800 };
+    void *line;
+    uint8_t noise[256];
+    int i;
+
+    CHECK(a != NULL && b != NULL && memory != NULL);
+    icsc_register_command(b, 'D', on_frame);
+
+    // A link without a baud rate cannot take part.
+    CHECK(icsc_rate_allow(memory, ratesA, 3) == -1);
+    icsc_close(memory);
+    CHECK(icsc_negotiate_rate(a, 5) == 0);
+
+    // Nothing faster in common means staying put.
+    CHECK(icsc_rate_allow(a, ratesA, 3) == 0);
+    CHECK(icsc_rate_allow(b, ratesA, 0) == 0);
+    CHECK(icsc_negotiate_rate(a, 5) == B115200);
+    CHECK(a->baud == B115200 && b->baud == B115200);
+
+    // The fastest common rate is chosen, and the peer stays on it after
+    // its rollback time has passed.
+    CHECK(icsc_rate_allow(b, ratesB, 2) == 0);
+    CHECK(icsc_negotiate_rate(a, 5) == B460800);
+    CHECK(a->baud == B460800 && b->baud == B460800);
+    usleep(600000);
+    CHECK(b->baud == B460800);
+    icsc_send_array(a, 5, 'D', 4, "data");
+    WAIT_FOR(received == 1, 1000);
+    CHECK(received == 1);
+
+    // A burst of garbage on the link sends both ends back to the base rate.
+    line = icsc_transport_memory.open("rate", 0);
+    memset(noise, 0x55, sizeof(noise));
+    for (i = 0; i < 4; i++) {
+        icsc_transport_memory.write(line, noise, sizeof(noise));
+        usleep(100000);
+    }
+    WAIT_FOR(a->baud == B115200 && b->baud == B115200, 3000);
+    CHECK(a->baud == B115200 && b->baud == B115200);
+    icsc_transport_memory.close(line);
+
+    // If the initiator cannot follow, the peer hears nothing at the new
+    // rate and goes back on its own.
+    ends[0].stuck = 1;
+    CHECK(icsc_negotiate_rate(a, 5) == B115200);
+    WAIT_FOR(b->baud == B115200, 2000);
+    CHECK(b->baud == B115200);
+    ends[0].stuck = 0;
+    icsc_send_array(a, 5, 'D', 4, "data");
+    WAIT_FOR(received == 2, 1000);
+    CHECK(received == 2);
+
+    icsc_close(a);
+    icsc_close(b);
+    return failures ? 1 : 0;
+}
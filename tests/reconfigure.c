@@ -0,0 +1,78 @@
+/*
+ * Change the settings of a context on a memory bus while it runs and check
+ * that it answers to its new station, drops a half received frame and
+ * refuses addresses that are not stations.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "icsc.h"
+#include "icsc_private.h"
+#include "config.h"
+#include "check.h"
+
+static volatile int received = 0;
+
+static void on_frame(icsc_ptr icsc, unsigned char sender, char command, unsigned char len, char *data) {
+    (void)icsc; (void)sender; (void)command; (void)len; (void)data;
+    __sync_fetch_and_add(&received, 1);
+}
+
+int main() {
+    icsc_ptr sender = icsc_init_transport(&icsc_transport_memory, "reconfigure", B115200, 4, -1);
+    icsc_ptr target = icsc_init_transport(&icsc_transport_memory, "reconfigure", B115200, 5, -1);
+    uint8_t frame[ICSC_MAX_FRAME];
+    icsc_config_t config;
+    icsc_stats_t stats;
+    int len;
+
+    CHECK(sender != NULL && target != NULL);
+    icsc_register_command(target, 'R', on_frame);
+
+    CHECK(icsc_get_config(target, &config) == 0);
+    CHECK(config.station == 5 && config.baud == B115200);
+    CHECK(config.de == -1 && config.rxTimeout == ICSC_RX_TIMEOUT);
+
+    // Neither the broadcast address nor a group can be a station, and a
+    // refused change leaves the old settings in place.
+    config.station = ICSC_BROADCAST;
+    CHECK(icsc_reconfigure(target, &config) == -1);
+    config.station = ICSC_GROUP(1);
+    CHECK(icsc_reconfigure(target, &config) == -1);
+    CHECK(icsc_get_config(target, &config) == 0);
+    CHECK(config.station == 5);
+
+    // After moving, frames to the new station arrive and frames to the old
+    // one are dropped at the header.
+    config.station = 6;
+    CHECK(icsc_reconfigure(target, &config) == 0);
+    icsc_send_array(sender, 5, 'R', 3, "old");
+    icsc_send_array(sender, 6, 'R', 3, "new");
+    WAIT_FOR(received == 1, 1000);
+    usleep(20000);
+    CHECK(received == 1);
+    CHECK(icsc_get_stats(target, &stats) == 0);
+    CHECK(stats.rxFrames == 1);
+
+    // With a long receive timeout, a half received frame would swallow the
+    // next one. Reconfiguring throws it away instead of waiting it out.
+    config.rxTimeout = 5000000;
+    CHECK(icsc_reconfigure(target, &config) == 0);
+    len = icsc_build_frame(frame, 4, 6, 'R', 10, "0123456789");
+    CHECK(icsc_write_link(sender, frame, len - 6) == 0);
+    usleep(20000);
+    CHECK(icsc_reconfigure(target, &config) == 0);
+    CHECK(icsc_get_config(target, &config) == 0);
+    CHECK(config.rxTimeout == 5000000);
+    icsc_send_array(sender, 6, 'R', 3, "new");
+    WAIT_FOR(received == 2, 1000);
+    CHECK(received == 2);
+    CHECK(icsc_get_stats(target, &stats) == 0);
+    CHECK(stats.rxTimeouts == 0);
+
+    icsc_close(sender);
+    icsc_close(target);
+    return failures ? 1 : 0;
+}
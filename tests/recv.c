@@ -0,0 +1,105 @@
+/*
+ * The receive queue: ordering, holding and releasing slots, overruns, and
+ * waiting for a frame on a threadless context.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "icsc.h"
+#include "icsc_private.h"
+#include "config.h"
+#include "check.h"
+
+static icsc_ptr sender;
+
+static void *send_later(void *arg) {
+    (void)arg;
+    usleep(20000);
+    icsc_send_array(sender, 2, 'L', 5, "later");
+    return NULL;
+}
+
+static void test_queue(void) {
+    icsc_ptr b = icsc_init_transport(&icsc_transport_memory, "recv", B115200, 2, -1);
+    icsc_message_t msgs[8];
+    icsc_message_t msg;
+    char data[1];
+    int i;
+
+    sender = icsc_init_transport(&icsc_transport_memory, "recv", B115200, 1, -1);
+    CHECK(icsc_recv_enable(b, 0) == -1);
+    CHECK(icsc_recv_enable(b, ICSC_RECV_MAX_DEPTH + 1) == -1);
+
+    // Three rounds up to four slots.
+    CHECK(icsc_recv_enable(b, 3) == 0);
+    CHECK(icsc_recv_enable(b, 3) == -1);
+    CHECK(icsc_recv(b, &msg, 0) == 0);
+
+    for (i = 0; i < 5; i++) {
+        data[0] = i;
+        icsc_send_array(sender, 2, 'Q', 1, data);
+    }
+    WAIT_FOR(b->stats.rxFrames == 5, 1000);
+    CHECK(icsc_recv_depth(b) == 4);
+    CHECK(b->stats.rxOverruns == 1);
+
+    CHECK(icsc_recv_many(b, msgs, 8, 0) == 4);
+    for (i = 0; i < 4; i++) {
+        CHECK(msgs[i].sender == 1 && msgs[i].station == 2 && msgs[i].command == 'Q');
+        CHECK(msgs[i].len == 1 && msgs[i].data[0] == i);
+    }
+
+    // Releasing the newer frames first frees nothing while the oldest is
+    // still held.
+    CHECK(icsc_release(b, &msgs[1]) == 0);
+    CHECK(icsc_release(b, &msgs[1]) == -1);
+    CHECK(icsc_release(b, &msgs[2]) == 0);
+    CHECK(icsc_release(b, &msgs[3]) == 0);
+    icsc_send_array(sender, 2, 'Q', 1, "x");
+    WAIT_FOR(b->stats.rxFrames == 6, 1000);
+    CHECK(b->stats.rxOverruns == 2);
+    CHECK(icsc_recv_depth(b) == 0);
+
+    CHECK(icsc_release(b, &msgs[0]) == 0);
+    for (i = 0; i < 10; i++) {
+        data[0] = 10 + i;
+        icsc_send_array(sender, 2, 'R', 1, data);
+        CHECK(icsc_recv(b, &msg, 1000000) == 1);
+        CHECK(msg.command == 'R' && msg.data[0] == 10 + i);
+        CHECK(icsc_release(b, &msg) == 0);
+    }
+
+    icsc_close(b);
+    icsc_close(sender);
+}
+
+// With no read thread, waiting for a frame has to read the link.
+static void test_threadless(void) {
+    icsc_ptr b = icsc_init_threadless(&icsc_transport_memory, "recv-threadless", B115200, 2, -1);
+    icsc_message_t msg;
+    pthread_t thread;
+
+    sender = icsc_init_transport(&icsc_transport_memory, "recv-threadless", B115200, 1, -1);
+    CHECK(b != NULL);
+    CHECK(icsc_recv_enable(b, 4) == 0);
+
+    pthread_create(&thread, NULL, send_later, NULL);
+    CHECK(icsc_recv(b, &msg, 1000000) == 1);
+    CHECK(msg.command == 'L' && msg.len == 5 && memcmp(msg.data, "later", 5) == 0);
+    icsc_release(b, &msg);
+    pthread_join(thread, NULL);
+
+    CHECK(icsc_recv(b, &msg, 10000) == 0);
+
+    icsc_close(b);
+    icsc_close(sender);
+}
+
+int main() {
+    test_queue();
+    test_threadless();
+    return failures ? 1 : 0;
+}
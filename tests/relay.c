@@ -0,0 +1,106 @@
+/*
+ * Forward frames between two memory buses through a pair of gateway
+ * endpoints, and check the loop protection and route removal.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "icsc.h"
+#include "icsc_private.h"
+#include "config.h"
+#include "check.h"
+
+static volatile int received = 0;
+static volatile int lastSender = -1;
+static char lastCommand = 0;
+static char lastData[8];
+
+static void on_frame(icsc_ptr icsc, unsigned char sender, char command, unsigned char len, char *data) {
+    (void)icsc;
+    lastCommand = command;
+    memcpy(lastData, data, len < sizeof(lastData) ? len : sizeof(lastData));
+    lastSender = sender;
+    __sync_fetch_and_add(&received, 1);
+}
+
+static icsc_ptr sender;
+static volatile int sending = 1;
+
+static void *flood(void *arg) {
+    (void)arg;
+    while (sending) {
+        icsc_send_array(sender, 2, 'F', 4, "data");
+    }
+    return NULL;
+}
+
+int main() {
+    icsc_ptr gatewayA = icsc_init_transport(&icsc_transport_memory, "relay-a", B115200, 10, -1);
+    icsc_ptr gatewayB = icsc_init_transport(&icsc_transport_memory, "relay-b", B115200, 11, -1);
+    icsc_ptr target = icsc_init_transport(&icsc_transport_memory, "relay-b", B115200, 2, -1);
+    icsc_route_stats_t stats;
+    pthread_t thread;
+
+    sender = icsc_init_transport(&icsc_transport_memory, "relay-a", B115200, 1, -1);
+    CHECK(sender != NULL && gatewayA != NULL && gatewayB != NULL && target != NULL);
+
+    icsc_register_command(target, 'X', on_frame);
+    icsc_register_command(target, 'Y', on_frame);
+    icsc_register_command(target, 'F', on_frame);
+
+    CHECK(icsc_route_add(gatewayA, 2, gatewayA) == -1);
+    CHECK(icsc_route_add(gatewayA, 2, gatewayB) == 0);
+
+    // A frame for a routed station crosses over with its sender intact.
+    icsc_send_array(sender, 2, 'X', 3, "abc");
+    WAIT_FOR(received == 1, 1000);
+    CHECK(received == 1);
+    CHECK(lastSender == 1);
+    CHECK(lastCommand == 'X');
+    CHECK(memcmp(lastData, "abc", 3) == 0);
+    CHECK(icsc_route_stats(gatewayA, 2, &stats) == 0);
+    CHECK(stats.frames == 1 && stats.bytes == 3 && stats.loops == 0);
+
+    // So does an explicit relay request to the gateway.
+    icsc_send_relay(sender, 10, 2, 'Y', 2, "yz");
+    WAIT_FOR(received == 2, 1000);
+    CHECK(received == 2);
+    CHECK(lastCommand == 'Y');
+    CHECK(lastSender == 1);
+
+    // A sender that is itself routed out the same way is a loop.
+    CHECK(icsc_route_add(gatewayA, 3, gatewayB) == 0);
+    icsc_send_raw(sender, 3, 2, 'X', 1, "l");
+    usleep(50000);
+    CHECK(received == 2);
+    CHECK(icsc_route_stats(gatewayA, 2, &stats) == 0);
+    CHECK(stats.loops == 1);
+
+    // Once removed, the route forwards nothing more.
+    CHECK(icsc_route_remove(gatewayA, 3) == 0);
+    CHECK(icsc_route_remove(gatewayA, 3) == -1);
+    CHECK(icsc_route_remove(gatewayA, 2) == 0);
+    CHECK(icsc_route_stats(gatewayA, 2, &stats) == -1);
+    icsc_send_array(sender, 2, 'X', 3, "abc");
+    usleep(50000);
+    CHECK(received == 2);
+
+    // Removing a route while frames are being forwarded through it waits
+    // for them, so the egress endpoint can be closed straight after.
+    CHECK(icsc_route_add(gatewayA, 2, gatewayB) == 0);
+    pthread_create(&thread, NULL, flood, NULL);
+    WAIT_FOR(received > 10, 1000);
+    CHECK(icsc_route_remove(gatewayA, 2) == 0);
+    icsc_close(gatewayB);
+    usleep(20000);
+    sending = 0;
+    pthread_join(thread, NULL);
+
+    icsc_close(sender);
+    icsc_close(gatewayA);
+    icsc_close(target);
+    return failures ? 1 : 0;
+}
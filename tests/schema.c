@@ -0,0 +1,147 @@
+/*
+ * Check the code icsc-schema generates for tests/messages.icsc: the wire
+ * layout, unpacking, and typed handlers over a memory bus.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "icsc.h"
+#include "config.h"
+#include "check.h"
+#include "messages.h"
+
+static const messages_Sample_t sample = {
+    .channel = 7,
+    .offset = -2,
+    .value = 0x11223344,
+    .stamp = 0x0102030405060708ULL,
+    .gain = 1.5f,
+    .ratio = -0.25,
+    .taps = { -1, 0, 1 },
+};
+
+static volatile int samples = 0;
+static volatile int empties = 0;
+static messages_Sample_t received;
+static unsigned char receivedFrom;
+
+static void on_sample(icsc_ptr icsc, unsigned char from, const messages_Sample_t *m) {
+    (void)icsc;
+    received = *m;
+    receivedFrom = from;
+    __sync_fetch_and_add(&samples, 1);
+}
+
+static void on_empty(icsc_ptr icsc, unsigned char from, const messages_Empty_t *m) {
+    (void)icsc; (void)from; (void)m;
+    __sync_fetch_and_add(&empties, 1);
+}
+
+static const messages_handlers_t handlers = {
+    .Sample = on_sample,
+    .Empty = on_empty,
+};
+
+static int same_sample(const messages_Sample_t *a, const messages_Sample_t *b) {
+    return a->channel == b->channel && a->offset == b->offset && a->value == b->value &&
+        a->stamp == b->stamp && a->gain == b->gain && a->ratio == b->ratio &&
+        memcmp(a->taps, b->taps, sizeof(a->taps)) == 0;
+}
+
+static void test_layout(void) {
+    static const uint8_t expected[] = {
+        0x07,
+        0xFE, 0xFF,
+        0x44, 0x33, 0x22, 0x11,
+        0x08, 0x07, 0x06, 0x05, 0x04, 0x03, 0x02, 0x01,
+        0x00, 0x00, 0xC0, 0x3F,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xD0, 0xBF,
+        0xFF, 0x00, 0x01,
+    };
+    uint8_t buf[MESSAGES_SAMPLE_SIZE];
+    messages_Sample_t m;
+
+    CHECK(MESSAGES_SAMPLE_SIZE == sizeof(expected));
+    CHECK(MESSAGES_SAMPLE_COMMAND == 'P');
+    CHECK(MESSAGES_EMPTY_SIZE == 0);
+
+    messages_Sample_pack(buf, &sample);
+    CHECK(memcmp(buf, expected, sizeof(expected)) == 0);
+
+    CHECK(messages_Sample_get_offset((const char *)buf) == -2);
+    CHECK(messages_Sample_get_taps((const char *)buf, 0) == -1);
+    CHECK(messages_Sample_unpack((const char *)buf, sizeof(buf), &m) == 0);
+    CHECK(same_sample(&m, &sample));
+    CHECK(messages_Sample_unpack((const char *)buf, sizeof(buf) - 1, &m) == -1);
+}
+
+static void test_dispatch(void) {
+    char buf[MESSAGES_SAMPLE_SIZE + 1];
+
+    messages_Sample_pack((uint8_t *)buf, &sample);
+    CHECK(messages_dispatch(NULL, &handlers, 3, 'P', MESSAGES_SAMPLE_SIZE + 1, buf) == -1);
+    CHECK(messages_dispatch(NULL, &handlers, 3, 'Q', MESSAGES_SAMPLE_SIZE, buf) == 0);
+    CHECK(samples == 0);
+    CHECK(messages_dispatch(NULL, &handlers, 3, 'P', MESSAGES_SAMPLE_SIZE, buf) == 1);
+    CHECK(samples == 1);
+    CHECK(receivedFrom == 3);
+    CHECK(same_sample(&received, &sample));
+}
+
+static void test_bus(void) {
+    icsc_ptr a = icsc_init_transport(&icsc_transport_memory, "schema", B115200, 1, -1);
+    icsc_ptr b = icsc_init_transport(&icsc_transport_memory, "schema", B115200, 2, -1);
+    messages_Empty_t empty;
+
+    CHECK(messages_register(b, &handlers) == 0);
+    memset(&received, 0, sizeof(received));
+
+    CHECK(messages_send_Sample(a, 2, &sample) == 0);
+    CHECK(messages_send_Empty(a, 2, &empty) == 0);
+    WAIT_FOR(samples == 2 && empties == 1, 1000);
+    CHECK(samples == 2);
+    CHECK(empties == 1);
+    CHECK(receivedFrom == 1);
+    CHECK(same_sample(&received, &sample));
+
+    icsc_close(a);
+    icsc_close(b);
+}
+
+// Schemas with mistakes in them are refused.
+static void test_errors(void) {
+    char path[] = "/tmp/icsc-schema-XXXXXX";
+    char cmd[256];
+    FILE *f;
+    int fd;
+
+    fd = mkstemp(path);
+    CHECK(fd >= 0);
+    f = fdopen(fd, "w");
+    fprintf(f, "message A = 'A' { uint8 x; }\nmessage B = 'A' { uint8 y; }\n");
+    fclose(f);
+    snprintf(cmd, sizeof(cmd), "%s -o /dev/null %s 2>/dev/null", ICSC_SCHEMA, path);
+    CHECK(system(cmd) != 0);
+
+    f = fopen(path, "w");
+    fprintf(f, "message A = 'A' { uint8 x[256]; }\n");
+    fclose(f);
+    CHECK(system(cmd) != 0);
+
+    f = fopen(path, "w");
+    fprintf(f, "message A = 'A' { uint8 x[255]; }\n");
+    fclose(f);
+    CHECK(system(cmd) == 0);
+
+    unlink(path);
+}
+
+int main() {
+    test_layout();
+    test_dispatch();
+    test_bus();
+    test_errors();
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,62 @@
+/*
+ * Query the status of stations on a memory bus and check the blocks that
+ * come back, including the application extension.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "icsc.h"
+#include "config.h"
+#include "check.h"
+
+static volatile int seen = 0;
+
+static void on_data(icsc_ptr icsc, unsigned char sender, char command, unsigned char len, char *data) {
+    (void)icsc; (void)sender; (void)command; (void)len; (void)data;
+    __sync_fetch_and_add(&seen, 1);
+}
+
+int main() {
+    icsc_ptr a = icsc_init_transport(&icsc_transport_memory, "status", B115200, 4, -1);
+    icsc_ptr b = icsc_init_transport(&icsc_transport_memory, "status", B115200, 5, -1);
+    icsc_ptr c = icsc_init_transport(&icsc_transport_memory, "status", B115200, 6, -1);
+    uint8_t stations[3] = { 5, 9, 6 };
+    icsc_status_t results[3];
+    icsc_stats_t stats;
+    char ext[ICSC_STATUS_EXT_MAX + 1];
+
+    CHECK(a != NULL && b != NULL && c != NULL);
+    icsc_register_command(b, 'D', on_data);
+
+    memset(ext, 'x', sizeof(ext));
+    CHECK(icsc_set_status_ext(b, ext, ICSC_STATUS_EXT_MAX + 1) == -1);
+    CHECK(icsc_set_status_ext(b, "hello", 5) == 0);
+
+    icsc_send_array(a, 5, 'D', 4, "data");
+    icsc_send_array(a, 5, 'D', 4, "data");
+    WAIT_FOR(seen == 2, 1000);
+    CHECK(seen == 2);
+
+    // Every station that is there answers, in the order asked, and the
+    // missing one is marked as such.
+    CHECK(icsc_query_status(a, stations, 3, results, 100000) == 2);
+    CHECK(results[0].station == 5 && results[0].version == ICSC_STATUS_VERSION);
+    CHECK(results[0].rxFrames >= 2);
+    CHECK(results[0].extLen == 5 && memcmp(results[0].ext, "hello", 5) == 0);
+    CHECK(results[1].station == 9 && results[1].version == 0);
+    CHECK(results[2].station == 6 && results[2].version == ICSC_STATUS_VERSION);
+    CHECK(results[2].extLen == 0);
+
+    // The answer is counted as a frame sent.
+    CHECK(icsc_get_stats(b, &stats) == 0);
+    CHECK(stats.txFrames == results[0].txFrames + 1);
+    CHECK(stats.checksumErrors == 0);
+    CHECK(icsc_get_stats(NULL, &stats) == -1);
+
+    icsc_close(a);
+    icsc_close(b);
+    icsc_close(c);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,111 @@
+/*
+ * Run a TDMA master and two slotted stations on a memory bus, and check
+ * that the stations follow the sync and only send in their own slots.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "icsc.h"
+#include "icsc_private.h"
+#include "config.h"
+#include "check.h"
+
+#define SLOTS 3
+#define FRAMES 3
+
+static uint64_t arrivals[2][FRAMES];
+static volatile int received[2];
+
+static void on_frame(icsc_ptr icsc, unsigned char sender, char command, unsigned char len, char *data) {
+    int from = (sender == 5) ? 0 : 1;
+
+    (void)icsc; (void)command; (void)len; (void)data;
+    if (received[from] < FRAMES) {
+        arrivals[from][received[from]] = icsc_micros();
+    }
+    received[from]++;
+}
+
+static void *send_frames(void *arg) {
+    icsc_ptr icsc = (icsc_ptr)arg;
+    int i;
+
+    for (i = 0; i < FRAMES; i++) {
+        CHECK(icsc_send_array(icsc, 7, 'T', 8, "12345678") == 0);
+    }
+    return NULL;
+}
+
+// At 9600 baud a slot is about 20 ms, so the timing checks have room for a
+// loaded machine even though the memory bus itself is instant.
+int main() {
+    icsc_ptr master = icsc_init_transport(&icsc_transport_memory, "tdma", B9600, 4, -1);
+    icsc_ptr b = icsc_init_transport(&icsc_transport_memory, "tdma", B9600, 5, -1);
+    icsc_ptr c = icsc_init_transport(&icsc_transport_memory, "tdma", B9600, 6, -1);
+    icsc_ptr r = icsc_init_transport(&icsc_transport_memory, "tdma", B9600, 7, -1);
+    uint64_t slotTime = icsc_frame_time(master, 8) + ICSC_TURNAROUND_TIME;
+    uint64_t cycleTime = icsc_frame_time(master, 17) + ICSC_TURNAROUND_TIME + SLOTS * slotTime;
+    char big[32];
+    pthread_t threads[2];
+    uint32_t cycle;
+    uint32_t masterCycle;
+    int64_t diff;
+    int i;
+
+    CHECK(master != NULL && b != NULL && c != NULL && r != NULL);
+    icsc_register_command(r, 'T', on_frame);
+
+    CHECK(icsc_tdma_master(master, 0, 8) == -1);
+    CHECK(icsc_tdma_slot(b, 1) == 0);
+    CHECK(icsc_tdma_slot(c, 2) == 0);
+    CHECK(icsc_tdma_time(b, &cycle, NULL) == -1);
+
+    // The stations pick up the cycle from the master's sync.
+    CHECK(icsc_tdma_master(master, SLOTS, 8) == 0);
+    CHECK(icsc_tdma_master(master, SLOTS, 8) == -1);
+    WAIT_FOR(icsc_tdma_time(b, &cycle, NULL) == 0 && icsc_tdma_time(c, NULL, NULL) == 0, 1000);
+    CHECK(icsc_tdma_time(b, &cycle, NULL) == 0);
+    CHECK(icsc_tdma_time(master, &masterCycle, NULL) == 0);
+    CHECK(masterCycle - cycle <= 1);
+
+    // Frames wait for their slot, so each station gets one frame of this
+    // size out per cycle, and the two stations never share a slot.
+    pthread_create(&threads[0], NULL, send_frames, b);
+    pthread_create(&threads[1], NULL, send_frames, c);
+    pthread_join(threads[0], NULL);
+    pthread_join(threads[1], NULL);
+    WAIT_FOR(received[0] == FRAMES && received[1] == FRAMES, 1000);
+    CHECK(received[0] == FRAMES && received[1] == FRAMES);
+    for (i = 1; i < FRAMES; i++) {
+        CHECK(arrivals[0][i] - arrivals[0][i - 1] >= cycleTime - slotTime);
+        CHECK(arrivals[1][i] - arrivals[1][i - 1] >= cycleTime - slotTime);
+    }
+    for (i = 0; i < FRAMES; i++) {
+        diff = (int64_t)(arrivals[1][i] - arrivals[0][i]);
+        CHECK(llabs(diff) >= (int64_t)slotTime / 4);
+    }
+
+    // A frame longer than a slot is refused.
+    memset(big, 'x', sizeof(big));
+    CHECK(icsc_send_array(b, 7, 'T', sizeof(big), big) == -1);
+
+    // Without the sync the stations lose the cycle.
+    CHECK(icsc_tdma_stop(master) == 0);
+    WAIT_FOR(icsc_tdma_time(b, NULL, NULL) == -1, 1000);
+    CHECK(icsc_tdma_time(b, NULL, NULL) == -1);
+
+    // A station without a slot sends straight away.
+    CHECK(icsc_tdma_slot(b, -1) == 0);
+    CHECK(icsc_send_array(b, 7, 'T', 8, "12345678") == 0);
+    WAIT_FOR(received[0] == FRAMES + 1, 1000);
+    CHECK(received[0] == FRAMES + 1);
+
+    icsc_close(master);
+    icsc_close(b);
+    icsc_close(c);
+    icsc_close(r);
+    return failures ? 1 : 0;
+}
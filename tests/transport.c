@@ -0,0 +1,162 @@
+/*
+ * Run contexts over a transport defined here, on a socket pair, and over
+ * the memory bus, and check that frames get through both ways.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "icsc.h"
+#include "config.h"
+#include "check.h"
+
+static int pair[2] = { -1, -1 };
+static int opened = 0;
+static int closed = 0;
+
+static volatile int receivedA = 0;
+static volatile int receivedB = 0;
+static volatile int receivedC = 0;
+static volatile int lastSender = -1;
+
+// Path "0" and "1" are the two ends of the pair.
+static void *pair_open(const char *path, unsigned long baud) {
+    int *fd;
+
+    (void)baud;
+    if (pair[0] < 0 && socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0) {
+        fprintf(stderr, "Cannot create socket pair: %s\n", strerror(errno));
+        return NULL;
+    }
+    fd = &pair[path[0] == '1'];
+    opened++;
+    return fd;
+}
+
+static ssize_t pair_read(void *data, uint8_t *buf, size_t len) {
+    ssize_t rc = recv(*(int *)data, buf, len, MSG_DONTWAIT);
+
+    if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return 0;
+    }
+    return rc;
+}
+
+static ssize_t pair_write(void *data, const uint8_t *buf, size_t len) {
+    return send(*(int *)data, buf, len, MSG_NOSIGNAL);
+}
+
+static int pair_drain(void *data) {
+    (void)data;
+    return 0;
+}
+
+static int pair_wait(void *data, unsigned long timeout) {
+    struct pollfd pfd = { *(int *)data, POLLIN, 0 };
+    int rc = poll(&pfd, 1, timeout / 1000);
+
+    return rc < 0 ? -1 : rc > 0;
+}
+
+static void pair_close(void *data) {
+    close(*(int *)data);
+    *(int *)data = -1;
+    closed++;
+}
+
+static int pair_fd(void *data) {
+    return *(int *)data;
+}
+
+static const icsc_transport_t pairTransport = {
+    "pair", pair_open, pair_read, pair_write, pair_drain, pair_wait, pair_close, NULL, NULL, pair_fd, NULL
+};
+
+static void on_a(icsc_ptr icsc, unsigned char sender, char command, unsigned char len, char *data) {
+    (void)icsc; (void)command; (void)len; (void)data;
+    lastSender = sender;
+    __sync_fetch_and_add(&receivedA, 1);
+}
+
+static void on_b(icsc_ptr icsc, unsigned char sender, char command, unsigned char len, char *data) {
+    (void)icsc; (void)command; (void)len; (void)data;
+    lastSender = sender;
+    __sync_fetch_and_add(&receivedB, 1);
+}
+
+static void on_c(icsc_ptr icsc, unsigned char sender, char command, unsigned char len, char *data) {
+    (void)icsc; (void)sender; (void)command; (void)len; (void)data;
+    __sync_fetch_and_add(&receivedC, 1);
+}
+
+static void test_pair(void) {
+    icsc_ptr a = icsc_init_transport(&pairTransport, "0", B115200, 4, -1);
+    icsc_ptr b = icsc_init_transport(&pairTransport, "1", B115200, 5, -1);
+    short events = 0;
+
+    CHECK(a != NULL && b != NULL);
+    CHECK(opened == 2);
+    CHECK(icsc_get_fd(a, &events) == pair[0]);
+    CHECK(events == POLLIN);
+
+    icsc_register_command(a, 'A', on_a);
+    icsc_register_command(b, 'B', on_b);
+
+    icsc_send_array(a, 5, 'B', 3, "abc");
+    WAIT_FOR(receivedB == 1, 1000);
+    CHECK(receivedB == 1);
+    CHECK(lastSender == 4);
+
+    icsc_send_array(b, 4, 'A', 3, "abc");
+    WAIT_FOR(receivedA == 1, 1000);
+    CHECK(receivedA == 1);
+    CHECK(lastSender == 5);
+
+    icsc_close(a);
+    icsc_close(b);
+    CHECK(closed == 2);
+}
+
+static void test_memory(void) {
+    icsc_ptr a = icsc_init_transport(&icsc_transport_memory, "transport", B115200, 4, -1);
+    icsc_ptr b = icsc_init_transport(&icsc_transport_memory, "transport", B115200, 5, -1);
+    icsc_ptr c = icsc_init_transport(&icsc_transport_memory, "transport", B115200, 6, -1);
+    icsc_ptr other = icsc_init_transport(&icsc_transport_memory, "transport-other", B115200, 5, -1);
+
+    CHECK(a != NULL && b != NULL && c != NULL && other != NULL);
+
+    receivedA = receivedB = 0;
+    icsc_register_command(a, 'A', on_a);
+    icsc_register_command(b, 'B', on_b);
+    icsc_register_command(c, 'B', on_c);
+    icsc_register_command(other, 'B', on_c);
+
+    // Every context on the bus hears a frame but only its station takes it,
+    // and a bus of another name hears nothing.
+    icsc_send_array(a, 5, 'B', 3, "abc");
+    WAIT_FOR(receivedB == 1, 1000);
+    usleep(20000);
+    CHECK(receivedB == 1);
+    CHECK(receivedC == 0);
+
+    // The sender does not hear itself.
+    icsc_send_array(a, 4, 'A', 3, "abc");
+    usleep(20000);
+    CHECK(receivedA == 0);
+
+    icsc_close(a);
+    icsc_close(b);
+    icsc_close(c);
+    icsc_close(other);
+}
+
+int main() {
+    test_pair();
+    test_memory();
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,92 @@
+/*
+ * Let one context answer for several station numbers on a memory bus and
+ * check that frames, pings, status queries and replies use the right one.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "icsc.h"
+#include "config.h"
+#include "check.h"
+
+static volatile int received = 0;
+static volatile int lastStation = -1;
+static volatile int lastSender = -1;
+static volatile int replies = 0;
+
+static void on_frame(icsc_ptr icsc, unsigned char station, unsigned char sender, char command, unsigned char len, char *data, void *arg) {
+    (void)icsc; (void)sender; (void)command; (void)len; (void)data; (void)arg;
+    lastStation = station;
+    __sync_fetch_and_add(&received, 1);
+}
+
+static void on_reply(icsc_ptr icsc, unsigned char sender, char command, unsigned char len, char *data) {
+    (void)icsc; (void)command; (void)len; (void)data;
+    lastSender = sender;
+    __sync_fetch_and_add(&replies, 1);
+}
+
+// The slow baud rate only lengthens the wait for pings.
+int main() {
+    icsc_ptr a = icsc_init_transport(&icsc_transport_memory, "virtual", B9600, 4, -1);
+    icsc_ptr v = icsc_init_transport(&icsc_transport_memory, "virtual", B9600, 10, -1);
+    icsc_station_info_t table[8];
+    icsc_status_t status;
+    uint8_t stations[32];
+    uint8_t station = 21;
+    int count;
+
+    CHECK(a != NULL && v != NULL);
+    icsc_register_command_station(v, 'X', on_frame, NULL);
+    icsc_register_command(a, 'R', on_reply);
+
+    CHECK(icsc_claim_station(v, ICSC_BROADCAST) == -1);
+    CHECK(icsc_claim_station(v, ICSC_GROUP_FIRST) == -1);
+    CHECK(icsc_claim_station(v, 20) == 0);
+    CHECK(icsc_claim_station(v, 21) == 0);
+
+    // Frames for each claimed station arrive, and say which they were for.
+    icsc_send_array(a, 20, 'X', 1, "x");
+    WAIT_FOR(received == 1, 1000);
+    CHECK(received == 1 && lastStation == 20);
+    icsc_send_array(a, 10, 'X', 1, "x");
+    WAIT_FOR(received == 2, 1000);
+    CHECK(received == 2 && lastStation == 10);
+
+    // Every station it stands in for answers pings and status queries.
+    count = icsc_discover(a, 9, 22, ICSC_DISCOVER_PIPELINE, table, 8);
+    CHECK(count == 3);
+    CHECK(count == 3 && table[0].station == 10 && table[1].station == 20 && table[2].station == 21);
+    CHECK(icsc_query_status(a, &station, 1, &status, 100000) == 1);
+    CHECK(status.station == 21);
+
+    // Replies can come from a claimed station, but not an unclaimed one.
+    CHECK(icsc_send_array_from(v, 21, 4, 'R', 1, "r") == 0);
+    WAIT_FOR(replies == 1, 1000);
+    CHECK(replies == 1 && lastSender == 21);
+    CHECK(icsc_send_array_from(v, 22, 4, 'R', 1, "r") == -1);
+
+    // Released stations go quiet; the context's own cannot be released.
+    CHECK(icsc_release_station(v, 21) == 0);
+    CHECK(icsc_release_station(v, 10) == -1);
+    icsc_send_array(a, 21, 'X', 1, "x");
+    usleep(20000);
+    CHECK(received == 2);
+
+    // Setting the whole map replaces the claims, but never the own station.
+    memset(stations, 0, sizeof(stations));
+    stations[30 >> 3] |= 1 << (30 & 7);
+    CHECK(icsc_set_stations(v, stations) == 0);
+    icsc_send_array(a, 20, 'X', 1, "x");
+    icsc_send_array(a, 30, 'X', 1, "x");
+    icsc_send_array(a, 10, 'X', 1, "x");
+    WAIT_FOR(received == 4, 1000);
+    usleep(20000);
+    CHECK(received == 4 && lastStation == 10);
+
+    icsc_close(a);
+    icsc_close(v);
+    return failures ? 1 : 0;
+}
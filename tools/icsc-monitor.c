@@ -0,0 +1,302 @@
+/*
+ * icsc-monitor - decode the traffic on an ICSC bus.
+ *
+ * The bus is opened in passive promiscuous mode, so the monitor sees every
+ * frame whoever it is addressed to, and never transmits. Each frame can be
+ * printed as it arrives, and a table of per-station frame rates and errors
+ * is printed at an interval and on exit. It can also watch a bus shared by
+ * icscd instead of opening the UART itself.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <ctype.h>
+#include <time.h>
+
+#include "icsc.h"
+#include "config.h"
+
+#define MAP_SET(map, n) ((map)[(n) >> 3] |= (1 << ((n) & 7)))
+#define MAP_BIT(map, n) ((map)[(n) >> 3] & (1 << ((n) & 7)))
+
+typedef struct {
+    unsigned long frames;
+    unsigned long bytes;
+    unsigned long checksumErrors;
+    unsigned long framingErrors;
+    unsigned long timeouts;
+} station_stats_t;
+
+static uint8_t stationFilter[32];
+static uint8_t commandFilter[32];
+static int filterStations = 0;
+static int filterCommands = 0;
+static int quiet = 0;
+static int hexOnly = 0;
+
+// Written by the read thread, read and cleared by the main thread. A
+// summary taken mid-update is off by at most a frame.
+static station_stats_t stats[256];
+static uint64_t firstFrame = 0;
+
+static volatile sig_atomic_t running = 1;
+
+static void stop(int sig) {
+    (void)sig;
+    running = 0;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "Usage: %s (-d <device> [-b <baud>] | -S <socket>) [-s <stations>] [-c <commands>] [-i <seconds>] [-q] [-x] [-v]\n", name);
+    fprintf(stderr, "  -d  Serial device that the bus is connected to\n");
+    fprintf(stderr, "  -b  Baud rate (default 115200)\n");
+    fprintf(stderr, "  -S  Watch the bus shared by the icscd listening on this socket\n");
+    fprintf(stderr, "  -s  Only show frames to or from these stations (e.g. 1,5-9)\n");
+    fprintf(stderr, "  -c  Only show these commands (characters, or numbers with 0x)\n");
+    fprintf(stderr, "  -i  Print a summary every this many seconds (default only on exit)\n");
+    fprintf(stderr, "  -q  Do not print each frame\n");
+    fprintf(stderr, "  -x  Print payloads in hex only\n");
+    fprintf(stderr, "  -v  Enable debug messages\n");
+}
+
+// Parse a list like "1,5-9,200" into a station map.
+static int parse_stations(const char *list) {
+    char *end;
+    long first;
+    long last;
+    long i;
+
+    while (*list) {
+        first = strtol(list, &end, 0);
+        last = first;
+        if (*end == '-') {
+            last = strtol(end + 1, &end, 0);
+        }
+        if (end == list || first < 0 || last > 255 || last < first || (*end != ',' && *end != 0)) {
+            return -1;
+        }
+        for (i = first; i <= last; i++) {
+            MAP_SET(stationFilter, i);
+        }
+        list = (*end == ',') ? end + 1 : end;
+    }
+    return 0;
+}
+
+// Parse a list like "T,H,0x1f" into a command map.
+static int parse_commands(const char *list) {
+    char *end;
+    long command;
+
+    while (*list) {
+        if (list[0] == '0' && list[1] == 'x') {
+            command = strtol(list, &end, 16);
+            if (end == list + 2 || command > 255) {
+                return -1;
+            }
+        } else {
+            command = (uint8_t)*list;
+            end = (char *)list + 1;
+        }
+        if (*end != ',' && *end != 0) {
+            return -1;
+        }
+        MAP_SET(commandFilter, command);
+        list = (*end == ',') ? end + 1 : end;
+    }
+    return 0;
+}
+
+static const char *status_name(int status) {
+    switch (status) {
+        case ICSC_MONITOR_CHECKSUM: return "bad checksum";
+        case ICSC_MONITOR_FRAMING: return "framing error";
+        case ICSC_MONITOR_TIMEOUT: return "timed out";
+    }
+    return "ok";
+}
+
+static void print_frame(const icsc_monitor_frame_t *frame) {
+    uint8_t command = frame->command;
+    int printable = 1;
+    int i;
+
+    printf("%10.6f %3d -> %3d ", (frame->when - firstFrame) / 1000000.0, frame->sender, frame->station);
+    if (isprint(command)) {
+        printf("'%c' ", command);
+    } else {
+        printf("0x%02x", command);
+    }
+    printf(" %3d", frame->len);
+
+    if (frame->status != ICSC_MONITOR_OK) {
+        printf(" %s\n", status_name(frame->status));
+        return;
+    }
+
+    for (i = 0; i < frame->len; i++) {
+        printf(" %02x", (uint8_t)frame->data[i]);
+        if (!isprint((uint8_t)frame->data[i])) {
+            printable = 0;
+        }
+    }
+    if (printable && frame->len > 0 && !hexOnly) {
+        printf("  \"%.*s\"", frame->len, frame->data);
+    }
+    printf("\n");
+}
+
+static void monitor(icsc_ptr icsc, const icsc_monitor_frame_t *frame, void *arg) {
+    station_stats_t *s = &stats[frame->sender];
+
+    (void)icsc;
+    (void)arg;
+
+    if (filterStations && !MAP_BIT(stationFilter, frame->sender) && !MAP_BIT(stationFilter, frame->station)) {
+        return;
+    }
+    if (filterCommands && !MAP_BIT(commandFilter, (uint8_t)frame->command)) {
+        return;
+    }
+
+    if (firstFrame == 0) {
+        firstFrame = frame->when;
+    }
+
+    switch (frame->status) {
+        case ICSC_MONITOR_OK:
+            s->frames++;
+            s->bytes += frame->len;
+            break;
+        case ICSC_MONITOR_CHECKSUM:
+            s->checksumErrors++;
+            break;
+        case ICSC_MONITOR_FRAMING:
+            s->framingErrors++;
+            break;
+        case ICSC_MONITOR_TIMEOUT:
+            s->timeouts++;
+            break;
+    }
+
+    if (!quiet) {
+        print_frame(frame);
+    }
+}
+
+static void print_summary(double seconds) {
+    station_stats_t s;
+    int i;
+
+    printf("\nStation   Frames   Frames/s    Bytes/s  Checksum  Framing  Timeout\n");
+    for (i = 0; i < 256; i++) {
+        s = stats[i];
+        if (s.frames == 0 && s.checksumErrors == 0 && s.framingErrors == 0 && s.timeouts == 0) {
+            continue;
+        }
+        printf("%7d %8lu %10.1f %10.1f %9lu %8lu %8lu\n", i, s.frames,
+            s.frames / seconds, s.bytes / seconds,
+            s.checksumErrors, s.framingErrors, s.timeouts);
+    }
+    printf("\n");
+    fflush(stdout);
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+int main(int argc, char **argv) {
+    const char *device = NULL;
+    const char *path = NULL;
+    unsigned long baud = 115200;
+    unsigned long interval = 0;
+    uint8_t all[32];
+    icsc_ptr icsc;
+    double start;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:b:S:s:c:i:qxv")) != -1) {
+        switch (opt) {
+            case 'd': device = optarg; break;
+            case 'b': baud = strtoul(optarg, NULL, 10); break;
+            case 'S': path = optarg; break;
+            case 's':
+                if (parse_stations(optarg) < 0) {
+                    icsc_error("Invalid station list %s\n", optarg);
+                    return 1;
+                }
+                filterStations = 1;
+                break;
+            case 'c':
+                if (parse_commands(optarg) < 0) {
+                    icsc_error("Invalid command list %s\n", optarg);
+                    return 1;
+                }
+                filterCommands = 1;
+                break;
+            case 'i': interval = strtoul(optarg, NULL, 10); break;
+            case 'q': quiet = 1; break;
+            case 'x': hexOnly = 1; break;
+            case 'v': icsc_enable_debug(); break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if ((device == NULL) == (path == NULL)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (path != NULL) {
+        icsc = icsc_connect(path, ICSC_BROADCAST);
+        if (icsc != NULL) {
+            memset(all, 0xFF, sizeof(all));
+            icsc_subscribe(icsc, all, all);
+        }
+    } else {
+        if (icsc_serial_baud_symbol(baud) == 0) {
+            icsc_error("Unsupported baud rate %lu\n", baud);
+            return 1;
+        }
+        icsc = icsc_init(device, icsc_serial_baud_symbol(baud), ICSC_BROADCAST);
+    }
+
+    if (icsc == NULL) {
+        return 1;
+    }
+
+    // Printing a line per frame must not hold up the read thread.
+    setvbuf(stdout, NULL, _IOFBF, 65536);
+
+    icsc_set_promiscuous(icsc, ICSC_PROMISCUOUS_PASSIVE);
+    icsc_set_monitor(icsc, monitor, NULL);
+
+    signal(SIGINT, stop);
+    signal(SIGTERM, stop);
+
+    start = now();
+    while (running) {
+        sleep(interval > 0 ? interval : 1);
+        if (!quiet) {
+            fflush(stdout);
+        }
+        if (interval > 0 && running) {
+            print_summary(now() - start);
+            memset(stats, 0, sizeof(stats));
+            start = now();
+        }
+    }
+
+    icsc_close(icsc);
+    print_summary(now() - start);
+    return 0;
+}
@@ -0,0 +1,588 @@
+/*
+ * icsc-schema - generate typed pack/unpack code for ICSC messages.
+ *
+ * A schema lists the messages used on a bus, the command each one is sent
+ * with and its fields:
+ *
+ *     # Comments run to the end of the line
+ *     message SetPoint = 'S' {
+ *         uint8  channel;
+ *         int32  value;
+ *         float  gain;
+ *         uint8  name[8];
+ *     }
+ *
+ * Field types are int8, uint8, int16, uint16, int32, uint32, int64, uint64,
+ * float and double, optionally as fixed length arrays. Every message has a
+ * fixed little-endian layout with no padding, whatever the compiler or CPU.
+ *
+ * The output is a single C header. For each message it provides a struct,
+ * a function that packs the struct straight into the payload of a frame
+ * buffer and sends it, accessors that decode single fields in place from a
+ * received payload, an unpack function, and a dispatcher that decodes
+ * each command and passes the message to its own handler.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "config.h"
+
+#define MAX_MESSAGES 256
+#define MAX_FIELDS 128
+#define MAX_NAME 64
+
+typedef struct {
+    const char *name;
+    const char *ctype;
+    int size;
+    char kind;  // 'u'nsigned, 's'igned or 'f'loat
+} type_t;
+
+static const type_t types[] = {
+    { "int8",   "int8_t",   1, 's' },
+    { "uint8",  "uint8_t",  1, 'u' },
+    { "int16",  "int16_t",  2, 's' },
+    { "uint16", "uint16_t", 2, 'u' },
+    { "int32",  "int32_t",  4, 's' },
+    { "uint32", "uint32_t", 4, 'u' },
+    { "int64",  "int64_t",  8, 's' },
+    { "uint64", "uint64_t", 8, 'u' },
+    { "float",  "float",    4, 'f' },
+    { "double", "double",   8, 'f' },
+    { NULL, NULL, 0, 0 }
+};
+
+typedef struct {
+    char name[MAX_NAME];
+    const type_t *type;
+    int count;      // 0 for a scalar
+    int offset;
+} field_t;
+
+typedef struct {
+    char name[MAX_NAME];
+    int command;
+    int size;
+    int nfields;
+    field_t fields[MAX_FIELDS];
+} message_t;
+
+static message_t messages[MAX_MESSAGES];
+static int nmessages = 0;
+
+static const char *source;
+static const char *filename;
+static int line = 1;
+
+static char token[MAX_NAME];
+
+static void fail(const char *msg) {
+    fprintf(stderr, "%s:%d: %s\n", filename, line, msg);
+    exit(1);
+}
+
+// Read the next token into token[]. Returns 0 at the end of the input.
+static int next_token() {
+    int len = 0;
+
+    for (;;) {
+        while (isspace((unsigned char)*source)) {
+            if (*source == '\n') {
+                line++;
+            }
+            source++;
+        }
+        if ((*source == '#') || (source[0] == '/' && source[1] == '/')) {
+            while (*source && *source != '\n') {
+                source++;
+            }
+            continue;
+        }
+        break;
+    }
+
+    if (*source == 0) {
+        token[0] = 0;
+        return 0;
+    }
+
+    if (*source == '\'') {
+        // Character literal, returned with its quotes.
+        token[len++] = *source++;
+        if (*source == '\\') {
+            token[len++] = *source++;
+        }
+        if (*source == 0) {
+            fail("unterminated character literal");
+        }
+        token[len++] = *source++;
+        if (*source != '\'') {
+            fail("unterminated character literal");
+        }
+        token[len++] = *source++;
+        token[len] = 0;
+        return 1;
+    }
+
+    if (isalnum((unsigned char)*source) || *source == '_') {
+        while (isalnum((unsigned char)*source) || *source == '_') {
+            if (len == MAX_NAME - 1) {
+                fail("name too long");
+            }
+            token[len++] = *source++;
+        }
+        token[len] = 0;
+        return 1;
+    }
+
+    token[0] = *source++;
+    token[1] = 0;
+    return 1;
+}
+
+static void expect(const char *what) {
+    char msg[128];
+    if (!next_token() || strcmp(token, what) != 0) {
+        snprintf(msg, sizeof(msg), "expected '%s' but found '%s'", what, token);
+        fail(msg);
+    }
+}
+
+static void expect_name(char *dest) {
+    char msg[128];
+    if (!next_token() || !(isalpha((unsigned char)token[0]) || token[0] == '_')) {
+        snprintf(msg, sizeof(msg), "expected a name but found '%s'", token);
+        fail(msg);
+    }
+    strcpy(dest, token);
+}
+
+static long parse_number(const char *text) {
+    char *end;
+    long value;
+
+    errno = 0;
+    value = strtol(text, &end, 0);
+    if (errno != 0 || *end != 0) {
+        fail("bad number");
+    }
+    return value;
+}
+
+static int parse_command(const char *text) {
+    if (text[0] == '\'') {
+        if (text[1] != '\\') {
+            return (unsigned char)text[1];
+        }
+        switch (text[2]) {
+            case 'n': return '\n';
+            case 'r': return '\r';
+            case 't': return '\t';
+            case '0': return 0;
+            default: return (unsigned char)text[2];
+        }
+    }
+    return parse_number(text);
+}
+
+static void parse_field(message_t *msg) {
+    field_t *field;
+    char msg_text[128];
+    int i;
+
+    if (msg->nfields == MAX_FIELDS) {
+        fail("too many fields");
+    }
+    field = &msg->fields[msg->nfields];
+
+    for (i = 0; types[i].name; i++) {
+        if (strcmp(types[i].name, token) == 0) {
+            break;
+        }
+    }
+    if (types[i].name == NULL) {
+        snprintf(msg_text, sizeof(msg_text), "unknown type '%s'", token);
+        fail(msg_text);
+    }
+    field->type = &types[i];
+
+    expect_name(field->name);
+    for (i = 0; i < msg->nfields; i++) {
+        if (strcmp(msg->fields[i].name, field->name) == 0) {
+            fail("duplicate field name");
+        }
+    }
+
+    next_token();
+    if (strcmp(token, "[") == 0) {
+        next_token();
+        field->count = parse_number(token);
+        if (field->count < 1) {
+            fail("array length must be at least 1");
+        }
+        expect("]");
+        next_token();
+    }
+    if (strcmp(token, ";") != 0) {
+        fail("expected ';' after field");
+    }
+
+    field->offset = msg->size;
+    msg->size += field->type->size * (field->count ? field->count : 1);
+    if (msg->size > 255) {
+        fail("message is longer than 255 bytes");
+    }
+    msg->nfields++;
+}
+
+static void parse() {
+    message_t *msg;
+    int i;
+
+    while (next_token()) {
+        if (strcmp(token, "message") != 0) {
+            fail("expected 'message'");
+        }
+        if (nmessages == MAX_MESSAGES) {
+            fail("too many messages");
+        }
+        msg = &messages[nmessages];
+
+        expect_name(msg->name);
+        expect("=");
+        next_token();
+        msg->command = parse_command(token);
+        if (msg->command < 0 || msg->command > 255) {
+            fail("command must fit in one byte");
+        }
+
+        for (i = 0; i < nmessages; i++) {
+            if (strcmp(messages[i].name, msg->name) == 0) {
+                fail("duplicate message name");
+            }
+            if (messages[i].command == msg->command) {
+                fail("duplicate command");
+            }
+        }
+
+        expect("{");
+        while (next_token() && strcmp(token, "}") != 0) {
+            parse_field(msg);
+        }
+        if (strcmp(token, "}") != 0) {
+            fail("unterminated message");
+        }
+
+        nmessages++;
+    }
+}
+
+static void upper(char *dest, const char *src) {
+    while (*src) {
+        *dest++ = toupper((unsigned char)*src++);
+    }
+    *dest = 0;
+}
+
+// Expression that encodes value (of the field's type) at p.
+static void emit_put(FILE *out, const field_t *f, const char *p, const char *value) {
+    int bits = f->type->size * 8;
+
+    if (f->type->kind == 'f') {
+        fprintf(out, "icsc_schema_put%df(%s, %s);", bits, p, value);
+    } else {
+        fprintf(out, "icsc_schema_put%d(%s, (uint%d_t)%s);", bits, p, bits, value);
+    }
+}
+
+static void emit_get(FILE *out, const field_t *f, const char *p) {
+    int bits = f->type->size * 8;
+
+    if (f->type->kind == 'f') {
+        fprintf(out, "icsc_schema_get%df(%s)", bits, p);
+    } else {
+        fprintf(out, "(%s)icsc_schema_get%d(%s)", f->type->ctype, bits, p);
+    }
+}
+
+static void emit_helpers(FILE *out) {
+    fprintf(out,
+        "#ifndef ICSC_SCHEMA_HELPERS\n"
+        "#define ICSC_SCHEMA_HELPERS\n"
+        "static inline void icsc_schema_put8(uint8_t *p, uint8_t v) { p[0] = v; }\n"
+        "static inline void icsc_schema_put16(uint8_t *p, uint16_t v) { p[0] = v; p[1] = v >> 8; }\n"
+        "static inline void icsc_schema_put32(uint8_t *p, uint32_t v) { icsc_schema_put16(p, v); icsc_schema_put16(p + 2, v >> 16); }\n"
+        "static inline void icsc_schema_put64(uint8_t *p, uint64_t v) { icsc_schema_put32(p, v); icsc_schema_put32(p + 4, v >> 32); }\n"
+        "static inline void icsc_schema_put32f(uint8_t *p, float v) { uint32_t u; memcpy(&u, &v, 4); icsc_schema_put32(p, u); }\n"
+        "static inline void icsc_schema_put64f(uint8_t *p, double v) { uint64_t u; memcpy(&u, &v, 8); icsc_schema_put64(p, u); }\n"
+        "static inline uint8_t icsc_schema_get8(const char *p) { return (uint8_t)p[0]; }\n"
+        "static inline uint16_t icsc_schema_get16(const char *p) { return (uint16_t)(uint8_t)p[0] | (uint16_t)(uint8_t)p[1] << 8; }\n"
+        "static inline uint32_t icsc_schema_get32(const char *p) { return (uint32_t)icsc_schema_get16(p) | (uint32_t)icsc_schema_get16(p + 2) << 16; }\n"
+        "static inline uint64_t icsc_schema_get64(const char *p) { return (uint64_t)icsc_schema_get32(p) | (uint64_t)icsc_schema_get32(p + 4) << 32; }\n"
+        "static inline float icsc_schema_get32f(const char *p) { uint32_t u = icsc_schema_get32(p); float v; memcpy(&v, &u, 4); return v; }\n"
+        "static inline double icsc_schema_get64f(const char *p) { uint64_t u = icsc_schema_get64(p); double v; memcpy(&v, &u, 8); return v; }\n"
+        "#endif\n\n");
+}
+
+static void emit_message(FILE *out, const char *prefix, const char *uprefix, const message_t *msg) {
+    char uname[MAX_NAME];
+    char expr[MAX_NAME * 2 + 32];
+    char ptr[64];
+    const field_t *f;
+    int i;
+
+    upper(uname, msg->name);
+
+    fprintf(out, "/* %s */\n\n", msg->name);
+    fprintf(out, "#define %s_%s_COMMAND 0x%02X\n", uprefix, uname, msg->command);
+    fprintf(out, "#define %s_%s_SIZE %d\n\n", uprefix, uname, msg->size);
+
+    fprintf(out, "typedef struct {\n");
+    for (i = 0; i < msg->nfields; i++) {
+        f = &msg->fields[i];
+        if (f->count) {
+            fprintf(out, "    %s %s[%d];\n", f->type->ctype, f->name, f->count);
+        } else {
+            fprintf(out, "    %s %s;\n", f->type->ctype, f->name);
+        }
+    }
+    if (msg->nfields == 0) {
+        fprintf(out, "    char unused;\n");
+    }
+    fprintf(out, "} %s_%s_t;\n\n", prefix, msg->name);
+
+    // Accessors that read a field in place from a received payload.
+    for (i = 0; i < msg->nfields; i++) {
+        f = &msg->fields[i];
+        if (f->count) {
+            fprintf(out, "static inline %s %s_%s_get_%s(const char *data, int i) {\n    return ",
+                f->type->ctype, prefix, msg->name, f->name);
+            snprintf(ptr, sizeof(ptr), "data + %d + i * %d", f->offset, f->type->size);
+        } else {
+            fprintf(out, "static inline %s %s_%s_get_%s(const char *data) {\n    return ",
+                f->type->ctype, prefix, msg->name, f->name);
+            snprintf(ptr, sizeof(ptr), "data + %d", f->offset);
+        }
+        emit_get(out, f, ptr);
+        fprintf(out, ";\n}\n\n");
+    }
+
+    // Pack into a payload buffer.
+    fprintf(out, "static inline void %s_%s_pack(uint8_t *buf, const %s_%s_t *m) {\n",
+        prefix, msg->name, prefix, msg->name);
+    if (msg->nfields == 0) {
+        fprintf(out, "    (void)buf;\n    (void)m;\n");
+    }
+    for (i = 0; i < msg->nfields; i++) {
+        f = &msg->fields[i];
+        if (f->count) {
+            fprintf(out, "    for (int i = 0; i < %d; i++) {\n        ", f->count);
+            snprintf(ptr, sizeof(ptr), "buf + %d + i * %d", f->offset, f->type->size);
+            snprintf(expr, sizeof(expr), "m->%s[i]", f->name);
+            emit_put(out, f, ptr, expr);
+            fprintf(out, "\n    }\n");
+        } else {
+            fprintf(out, "    ");
+            snprintf(ptr, sizeof(ptr), "buf + %d", f->offset);
+            snprintf(expr, sizeof(expr), "m->%s", f->name);
+            emit_put(out, f, ptr, expr);
+            fprintf(out, "\n");
+        }
+    }
+    fprintf(out, "}\n\n");
+
+    // Unpack a whole payload.
+    fprintf(out, "static inline int %s_%s_unpack(const char *data, uint8_t len, %s_%s_t *m) {\n",
+        prefix, msg->name, prefix, msg->name);
+    fprintf(out, "    if (len != %s_%s_SIZE) {\n        return -1;\n    }\n", uprefix, uname);
+    if (msg->nfields == 0) {
+        fprintf(out, "    (void)data;\n    (void)m;\n");
+    }
+    for (i = 0; i < msg->nfields; i++) {
+        f = &msg->fields[i];
+        if (f->count) {
+            fprintf(out, "    for (int i = 0; i < %d; i++) {\n        m->%s[i] = %s_%s_get_%s(data, i);\n    }\n",
+                f->count, f->name, prefix, msg->name, f->name);
+        } else {
+            fprintf(out, "    m->%s = %s_%s_get_%s(data);\n", f->name, prefix, msg->name, f->name);
+        }
+    }
+    fprintf(out, "    return 0;\n}\n\n");
+
+    // Pack straight into a frame buffer and send it.
+    fprintf(out, "static inline int %s_send_%s(icsc_ptr icsc, uint8_t station, const %s_%s_t *m) {\n",
+        prefix, msg->name, prefix, msg->name);
+    fprintf(out, "    icsc_frame_t frame;\n");
+    fprintf(out, "    %s_%s_pack(ICSC_FRAME_PAYLOAD(&frame), m);\n", prefix, msg->name);
+    fprintf(out, "    return icsc_send_frame(icsc, &frame, station, %s_%s_COMMAND, %s_%s_SIZE);\n}\n\n",
+        uprefix, uname, uprefix, uname);
+}
+
+static void emit_dispatch(FILE *out, const char *prefix, const char *uprefix) {
+    char uname[MAX_NAME];
+    int i;
+
+    fprintf(out, "/* Dispatch */\n\n");
+    fprintf(out, "/* A handler receives the decoded message, which is only valid until the\n"
+                 " * handler returns. */\n");
+    fprintf(out, "typedef struct {\n");
+    for (i = 0; i < nmessages; i++) {
+        fprintf(out, "    void (*%s)(icsc_ptr icsc, unsigned char from, const %s_%s_t *m);\n",
+            messages[i].name, prefix, messages[i].name);
+    }
+    fprintf(out, "} %s_handlers_t;\n\n", prefix);
+
+    fprintf(out, "/* Returns 1 if the command was handled, 0 if it is not in the schema and\n"
+                 " * -1 if the payload has the wrong length. */\n");
+    fprintf(out, "static inline int %s_dispatch(icsc_ptr icsc, const %s_handlers_t *h, unsigned char from, char command, unsigned char len, const char *data) {\n",
+        prefix, prefix);
+    fprintf(out, "    switch ((uint8_t)command) {\n");
+    for (i = 0; i < nmessages; i++) {
+        upper(uname, messages[i].name);
+        fprintf(out, "        case %s_%s_COMMAND: {\n", uprefix, uname);
+        fprintf(out, "            %s_%s_t m;\n", prefix, messages[i].name);
+        fprintf(out, "            if (%s_%s_unpack(data, len, &m) < 0) {\n                return -1;\n            }\n",
+            prefix, messages[i].name);
+        fprintf(out, "            if (h->%s) {\n                h->%s(icsc, from, &m);\n            }\n",
+            messages[i].name, messages[i].name);
+        fprintf(out, "            return 1;\n        }\n");
+    }
+    fprintf(out, "    }\n    return 0;\n}\n\n");
+
+    fprintf(out, "static inline void %s_callback(icsc_ptr icsc, unsigned char from, char command, unsigned char len, char *data, void *arg) {\n",
+        prefix);
+    fprintf(out, "    %s_dispatch(icsc, (const %s_handlers_t *)arg, from, command, len, data);\n}\n\n", prefix, prefix);
+
+    fprintf(out, "/* Register a callback for every message that has a handler. The handler\n"
+                 " * table must stay valid for as long as the callbacks are registered. */\n");
+    fprintf(out, "static inline int %s_register(icsc_ptr icsc, const %s_handlers_t *h) {\n", prefix, prefix);
+    for (i = 0; i < nmessages; i++) {
+        upper(uname, messages[i].name);
+        fprintf(out, "    if (h->%s && icsc_register_command_arg(icsc, (char)%s_%s_COMMAND, %s_callback, (void *)h) < 0) {\n        return -1;\n    }\n",
+            messages[i].name, uprefix, uname, prefix);
+    }
+    fprintf(out, "    return 0;\n}\n\n");
+}
+
+static void emit(FILE *out, const char *prefix) {
+    char uprefix[MAX_NAME];
+    int i;
+
+    upper(uprefix, prefix);
+
+    fprintf(out, "/* Generated by icsc-schema from %s. Do not edit. */\n\n", filename);
+    fprintf(out, "#ifndef _%s_SCHEMA_H\n#define _%s_SCHEMA_H\n\n", uprefix, uprefix);
+    fprintf(out, "#include <stdint.h>\n#include <string.h>\n#include <icsc.h>\n\n");
+    fprintf(out, "#ifdef __cplusplus\nextern \"C\" {\n#endif\n\n");
+
+    emit_helpers(out);
+    for (i = 0; i < nmessages; i++) {
+        emit_message(out, prefix, uprefix, &messages[i]);
+    }
+    emit_dispatch(out, prefix, uprefix);
+
+    fprintf(out, "#ifdef __cplusplus\n}\n#endif\n\n#endif\n");
+}
+
+static char *read_file(const char *path) {
+    FILE *f;
+    char *buf;
+    long len;
+
+    f = fopen(path, "r");
+    if (f == NULL) {
+        fprintf(stderr, "Unable to open %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    fseek(f, 0, SEEK_END);
+    len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    buf = (char *)malloc(len + 1);
+    if (buf == NULL || fread(buf, 1, len, f) != (size_t)len) {
+        fprintf(stderr, "Unable to read %s\n", path);
+        fclose(f);
+        free(buf);
+        return NULL;
+    }
+    buf[len] = 0;
+    fclose(f);
+    return buf;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [-o <output.h>] [-p <prefix>] <schema>\n", name);
+    fprintf(stderr, "  -o  Write the header here instead of to stdout\n");
+    fprintf(stderr, "  -p  Prefix for generated names (default: the schema file name)\n");
+}
+
+int main(int argc, char **argv) {
+    const char *output = NULL;
+    char prefix[MAX_NAME] = "";
+    const char *base;
+    char *text;
+    FILE *out;
+    int opt;
+    int i;
+
+    while ((opt = getopt(argc, argv, "o:p:")) != -1) {
+        switch (opt) {
+            case 'o': output = optarg; break;
+            case 'p': snprintf(prefix, sizeof(prefix), "%s", optarg); break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    filename = argv[optind];
+    text = read_file(filename);
+    if (text == NULL) {
+        return 1;
+    }
+
+    if (prefix[0] == 0) {
+        base = strrchr(filename, '/');
+        base = base ? base + 1 : filename;
+        for (i = 0; base[i] && base[i] != '.' && i < MAX_NAME - 1; i++) {
+            prefix[i] = isalnum((unsigned char)base[i]) ? base[i] : '_';
+        }
+        prefix[i] = 0;
+    }
+
+    if (!(isalpha((unsigned char)prefix[0]) || prefix[0] == '_')) {
+        fprintf(stderr, "Prefix '%s' is not a valid C name\n", prefix);
+        return 1;
+    }
+
+    source = text;
+    parse();
+
+    if (output != NULL) {
+        out = fopen(output, "w");
+        if (out == NULL) {
+            fprintf(stderr, "Unable to create %s: %s\n", output, strerror(errno));
+            return 1;
+        }
+    } else {
+        out = stdout;
+    }
+
+    emit(out, prefix);
+
+    if (out != stdout) {
+        fclose(out);
+    }
+    free(text);
+    return 0;
+}
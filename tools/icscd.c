@@ -0,0 +1,446 @@
+/*
+ * icscd - share one ICSC bus between several local processes.
+ *
+ * The daemon owns the UART (and the RS-485 DE pin if there is one) and
+ * listens on a Unix domain socket. Clients connect with icsc_connect() and
+ * exchange ordinary ICSC frames with the daemon over the socket. Frames from
+ * the bus, and frames sent by other clients, are passed to every client
+ * whose station and command subscriptions match. Frames from a client are
+ * put on the bus whole, so frames from different clients never interleave.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "icsc.h"
+#include "icsc_private.h"
+#include "config.h"
+
+#define MAX_CLIENTS 64
+#define INPUT_SIZE (ICSC_MAX_FRAME * 2)
+#define OUTPUT_SIZE 65536
+
+#define MAP_BIT(map, n) ((map)[(n) >> 3] & (1 << ((n) & 7)))
+
+typedef struct {
+    int fd;
+    uint8_t stations[32];
+    uint8_t commands[32];
+    uint8_t in[INPUT_SIZE];
+    int inLen;
+    uint8_t out[OUTPUT_SIZE];
+    int outLen;
+    unsigned long dropped;
+} client_t;
+
+static client_t *clients[MAX_CLIENTS];
+
+static int uartFD = -1;
+static int dePin = -1;
+static int listenFD = -1;
+
+static volatile sig_atomic_t running = 1;
+
+typedef void (*frameHandler)(int source, uint8_t station, uint8_t sender, uint8_t command, uint8_t len, const uint8_t *data);
+
+static void stop(int sig) {
+    (void)sig;
+    running = 0;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "Usage: %s -d <device> [-b <baud>] [-p <de gpio>] [-s <socket>] [-m <mode>] [-f] [-v]\n", name);
+    fprintf(stderr, "  -d  Serial device that the bus is connected to\n");
+    fprintf(stderr, "  -b  Baud rate (default 115200)\n");
+    fprintf(stderr, "  -p  GPIO number of the RS-485 DE pin\n");
+    fprintf(stderr, "  -s  Socket to listen on (default %s)\n", ICSC_DAEMON_SOCKET);
+    fprintf(stderr, "  -m  Permissions of the socket in octal (default 0660)\n");
+    fprintf(stderr, "  -f  Stay in the foreground\n");
+    fprintf(stderr, "  -v  Enable debug messages\n");
+}
+
+// Pull every complete, valid frame out of buf and hand it to the handler.
+// Returns the number of bytes consumed; anything left is a partial frame.
+static int split_frames(int source, uint8_t *buf, int len, frameHandler handler) {
+    int pos = 0;
+    int i;
+    uint8_t flen;
+    uint8_t cs;
+
+    while (len - pos >= 6) {
+        if ((buf[pos] != SOH) || (buf[pos + 5] != STX)) {
+            pos++;
+            continue;
+        }
+
+        // Only control frames from a client may be addressed to their sender.
+        if ((buf[pos + 1] == buf[pos + 2]) && (source < 0)) {
+            pos++;
+            continue;
+        }
+
+        flen = buf[pos + 4];
+        if (len - pos < flen + 9) {
+            break;
+        }
+
+        cs = 0;
+        for (i = 1; i < 5; i++) {
+            cs += buf[pos + i];
+        }
+        for (i = 0; i < flen; i++) {
+            cs += buf[pos + 6 + i];
+        }
+
+        if ((buf[pos + 6 + flen] != ETX) || (buf[pos + 7 + flen] != cs) || (buf[pos + 8 + flen] != EOT)) {
+            icsc_debug("Discarding corrupt frame\n");
+            pos++;
+            continue;
+        }
+
+        handler(source, buf[pos + 1], buf[pos + 2], buf[pos + 3], flen, &buf[pos + 6]);
+        pos += flen + 9;
+    }
+
+    return pos;
+}
+
+static void client_close(int index) {
+    client_t *client = clients[index];
+
+    icsc_debug("Client %d disconnected (%lu frames dropped)\n", client->fd, client->dropped);
+    close(client->fd);
+    free(client);
+    clients[index] = NULL;
+}
+
+static int client_flush(client_t *client) {
+    ssize_t rc;
+
+    if (client->outLen == 0) {
+        return 0;
+    }
+
+    rc = send(client->fd, client->out, client->outLen, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (rc < 0) {
+        if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) {
+            return 0;
+        }
+        return -1;
+    }
+
+    memmove(client->out, client->out + rc, client->outLen - rc);
+    client->outLen -= rc;
+    return 0;
+}
+
+// Queue a frame for a client. A client that does not keep up loses whole
+// frames rather than holding up the bus or the other clients.
+static void client_queue(client_t *client, const uint8_t *frame, int len) {
+    if (client->outLen + len > OUTPUT_SIZE) {
+        client->dropped++;
+        return;
+    }
+    memcpy(client->out + client->outLen, frame, len);
+    client->outLen += len;
+    client_flush(client);
+}
+
+static void deliver(int source, uint8_t station, uint8_t sender, uint8_t command, uint8_t len, const uint8_t *data) {
+    uint8_t frame[ICSC_MAX_FRAME];
+    int flen = 0;
+    int i;
+
+    for (i = 0; i < MAX_CLIENTS; i++) {
+        if ((clients[i] == NULL) || (i == source)) {
+            continue;
+        }
+        if (!MAP_BIT(clients[i]->stations, station) || !MAP_BIT(clients[i]->commands, command)) {
+            continue;
+        }
+        if (flen == 0) {
+            flen = icsc_build_frame(frame, sender, station, command, len, (const char *)data);
+        }
+        client_queue(clients[i], frame, flen);
+    }
+}
+
+static void bus_frame(int source, uint8_t station, uint8_t sender, uint8_t command, uint8_t len, const uint8_t *data) {
+    icsc_debug("Bus frame from %d to %d command 0x%02x\n", sender, station, command);
+    deliver(source, station, sender, command, len, data);
+}
+
+static void client_frame(int source, uint8_t station, uint8_t sender, uint8_t command, uint8_t len, const uint8_t *data) {
+    uint8_t frame[ICSC_MAX_FRAME];
+    client_t *client = clients[source];
+    int flen;
+
+    if (station == sender) {
+        if ((command == ICSC_CMD_SYS) && (len == ICSC_DAEMON_FILTER_LEN)) {
+            if (data[0] & ICSC_DAEMON_FILTER_STATIONS) {
+                memcpy(client->stations, &data[1], 32);
+            }
+            if (data[0] & ICSC_DAEMON_FILTER_COMMANDS) {
+                memcpy(client->commands, &data[33], 32);
+            }
+            icsc_debug("Client %d updated its subscriptions\n", client->fd);
+        }
+        return;
+    }
+
+    flen = icsc_build_frame(frame, sender, station, command, len, (const char *)data);
+
+    if (dePin >= 0) {
+        icsc_gpio_write(dePin, 1);
+    }
+    icsc_serial_write_array(uartFD, frame, flen);
+    icsc_serial_flush(uartFD);
+    if (dePin >= 0) {
+        icsc_gpio_write(dePin, 0);
+    }
+
+    deliver(source, station, sender, command, len, data);
+}
+
+static void client_accept() {
+    int fd;
+    int i;
+
+    fd = accept(listenFD, NULL, NULL);
+    if (fd < 0) {
+        icsc_error("Unable to accept client: %s\n", strerror(errno));
+        return;
+    }
+
+    for (i = 0; i < MAX_CLIENTS; i++) {
+        if (clients[i] == NULL) {
+            break;
+        }
+    }
+
+    if (i == MAX_CLIENTS) {
+        icsc_error("Too many clients\n");
+        close(fd);
+        return;
+    }
+
+    clients[i] = (client_t *)calloc(1, sizeof(client_t));
+    if (clients[i] == NULL) {
+        icsc_error("Cannot allocate client: %s\n", strerror(errno));
+        close(fd);
+        return;
+    }
+    clients[i]->fd = fd;
+
+    icsc_debug("Client %d connected\n", fd);
+}
+
+static int client_read(int index) {
+    client_t *client = clients[index];
+    ssize_t rc;
+    int used;
+
+    rc = read(client->fd, client->in + client->inLen, INPUT_SIZE - client->inLen);
+    if (rc <= 0) {
+        return -1;
+    }
+    client->inLen += rc;
+
+    used = split_frames(index, client->in, client->inLen, client_frame);
+    memmove(client->in, client->in + used, client->inLen - used);
+    client->inLen -= used;
+    return 0;
+}
+
+static int listen_socket(const char *path, mode_t mode) {
+    struct sockaddr_un addr;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        icsc_error("Socket path %s is too long\n", path);
+        return -1;
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        icsc_error("Unable to create socket: %s\n", strerror(errno));
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        icsc_error("Unable to bind to %s: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    chmod(path, mode);
+
+    if (listen(fd, 8) < 0) {
+        icsc_error("Unable to listen on %s: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+int main(int argc, char **argv) {
+    const char *device = NULL;
+    const char *path = ICSC_DAEMON_SOCKET;
+    unsigned long baud = 115200;
+    mode_t mode = 0660;
+    int foreground = 0;
+    struct pollfd fds[MAX_CLIENTS + 2];
+    int owner[MAX_CLIENTS + 2];
+    uint8_t uartIn[INPUT_SIZE];
+    int uartLen = 0;
+    int nfds;
+    int used;
+    int opt;
+    int i;
+    int status = 0;
+    ssize_t rc;
+
+    while ((opt = getopt(argc, argv, "d:b:p:s:m:fv")) != -1) {
+        switch (opt) {
+            case 'd': device = optarg; break;
+            case 'b': baud = strtoul(optarg, NULL, 10); break;
+            case 'p': dePin = atoi(optarg); break;
+            case 's': path = optarg; break;
+            case 'm': mode = strtoul(optarg, NULL, 8); break;
+            case 'f': foreground = 1; break;
+            case 'v': icsc_enable_debug(); break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (device == NULL) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (icsc_serial_baud_symbol(baud) == 0) {
+        icsc_error("Unsupported baud rate %lu\n", baud);
+        return 1;
+    }
+
+    uartFD = icsc_serial_open(device, icsc_serial_baud_symbol(baud));
+    if (uartFD < 0) {
+        return 1;
+    }
+
+    if (dePin >= 0) {
+        if ((icsc_gpio_open(dePin, ICSC_GPIO_OUTPUT) < 0) || (icsc_gpio_write(dePin, 0) < 0)) {
+            return 1;
+        }
+    }
+
+    listenFD = listen_socket(path, mode);
+    if (listenFD < 0) {
+        return 1;
+    }
+
+    if (!foreground && (daemon(0, 0) < 0)) {
+        icsc_error("Unable to detach: %s\n", strerror(errno));
+        return 1;
+    }
+
+    signal(SIGINT, stop);
+    signal(SIGTERM, stop);
+    signal(SIGPIPE, SIG_IGN);
+
+    while (running) {
+        fds[0].fd = listenFD;
+        fds[0].events = POLLIN;
+        owner[0] = -1;
+        fds[1].fd = uartFD;
+        fds[1].events = POLLIN;
+        owner[1] = -1;
+        nfds = 2;
+
+        for (i = 0; i < MAX_CLIENTS; i++) {
+            if (clients[i] == NULL) {
+                continue;
+            }
+            fds[nfds].fd = clients[i]->fd;
+            fds[nfds].events = POLLIN | (clients[i]->outLen > 0 ? POLLOUT : 0);
+            owner[nfds] = i;
+            nfds++;
+        }
+
+        if (poll(fds, nfds, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            icsc_error("Poll failed: %s\n", strerror(errno));
+            break;
+        }
+
+        if (fds[1].revents & POLLIN) {
+            rc = read(uartFD, uartIn + uartLen, INPUT_SIZE - uartLen);
+            if (rc > 0) {
+                uartLen += rc;
+                used = split_frames(-1, uartIn, uartLen, bus_frame);
+                memmove(uartIn, uartIn + used, uartLen - used);
+                uartLen -= used;
+            } else if (rc == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+                // An unplugged USB adapter reads as EOF or EIO for ever.
+                icsc_error("Lost %s: %s\n", device, rc == 0 ? "end of file" : strerror(errno));
+                status = 1;
+                break;
+            }
+        } else if (fds[1].revents & (POLLHUP | POLLERR | POLLNVAL)) {
+            icsc_error("Lost %s\n", device);
+            status = 1;
+            break;
+        }
+
+        for (i = 2; i < nfds; i++) {
+            if (clients[owner[i]] == NULL) {
+                continue;
+            }
+            if ((fds[i].revents & POLLOUT) && (client_flush(clients[owner[i]]) < 0)) {
+                client_close(owner[i]);
+                continue;
+            }
+            if ((fds[i].revents & (POLLIN | POLLHUP | POLLERR)) && (client_read(owner[i]) < 0)) {
+                client_close(owner[i]);
+            }
+        }
+
+        if (fds[0].revents & POLLIN) {
+            client_accept();
+        }
+    }
+
+    for (i = 0; i < MAX_CLIENTS; i++) {
+        if (clients[i] != NULL) {
+            client_close(i);
+        }
+    }
+
+    close(listenFD);
+    unlink(path);
+
+    if (dePin >= 0) {
+        icsc_gpio_close(dePin);
+    }
+    icsc_serial_close(uartFD);
+
+    return status;
+}